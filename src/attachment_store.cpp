@@ -0,0 +1,207 @@
+#include "prospect.h"
+#include "misc.h"
+#include "sha256.h"
+#include <fstream>
+#include <atomic>
+#include <optional>
+
+using namespace std;
+
+namespace prospect {
+
+// What we know about an attachment before downloading it. Two attachments that
+// agree on all three are taken to have the same content.
+static string hint_key(const attachment& att) {
+    return format("{} {} {}", att.size, att.modified, att.name);
+}
+
+class attachment_store::impl {
+public:
+    impl(const filesystem::path& dir) : dir(dir) {
+        filesystem::create_directories(dir / "objects");
+
+        index_fn = dir / "index";
+
+        load_index();
+
+        index.open(index_fn, ios::binary | ios::app);
+
+        if (!index.good())
+            throw formatted_error("Could not open {}.", index_fn.string());
+    }
+
+    // Lines are "hash size modified name", with the name running to the end of
+    // the line. A torn last line is just ignored.
+    void load_index() {
+        ifstream f(index_fn, ios::binary);
+        string line;
+
+        while (getline(f, line)) {
+            auto sp = line.find(' ');
+
+            if (sp != 64 || line.length() <= sp + 1)
+                continue;
+
+            hints.insert_or_assign(line.substr(sp + 1), line.substr(0, sp));
+        }
+    }
+
+    filesystem::path object_path(string_view hash) const {
+        return dir / "objects" / hash.substr(0, 2) / hash.substr(2);
+    }
+
+    // returns the hash, if we've seen something like att before and still have it
+    optional<string> lookup(const attachment& att) {
+        string hash;
+
+        {
+            lock_guard lg(lock);
+
+            auto it = hints.find(hint_key(att));
+
+            if (it == hints.end())
+                return nullopt;
+
+            hash = it->second;
+        }
+
+        if (!filesystem::exists(object_path(hash)))
+            return nullopt;
+
+        return hash;
+    }
+
+    // Writes the content under its hash, unless we've already got it, and
+    // remembers the hint that led to it.
+    string store(const attachment& att, string_view data) {
+        auto hash = sha256_hex(data);
+        auto fn = object_path(hash);
+
+        if (filesystem::exists(fn))
+            bytes_saved += data.length();
+        else {
+            filesystem::create_directories(fn.parent_path());
+
+            // another thread may be writing the same object, so the temporary name needs to be unique
+            auto tmp_fn = fn;
+
+            tmp_fn += format(".{}.tmp", tmp_counter++);
+
+            {
+                ofstream f(tmp_fn, ios::binary | ios::trunc);
+
+                if (!f.good())
+                    throw formatted_error("Could not open {} for writing.", tmp_fn.string());
+
+                f.write(data.data(), (streamsize)data.length());
+
+                if (!f.good())
+                    throw formatted_error("Error writing to {}.", tmp_fn.string());
+            }
+
+            filesystem::rename(tmp_fn, fn);
+            stored++;
+            bytes_stored += data.length();
+        }
+
+        auto key = hint_key(att);
+
+        // names with line breaks would spoil the index, so we don't remember those
+        if (key.find_first_of("\r\n") != string::npos)
+            return hash;
+
+        lock_guard lg(lock);
+
+        auto [it, inserted] = hints.try_emplace(key, hash);
+
+        if (!inserted) {
+            if (it->second == hash)
+                return hash;
+
+            it->second = hash;
+        }
+
+        index << hash << ' ' << key << '\n';
+        index.flush();
+
+        return hash;
+    }
+
+    filesystem::path dir, index_fn;
+    mutex lock;
+    unordered_map<string, string> hints;
+    ofstream index;
+    atomic<uint64_t> tmp_counter = 0;
+    atomic<uint64_t> downloaded = 0, deduplicated = 0, stored = 0, bytes_stored = 0, bytes_saved = 0;
+};
+
+attachment_store::attachment_store(prospect& p, const filesystem::path& dir) : p(p) {
+    state = make_unique<impl>(dir);
+}
+
+attachment_store::~attachment_store() = default;
+
+vector<string> attachment_store::fetch(span<const attachment> atts) {
+    vector<string> hashes(atts.size());
+    vector<attachment> wanted;
+    unordered_map<string, vector<size_t>> waiting; // hint to indices into atts
+    unordered_map<string, string> id_to_hint;
+
+    for (size_t i = 0; i < atts.size(); i++) {
+        const auto& att = atts[i];
+
+        if (auto hash = state->lookup(att)) {
+            hashes[i] = move(*hash);
+            state->deduplicated++;
+            state->bytes_saved += att.size;
+            continue;
+        }
+
+        // the same attachment twice in one call only needs downloading once
+        auto key = hint_key(att);
+        auto [it, inserted] = waiting.try_emplace(key);
+
+        it->second.push_back(i);
+
+        if (inserted) {
+            wanted.push_back(att);
+            id_to_hint.emplace(att.id, key);
+        } else {
+            state->deduplicated++;
+            state->bytes_saved += att.size;
+        }
+    }
+
+    if (wanted.empty())
+        return hashes;
+
+    p.read_attachments(wanted, [&](const attachment& att, string_view data) {
+        state->downloaded++;
+
+        auto hash = state->store(att, data);
+
+        for (auto i : waiting.at(id_to_hint.at(att.id))) {
+            hashes[i] = hash;
+        }
+    });
+
+    return hashes;
+}
+
+filesystem::path attachment_store::path(string_view hash) const {
+    return state->object_path(hash);
+}
+
+store_stats attachment_store::stats() const {
+    store_stats s;
+
+    s.downloaded = state->downloaded;
+    s.deduplicated = state->deduplicated;
+    s.stored = state->stored;
+    s.bytes_stored = state->bytes_stored;
+    s.bytes_saved = state->bytes_saved;
+
+    return s;
+}
+
+}
@@ -10,6 +10,7 @@
 // instead of a buffer allocated with malloc.
 
 #include <string>
+#include "b64.h"
 
 static const unsigned char base64_table[65] =
 "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
@@ -103,3 +104,35 @@ std::string b64decode(std::string_view sv) {
 
 	return str;
 }
+
+// Incremental version of b64decode, for content that arrives in pieces - keeps
+// back any partial group of four until the next call. Whitespace is skipped.
+std::string b64_decoder::decode(std::string_view sv) {
+	std::string str;
+
+	str.reserve((sv.length() + quad_len) / 4 * 3);
+
+	for (auto c : sv) {
+		if (c == ' ' || c == '\t' || c == '\r' || c == '\n')
+			continue;
+
+		quad[quad_len++] = (unsigned char)c;
+
+		if (quad_len < 4)
+			continue;
+
+		int n = B64index[quad[0]] << 18 | B64index[quad[1]] << 12 | B64index[quad[2]] << 6 | B64index[quad[3]];
+
+		str.push_back((char)(n >> 16));
+
+		if (quad[2] != '=')
+			str.push_back((char)(n >> 8 & 0xFF));
+
+		if (quad[3] != '=')
+			str.push_back((char)(n & 0xFF));
+
+		quad_len = 0;
+	}
+
+	return str;
+}
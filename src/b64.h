@@ -4,3 +4,12 @@
 
 std::string b64encode(std::string_view sv);
 std::string b64decode(std::string_view sv);
+
+class b64_decoder {
+public:
+    std::string decode(std::string_view sv);
+
+private:
+    unsigned char quad[4];
+    size_t quad_len = 0;
+};
@@ -0,0 +1,217 @@
+#include "prospect.h"
+#include <mutex>
+#include <unordered_map>
+#include <optional>
+
+using namespace std;
+
+namespace prospect {
+
+struct pending_item {
+    bool created = false;
+    bool deleted = false;
+};
+
+class event_coalescer::impl {
+public:
+    impl(batch_func func, const item_shape& shape, chrono::milliseconds window, size_t max_events) :
+         func(move(func)), shape(shape), window(window), max_events(max(max_events, (size_t)1)) {
+    }
+
+    // returns true if it's time to flush
+    bool push(const notification& n) {
+        if (n.item_id.empty())
+            return false;
+
+        lock_guard lg(lock);
+
+        auto [it, inserted] = items.try_emplace(n.item_id);
+
+        if (inserted)
+            order.push_back(n.item_id);
+
+        auto& p = it->second;
+
+        switch (n.type) {
+            case event::new_mail:
+            case event::created:
+                p.created = true;
+                p.deleted = false;
+                break;
+
+            case event::deleted:
+                p.deleted = true;
+                break;
+
+            case event::modified:
+            case event::moved:
+            case event::copied:
+                p.deleted = false;
+                break;
+
+            default:
+                break;
+        }
+
+        if (!oldest)
+            oldest = chrono::steady_clock::now();
+
+        num_events++;
+
+        return num_events >= max_events;
+    }
+
+    bool due() {
+        lock_guard lg(lock);
+
+        return oldest && chrono::steady_clock::now() - *oldest >= window;
+    }
+
+    void flush(prospect& p) {
+        // only one flush at a time, so that batches are delivered in order
+        lock_guard flg(flush_lock);
+        vector<string> fetch, deleted;
+        unordered_map<string, pending_item> taken_items;
+        vector<string> taken_order;
+        optional<chrono::steady_clock::time_point> taken_oldest;
+        size_t taken_events;
+
+        {
+            lock_guard lg(lock);
+
+            taken_items.swap(items);
+            taken_order.swap(order);
+            taken_oldest = exchange(oldest, nullopt);
+            taken_events = exchange(num_events, 0);
+        }
+
+        for (const auto& id : taken_order) {
+            const auto& pi = taken_items.at(id);
+
+            if (!pi.deleted)
+                fetch.emplace_back(id);
+            else if (!pi.created)
+                deleted.emplace_back(id);
+        }
+
+        if (fetch.empty() && deleted.empty())
+            return;
+
+        vector<mail_item> found;
+
+        if (!fetch.empty()) {
+            unordered_map<string_view, size_t> wanted;
+
+            for (size_t i = 0; i < fetch.size(); i++) {
+                wanted.emplace(fetch[i], i);
+            }
+
+            vector<bool> seen(fetch.size());
+
+            try {
+                p.get_items(fetch, [&](const mail_item& item) {
+                    auto it = wanted.find(item.id);
+
+                    if (it != wanted.end())
+                        seen[it->second] = true;
+
+                    found.emplace_back(item);
+
+                    return true;
+                }, shape);
+            } catch (...) {
+                restore(move(taken_items), move(taken_order), taken_oldest, taken_events);
+                throw;
+            }
+
+            // gone before we could get to it
+            for (size_t i = 0; i < fetch.size(); i++) {
+                if (!seen[i])
+                    deleted.emplace_back(move(fetch[i]));
+            }
+        }
+
+        func(found, deleted);
+    }
+
+    // Puts back what a failed flush took, so that the next flush tries again.
+    // Anything that's come in since is newer, so it wins where they overlap.
+    void restore(unordered_map<string, pending_item> taken_items, vector<string> taken_order,
+                 optional<chrono::steady_clock::time_point> taken_oldest, size_t taken_events) {
+        lock_guard lg(lock);
+
+        for (auto& [id, pi] : items) {
+            auto it = taken_items.find(id);
+
+            if (it != taken_items.end()) {
+                pi.created = pi.created || it->second.created;
+                it->second = pi;
+            } else {
+                taken_items.emplace(id, pi);
+                taken_order.push_back(id);
+            }
+        }
+
+        items.swap(taken_items);
+        order.swap(taken_order);
+
+        if (taken_oldest && (!oldest || *taken_oldest < *oldest))
+            oldest = taken_oldest;
+
+        num_events += taken_events;
+    }
+
+    batch_func func;
+    item_shape shape;
+    chrono::milliseconds window;
+    size_t max_events;
+    mutex lock, flush_lock;
+    unordered_map<string, pending_item> items;
+    vector<string> order;
+    optional<chrono::steady_clock::time_point> oldest;
+    size_t num_events = 0;
+};
+
+event_coalescer::event_coalescer(prospect& p, batch_func func, const item_shape& shape, chrono::milliseconds window,
+                                 size_t max_events) : p(p) {
+    state = make_unique<impl>(move(func), shape, window, max_events);
+}
+
+event_coalescer::~event_coalescer() = default;
+
+void event_coalescer::push(const notification& n) {
+    if (state->push(n))
+        state->flush(p);
+}
+
+void event_coalescer::poll() {
+    if (state->due())
+        state->flush(p);
+}
+
+void event_coalescer::flush() {
+    state->flush(p);
+}
+
+// Feeds events from runner into the coalescer for duration, flushing as it goes.
+// Anything left over stays pending until the next call.
+void event_coalescer::consume(subscription_runner& runner, chrono::milliseconds duration) {
+    auto end = chrono::steady_clock::now() + duration;
+    auto tick = max(state->window / 4, chrono::milliseconds(1));
+
+    while (true) {
+        auto now = chrono::steady_clock::now();
+
+        if (now >= end)
+            break;
+
+        notification n;
+
+        if (runner.pop(n, min(tick, chrono::duration_cast<chrono::milliseconds>(end - now))))
+            push(n);
+
+        poll();
+    }
+}
+
+}
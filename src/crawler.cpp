@@ -0,0 +1,392 @@
+#include "prospect.h"
+#include "misc.h"
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <semaphore>
+#include <atomic>
+#include <memory>
+#include <optional>
+#include <fstream>
+#include <set>
+#include <algorithm>
+
+using namespace std;
+
+namespace prospect {
+
+// Each worker has its own deque of tasks. New tasks go on the back of the
+// current worker's deque and are taken from the back, so a worker finishes
+// what it started before moving on; idle workers steal from the front of the
+// others' deques.
+class work_stealing_pool {
+public:
+    work_stealing_pool(unsigned int num_threads) {
+        num_threads = max(num_threads, 1u);
+
+        for (unsigned int i = 0; i < num_threads; i++) {
+            queues.emplace_back(make_unique<worker_queue>());
+        }
+
+        for (unsigned int i = 0; i < num_threads; i++) {
+            threads.emplace_back([this, i]() {
+                run(i);
+            });
+        }
+    }
+
+    ~work_stealing_pool() {
+        failed = true;
+
+        {
+            lock_guard lg(idle_lock);
+            stopping = true;
+        }
+
+        idle_cv.notify_all();
+
+        for (auto& t : threads) {
+            t.join();
+        }
+    }
+
+    void push(function<void()>&& task) {
+        size_t idx = current_pool == this ? current_index : (next_queue++ % queues.size());
+
+        pending++;
+
+        // counted before it's visible, so that a worker taking it straight away
+        // can't bring queued below zero
+        {
+            lock_guard lg(idle_lock);
+            queued++;
+        }
+
+        {
+            lock_guard lg(queues[idx]->lock);
+            queues[idx]->tasks.push_back(move(task));
+        }
+
+        idle_cv.notify_one();
+    }
+
+    void wait() {
+        unique_lock ul(done_lock);
+
+        done_cv.wait(ul, [&]() { return pending == 0; });
+
+        if (error)
+            rethrow_exception(error);
+    }
+
+private:
+    struct worker_queue {
+        mutex lock;
+        deque<function<void()>> tasks;
+    };
+
+    bool pop(size_t idx, function<void()>& task) {
+        {
+            auto& q = *queues[idx];
+            lock_guard lg(q.lock);
+
+            if (!q.tasks.empty()) {
+                task = move(q.tasks.back());
+                q.tasks.pop_back();
+                return true;
+            }
+        }
+
+        for (size_t i = 1; i < queues.size(); i++) {
+            auto& q = *queues[(idx + i) % queues.size()];
+            lock_guard lg(q.lock);
+
+            if (!q.tasks.empty()) {
+                task = move(q.tasks.front());
+                q.tasks.pop_front();
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    void run(size_t idx) {
+        current_pool = this;
+        current_index = idx;
+
+        while (true) {
+            function<void()> task;
+
+            if (!pop(idx, task)) {
+                unique_lock ul(idle_lock);
+
+                idle_cv.wait(ul, [&]() { return queued > 0 || stopping; });
+
+                if (stopping)
+                    return;
+
+                continue;
+            }
+
+            queued--;
+
+            // once something has failed, drain the remaining tasks without running them
+            if (!failed) {
+                try {
+                    task();
+                } catch (...) {
+                    lock_guard lg(done_lock);
+
+                    if (!error)
+                        error = current_exception();
+
+                    failed = true;
+                }
+            }
+
+            task = nullptr;
+
+            if (--pending == 0) {
+                lock_guard lg(done_lock);
+                done_cv.notify_all();
+            }
+        }
+    }
+
+    vector<unique_ptr<worker_queue>> queues;
+    vector<thread> threads;
+    atomic<size_t> next_queue = 0;
+    atomic<size_t> pending = 0;
+    atomic<size_t> queued = 0;
+    atomic<bool> failed = false;
+    mutex idle_lock;
+    condition_variable idle_cv;
+    bool stopping = false;
+    mutex done_lock;
+    condition_variable done_cv;
+    exception_ptr error;
+
+    static thread_local work_stealing_pool* current_pool;
+    static thread_local size_t current_index;
+};
+
+thread_local work_stealing_pool* work_stealing_pool::current_pool = nullptr;
+thread_local size_t work_stealing_pool::current_index = 0;
+
+class limiter {
+public:
+    limiter(unsigned int n) : sem(max(n, 1u)) {
+    }
+
+    counting_semaphore<> sem;
+};
+
+class limit_guard {
+public:
+    limit_guard(limiter& stage, limiter& global) : stage(stage), global(global) {
+        stage.sem.acquire();
+        global.sem.acquire();
+    }
+
+    ~limit_guard() {
+        global.sem.release();
+        stage.sem.release();
+    }
+
+private:
+    limiter& stage;
+    limiter& global;
+};
+
+// The checkpoint file is a log of lines "F <folder ID>" and "I <item ID>",
+// written once a folder or item has been completely dealt with.
+class checkpoint_log {
+public:
+    checkpoint_log(const filesystem::path& fn) {
+        if (fn.empty())
+            return;
+
+        {
+            ifstream in(fn);
+            string line;
+
+            while (getline(in, line)) {
+                if (line.length() < 3 || line[1] != ' ')
+                    continue;
+
+                if (line[0] == 'F')
+                    folders.insert(line.substr(2));
+                else if (line[0] == 'I')
+                    items.insert(line.substr(2));
+            }
+        }
+
+        out.open(fn, ios::app);
+
+        if (!out.good())
+            throw formatted_error("Could not open checkpoint file {}.", fn.string());
+    }
+
+    bool folder_done(const string& id) const {
+        return folders.count(id) != 0;
+    }
+
+    bool item_done(const string& id) const {
+        return items.count(id) != 0;
+    }
+
+    void record(char type, string_view id) {
+        if (!out.is_open())
+            return;
+
+        lock_guard lg(lock);
+
+        out << type << ' ' << id << '\n';
+        out.flush();
+    }
+
+private:
+    set<string> folders, items;
+    ofstream out;
+    mutex lock;
+};
+
+struct folder_state {
+    folder_state(string_view id) : id(id) {
+    }
+
+    string id;
+    atomic<size_t> pending = 1; // the enumeration itself
+    atomic<bool> incomplete = false; // something will need fetching again on resume
+};
+
+class crawl_job {
+public:
+    crawl_job(crawler& c) : c(c), shape(c.shape), global(c.max_in_flight), folder_limit(c.max_folder_tasks),
+                            item_limit(c.max_item_tasks), attachment_limit(c.max_attachment_tasks), log(c.checkpoint),
+                            pool(c.threads) {
+        // we need to know which items have attachments, whatever the caller asked for
+        if (c.fetch_attachments)
+            shape.fields = shape.fields | item_field::has_attachments;
+    }
+
+    void run(string_view mailbox) {
+        auto folders = c.p.find_folders(mailbox);
+
+        for (const auto& f : folders) {
+            if (log.folder_done(f.id))
+                continue;
+
+            if (c.on_folder && !c.on_folder(f))
+                continue;
+
+            auto state = make_shared<folder_state>(f.id);
+
+            pool.push([this, state]() {
+                enumerate(state);
+            });
+        }
+
+        pool.wait();
+    }
+
+private:
+    void folder_task_done(const shared_ptr<folder_state>& state) {
+        if (--state->pending == 0 && !state->incomplete)
+            log.record('F', state->id);
+    }
+
+    void enumerate(const shared_ptr<folder_state>& state) {
+        {
+            limit_guard lg(folder_limit, global);
+
+            // we only need the IDs and ChangeKeys here, the item tasks get the rest
+            c.p.find_items(state->id, [&](const mail_item& item) {
+                if (log.item_done(item.id))
+                    return true;
+
+                state->pending++;
+
+                pool.push([this, state, id = item.id, change_key = item.change_key]() {
+                    fetch_item(state, id, change_key);
+                });
+
+                return true;
+            }, item_shape(item_field{}));
+        }
+
+        folder_task_done(state);
+    }
+
+    void fetch_item(const shared_ptr<folder_state>& state, const string& id, const string& change_key) {
+        optional<mail_item> found;
+
+        {
+            limit_guard lg(item_limit, global);
+
+            // passing the ChangeKey saves an IdOnly GetItem when there's a cache
+            c.p.get_item(id, change_key, [&](const mail_item& item) {
+                found.emplace(item);
+
+                return false;
+            }, shape);
+        }
+
+        if (found) {
+            if (c.on_item)
+                c.on_item(*found);
+
+            if (c.fetch_attachments && found->has_attachments) {
+                pool.push([this, state, item = move(*found)]() {
+                    fetch_attachments(state, item);
+                });
+
+                return;
+            }
+        }
+
+        log.record('I', id);
+        folder_task_done(state);
+    }
+
+    void fetch_attachments(const shared_ptr<folder_state>& state, const mail_item& item) {
+        bool complete;
+
+        {
+            limit_guard lg(attachment_limit, global);
+
+            auto atts = c.p.get_attachments(item.id);
+
+            auto results = c.p.read_attachments(atts, [&](const attachment& att, string_view content) {
+                if (c.on_attachment)
+                    c.on_attachment(item, att, content);
+            });
+
+            complete = ranges::all_of(results, [](const item_result& r) { return r.success(); });
+        }
+
+        // leave it and its folder out of the checkpoint, so that a resumed crawl tries it again
+        if (complete)
+            log.record('I', item.id);
+        else
+            state->incomplete = true;
+
+        folder_task_done(state);
+    }
+
+    crawler& c;
+    item_shape shape;
+    limiter global, folder_limit, item_limit, attachment_limit;
+    checkpoint_log log;
+    work_stealing_pool pool; // last, so that the workers are joined before anything else goes away
+};
+
+void crawler::crawl(string_view mailbox) {
+    crawl_job job(*this);
+
+    job.run(mailbox);
+}
+
+}
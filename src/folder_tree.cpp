@@ -0,0 +1,185 @@
+#include "prospect.h"
+
+using namespace std;
+
+namespace prospect {
+
+size_t folder_tree::name_key_hash::operator()(const name_key& k) const noexcept {
+    auto h1 = hash<string_view>{}(k.parent);
+    auto h2 = hash<string_view>{}(k.name);
+
+    return h1 ^ (h2 + 0x9e3779b9 + (h1 << 6) + (h1 >> 2));
+}
+
+folder_tree::folder_tree(pmr::memory_resource* mr) : folders(mr), by_id(mr), by_name(mr), by_parent(mr) {
+}
+
+folder_tree::folder_tree(const folder_tree& t) {
+    for (const auto& f : t.folders) {
+        insert(f);
+    }
+}
+
+folder_tree& folder_tree::operator=(const folder_tree& t) {
+    if (this != &t) {
+        folder_tree copy(t);
+
+        *this = move(copy);
+    }
+
+    return *this;
+}
+
+folder_tree& folder_tree::operator=(folder_tree&& t) {
+    if (this == &t)
+        return *this;
+
+    // The indexes hold iterators and views into t's list, which are only still
+    // good here if the nodes themselves come across. pmr containers keep their
+    // own resource on assignment, so that means the resources have to match.
+    if (folders.get_allocator() == t.folders.get_allocator()) {
+        folders = move(t.folders);
+        by_id = move(t.by_id);
+        by_name = move(t.by_name);
+        by_parent = move(t.by_parent);
+    } else {
+        by_id.clear();
+        by_name.clear();
+        by_parent.clear();
+        folders.clear();
+
+        for (auto& f : t.folders) {
+            insert(move(f));
+        }
+    }
+
+    t.by_id.clear();
+    t.by_name.clear();
+    t.by_parent.clear();
+    t.folders.clear();
+
+    return *this;
+}
+
+const folder* folder_tree::find(string_view id) const {
+    auto it = by_id.find(id);
+
+    if (it == by_id.end())
+        return nullptr;
+
+    return &*it->second;
+}
+
+const folder* folder_tree::find(string_view parent, string_view name) const {
+    auto it = by_name.find(name_key{parent, name});
+
+    if (it == by_name.end())
+        return nullptr;
+
+    return &*it->second;
+}
+
+string_view folder_tree::root_id() const {
+    if (folders.empty())
+        return "";
+
+    auto f = &folders.front();
+
+    // bounded, in case the server ever gives us a loop
+    for (size_t i = 0; i < folders.size(); i++) {
+        auto p = find(f->parent);
+
+        if (!p)
+            return f->parent;
+
+        f = p;
+    }
+
+    return "";
+}
+
+const folder* folder_tree::find_path(string_view path, string_view root) const {
+    const folder* f = nullptr;
+    bool from_root = root.empty();
+    string_view parent = from_root ? root_id() : root;
+
+    while (!path.empty()) {
+        auto pos = path.find('/');
+        auto name = path.substr(0, pos);
+
+        path = pos == string_view::npos ? "" : path.substr(pos + 1);
+
+        if (name.empty())
+            continue;
+
+        f = find(parent, name);
+
+        // Inbox etc. live in the IPM subtree, one level below the root, so also
+        // allow paths like "Inbox/Juno" without having to name that folder
+        if (!f && from_root) {
+            auto [b, e] = by_parent.equal_range(parent);
+
+            for (auto it = b; it != e; it++) {
+                f = find(it->second->id, name);
+
+                if (f)
+                    break;
+            }
+        }
+
+        if (!f)
+            return nullptr;
+
+        parent = f->id;
+        from_root = false;
+    }
+
+    return f;
+}
+
+const folder& folder_tree::insert(folder f) {
+    erase(f.id);
+
+    auto it = folders.insert(folders.end(), move(f));
+
+    by_id.emplace(it->id, it);
+
+    // keys must point into the new entry, so don't reuse any existing node
+    by_name.erase(name_key{it->parent, it->display_name});
+    by_name.emplace(name_key{it->parent, it->display_name}, it);
+
+    by_parent.emplace(it->parent, it);
+
+    return *it;
+}
+
+bool folder_tree::erase(string_view id) {
+    auto it = by_id.find(id);
+
+    if (it == by_id.end())
+        return false;
+
+    auto f = it->second;
+
+    by_id.erase(it);
+
+    auto n = by_name.find(name_key{f->parent, f->display_name});
+
+    if (n != by_name.end() && n->second == f)
+        by_name.erase(n);
+
+    auto [b, e] = by_parent.equal_range(f->parent);
+
+    for (auto p = b; p != e; p++) {
+        if (p->second == f) {
+            by_parent.erase(p);
+            break;
+        }
+    }
+
+    folders.erase(f);
+
+    return true;
+}
+
+}
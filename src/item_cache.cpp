@@ -0,0 +1,825 @@
+#include "prospect.h"
+#include "misc.h"
+#include <string.h>
+#include <fstream>
+#include <algorithm>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <errno.h>
+#endif
+
+using namespace std;
+
+namespace prospect {
+
+static const uint32_t record_magic = 0x43495250; // "PRIC"
+static const uint64_t index_magic = 0x3158444943495250; // "PRICIDX1"
+static const uint64_t initial_capacity = 1024;
+
+struct index_header {
+    uint64_t magic;
+    uint64_t capacity;
+    uint64_t count;
+    uint64_t tombstones;
+    uint64_t log_size; // everything in the log beyond this was never committed
+    uint64_t live_bytes;
+};
+
+enum class slot_state : uint32_t {
+    empty = 0,
+    used,
+    deleted
+};
+
+struct index_slot {
+    uint64_t hash;
+    uint64_t offset;
+    uint32_t length;
+    slot_state state;
+};
+
+static uint64_t hash_id(string_view id) {
+    // FNV-1a
+    uint64_t h = 0xcbf29ce484222325;
+
+    for (auto c : id) {
+        h ^= (uint8_t)c;
+        h *= 0x100000001b3;
+    }
+
+    return h;
+}
+
+class mapped_file {
+public:
+    mapped_file(const filesystem::path& fn) {
+#ifdef _WIN32
+        file = CreateFileW((WCHAR*)fn.u16string().c_str(), GENERIC_READ | GENERIC_WRITE, 0, nullptr, OPEN_ALWAYS,
+                           FILE_ATTRIBUTE_NORMAL, nullptr);
+
+        if (file == INVALID_HANDLE_VALUE)
+            throw last_error("CreateFile", GetLastError());
+
+        LARGE_INTEGER li;
+
+        if (!GetFileSizeEx(file, &li)) {
+            auto le = GetLastError();
+            CloseHandle(file);
+            throw last_error("GetFileSizeEx", le);
+        }
+
+        len = (size_t)li.QuadPart;
+#else
+        fd = open(fn.c_str(), O_RDWR | O_CREAT, 0644);
+
+        if (fd < 0)
+            throw formatted_error("Could not open {} (errno = {}).", fn.string(), errno);
+
+        auto end = lseek(fd, 0, SEEK_END);
+
+        if (end < 0) {
+            auto err = errno;
+            close(fd);
+            throw formatted_error("lseek failed (errno = {}).", err);
+        }
+
+        len = (size_t)end;
+#endif
+
+        try {
+            if (len != 0)
+                map();
+        } catch (...) {
+            close_file();
+            throw;
+        }
+    }
+
+    ~mapped_file() {
+        unmap();
+        close_file();
+    }
+
+    // the contents are kept, and any new space is zeroed
+    void resize(size_t new_len) {
+        unmap();
+
+#ifdef _WIN32
+        LARGE_INTEGER li;
+
+        li.QuadPart = (LONGLONG)new_len;
+
+        if (!SetFilePointerEx(file, li, nullptr, FILE_BEGIN) || !SetEndOfFile(file))
+            throw last_error("SetEndOfFile", GetLastError());
+#else
+        if (ftruncate(fd, (off_t)new_len) < 0)
+            throw formatted_error("ftruncate failed (errno = {}).", errno);
+#endif
+
+        len = new_len;
+
+        if (len != 0)
+            map();
+    }
+
+    uint8_t* data() {
+        return ptr;
+    }
+
+    size_t size() const {
+        return len;
+    }
+
+private:
+    void map() {
+#ifdef _WIN32
+        mapping = CreateFileMappingW(file, nullptr, PAGE_READWRITE, 0, 0, nullptr);
+
+        if (!mapping)
+            throw last_error("CreateFileMapping", GetLastError());
+
+        ptr = (uint8_t*)MapViewOfFile(mapping, FILE_MAP_ALL_ACCESS, 0, 0, len);
+
+        if (!ptr) {
+            auto le = GetLastError();
+            CloseHandle(mapping);
+            mapping = nullptr;
+            throw last_error("MapViewOfFile", le);
+        }
+#else
+        auto p = mmap(nullptr, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+        if (p == MAP_FAILED)
+            throw formatted_error("mmap failed (errno = {}).", errno);
+
+        ptr = (uint8_t*)p;
+#endif
+    }
+
+    void unmap() {
+        if (!ptr)
+            return;
+
+#ifdef _WIN32
+        UnmapViewOfFile(ptr);
+        CloseHandle(mapping);
+        mapping = nullptr;
+#else
+        munmap(ptr, len);
+#endif
+
+        ptr = nullptr;
+    }
+
+    void close_file() {
+#ifdef _WIN32
+        CloseHandle(file);
+#else
+        close(fd);
+#endif
+    }
+
+#ifdef _WIN32
+    HANDLE file;
+    HANDLE mapping = nullptr;
+#else
+    int fd;
+#endif
+    uint8_t* ptr = nullptr;
+    size_t len;
+};
+
+class record_writer {
+public:
+    void u8(uint8_t v) {
+        buf.push_back((char)v);
+    }
+
+    void u32(uint32_t v) {
+        buf.append((const char*)&v, sizeof(v));
+    }
+
+    void str(string_view s) {
+        u32((uint32_t)s.length());
+        buf.append(s);
+    }
+
+    void strs(const vector<string>& v) {
+        u32((uint32_t)v.size());
+
+        for (const auto& s : v) {
+            str(s);
+        }
+    }
+
+    string buf;
+};
+
+class record_reader {
+public:
+    record_reader(string_view sv) : sv(sv) {
+    }
+
+    uint8_t u8() {
+        need(1);
+
+        auto v = (uint8_t)sv[0];
+
+        sv.remove_prefix(1);
+
+        return v;
+    }
+
+    uint32_t u32() {
+        uint32_t v;
+
+        need(sizeof(v));
+        memcpy(&v, sv.data(), sizeof(v));
+        sv.remove_prefix(sizeof(v));
+
+        return v;
+    }
+
+    string str() {
+        auto len = u32();
+
+        need(len);
+
+        string s{sv.substr(0, len)};
+
+        sv.remove_prefix(len);
+
+        return s;
+    }
+
+    vector<string> strs() {
+        auto n = u32();
+        vector<string> v;
+
+        for (uint32_t i = 0; i < n; i++) {
+            v.emplace_back(str());
+        }
+
+        return v;
+    }
+
+private:
+    void need(size_t n) {
+        if (sv.length() < n)
+            throw formatted_error("Truncated record in item cache.");
+    }
+
+    string_view sv;
+};
+
+static string serialize(const mail_item& item, const item_shape& shape) {
+    record_writer w;
+
+    w.str(item.id);
+    w.str(item.change_key);
+    w.u32((uint32_t)shape.fields);
+    w.u8((uint8_t)shape.body_type);
+    w.u32(shape.max_body_size);
+    w.str(item.subject);
+    w.str(item.received);
+    w.u8(item.read ? 1 : 0);
+    w.str(item.sender_name);
+    w.str(item.sender_email);
+    w.u8(item.has_attachments ? 1 : 0);
+    w.str(item.conversation_id);
+    w.str(item.internet_id);
+    w.str(item.body);
+    w.strs(item.recipients);
+    w.strs(item.cc);
+    w.strs(item.bcc);
+    w.u8((uint8_t)item.importance);
+
+    return w.buf;
+}
+
+// returns the shape the item was fetched with, and so what the record can be used for
+static item_shape deserialize(string_view sv, mail_item& item) {
+    record_reader r(sv);
+
+    item.id = r.str();
+    item.change_key = r.str();
+
+    auto fields = (item_field)r.u32();
+    auto body_type = (enum body_type)r.u8();
+    auto max_body_size = r.u32();
+    item.subject = r.str();
+    item.received = r.str();
+    item.read = r.u8() != 0;
+    item.sender_name = r.str();
+    item.sender_email = r.str();
+    item.has_attachments = r.u8() != 0;
+    item.conversation_id = r.str();
+    item.internet_id = r.str();
+    item.body = r.str();
+    item.recipients = r.strs();
+    item.cc = r.strs();
+    item.bcc = r.strs();
+    item.importance = (enum importance)r.u8();
+
+    return item_shape(fields, body_type, max_body_size);
+}
+
+// just the ChangeKey and shape, so a stale record can be turned down without decoding the rest
+static item_shape read_key(string_view sv, string& change_key) {
+    record_reader r(sv);
+
+    r.str();
+    change_key = r.str();
+
+    auto fields = (item_field)r.u32();
+    auto body_type = (enum body_type)r.u8();
+    auto max_body_size = r.u32();
+
+    return item_shape(fields, body_type, max_body_size);
+}
+
+static string read_id(string_view sv) {
+    record_reader r(sv);
+
+    return r.str();
+}
+
+class item_cache::impl {
+public:
+    impl(const filesystem::path& dir, uint64_t max_size) : dir(dir), max_size(max_size) {
+        filesystem::create_directories(dir);
+
+        log_fn = dir / "items.log";
+
+        if (!filesystem::exists(log_fn))
+            ofstream(log_fn, ios::binary);
+
+        idx = make_unique<mapped_file>(dir / "items.idx");
+
+        bool valid = idx->size() >= sizeof(index_header) && header().magic == index_magic &&
+                     idx->size() == sizeof(index_header) + (header().capacity * sizeof(index_slot));
+
+        auto actual = filesystem::file_size(log_fn);
+
+        // a write that never made it into the index
+        if (valid && actual > header().log_size)
+            filesystem::resize_file(log_fn, header().log_size);
+
+        open_log();
+
+        if (!valid || actual < header().log_size)
+            rebuild();
+    }
+
+    bool find(string_view id, string_view change_key, const item_shape& shape, mail_item& item) {
+        lock_guard lg(lock);
+
+        reopen_log();
+
+        auto slot = lookup(id);
+
+        if (!slot)
+            return false;
+
+        auto rec = read_record(*slot);
+        string cached_key;
+        auto cached_shape = read_key(rec, cached_key);
+
+        if (cached_key != change_key || !cached_shape.covers(shape))
+            return false;
+
+        deserialize(rec, item);
+
+        return true;
+    }
+
+    void store(const mail_item& item, const item_shape& shape) {
+        auto payload = serialize(item, shape);
+
+        lock_guard lg(lock);
+
+        reopen_log();
+
+        auto offset = header().log_size;
+        uint32_t hdr[2] = { record_magic, (uint32_t)payload.length() };
+
+        log.seekp((streamoff)offset);
+        log.write((const char*)hdr, sizeof(hdr));
+        log.write(payload.data(), (streamsize)payload.length());
+        log.flush();
+
+        if (!log.good())
+            throw formatted_error("Could not write to {}.", log_fn.string());
+
+        auto length = (uint32_t)(sizeof(hdr) + payload.length());
+
+        // if we crash before the insert, the record is just dead space
+        header().log_size = offset + length;
+
+        insert(item.id, offset, length);
+
+        if (header().log_size > max_size)
+            compact_locked(true);
+        else if (header().log_size > (1 << 20) && header().live_bytes < header().log_size / 2)
+            compact_locked(false);
+    }
+
+    void erase(string_view id) {
+        lock_guard lg(lock);
+
+        reopen_log();
+
+        auto slot = lookup(id);
+
+        if (!slot)
+            return;
+
+        header().live_bytes -= slot->length;
+        header().count--;
+        header().tombstones++;
+        slot->state = slot_state::deleted;
+    }
+
+    void compact() {
+        lock_guard lg(lock);
+
+        reopen_log();
+
+        compact_locked(false);
+    }
+
+    uint64_t size() const {
+        lock_guard lg(lock);
+
+        return header().log_size;
+    }
+
+    size_t count() const {
+        lock_guard lg(lock);
+
+        return (size_t)header().count;
+    }
+
+private:
+    index_header& header() {
+        return *(index_header*)idx->data();
+    }
+
+    const index_header& header() const {
+        return *(const index_header*)idx->data();
+    }
+
+    index_slot* slots() {
+        return (index_slot*)(idx->data() + sizeof(index_header));
+    }
+
+    // in case compaction couldn't reopen it
+    void reopen_log() {
+        if (!log.is_open())
+            open_log();
+    }
+
+    void open_log() {
+        log.close();
+        log.open(log_fn, ios::binary | ios::in | ios::out);
+
+        if (!log.good())
+            throw formatted_error("Could not open {}.", log_fn.string());
+    }
+
+    string read_record(const index_slot& slot) {
+        string buf(slot.length, 0);
+
+        log.seekg((streamoff)slot.offset);
+        log.read(buf.data(), slot.length);
+
+        if (!log.good()) {
+            log.clear();
+            throw formatted_error("Could not read from {}.", log_fn.string());
+        }
+
+        uint32_t hdr[2];
+
+        memcpy(hdr, buf.data(), sizeof(hdr));
+
+        if (hdr[0] != record_magic || hdr[1] != slot.length - sizeof(hdr))
+            throw formatted_error("Corrupted record in item cache.");
+
+        return buf.substr(sizeof(hdr));
+    }
+
+    // Reads just the length-prefixed ID at the start of the record, rather than
+    // the whole thing - which could be a large body - as lookup does this for
+    // every probe whose hash matches.
+    bool id_matches(const index_slot& slot, string_view id) {
+        uint32_t hdr[3];
+
+        if (slot.length < sizeof(hdr))
+            throw formatted_error("Corrupted record in item cache.");
+
+        log.seekg((streamoff)slot.offset);
+        log.read((char*)hdr, sizeof(hdr));
+
+        if (!log.good()) {
+            log.clear();
+            throw formatted_error("Could not read from {}.", log_fn.string());
+        }
+
+        if (hdr[0] != record_magic || hdr[1] != slot.length - 2 * sizeof(uint32_t) || hdr[2] > slot.length - sizeof(hdr))
+            throw formatted_error("Corrupted record in item cache.");
+
+        if (hdr[2] != id.length())
+            return false;
+
+        string buf(hdr[2], 0);
+
+        log.read(buf.data(), (streamsize)buf.length());
+
+        if (!log.good()) {
+            log.clear();
+            throw formatted_error("Could not read from {}.", log_fn.string());
+        }
+
+        return buf == id;
+    }
+
+    index_slot* lookup(string_view id) {
+        auto h = hash_id(id);
+        auto cap = header().capacity;
+
+        for (uint64_t i = 0; i < cap; i++) {
+            auto& slot = slots()[(h + i) % cap];
+
+            if (slot.state == slot_state::empty)
+                return nullptr;
+
+            if (slot.state == slot_state::used && slot.hash == h && id_matches(slot, id))
+                return &slot;
+        }
+
+        return nullptr;
+    }
+
+    void insert(string_view id, uint64_t offset, uint32_t length) {
+        if (auto existing = lookup(id)) {
+            header().live_bytes -= existing->length;
+            header().live_bytes += length;
+            existing->offset = offset;
+            existing->length = length;
+            return;
+        }
+
+        if ((header().count + header().tombstones + 1) * 10 > header().capacity * 7)
+            resize_index(max(initial_capacity, (header().count + 1) * 2));
+
+        insert_new(hash_id(id), offset, length);
+    }
+
+    void insert_new(uint64_t h, uint64_t offset, uint32_t length) {
+        auto cap = header().capacity;
+
+        for (uint64_t i = 0; i < cap; i++) {
+            auto& slot = slots()[(h + i) % cap];
+
+            if (slot.state != slot_state::used) {
+                if (slot.state == slot_state::deleted)
+                    header().tombstones--;
+
+                slot.hash = h;
+                slot.offset = offset;
+                slot.length = length;
+                slot.state = slot_state::used;
+
+                header().count++;
+                header().live_bytes += length;
+
+                return;
+            }
+        }
+
+        throw formatted_error("Item cache index is full.");
+    }
+
+    // also drops the tombstones
+    void resize_index(uint64_t capacity) {
+        vector<index_slot> live;
+
+        if (idx->size() >= sizeof(index_header) && header().magic == index_magic) {
+            for (uint64_t i = 0; i < header().capacity; i++) {
+                if (slots()[i].state == slot_state::used)
+                    live.push_back(slots()[i]);
+            }
+        }
+
+        auto log_size = idx->size() >= sizeof(index_header) ? header().log_size : 0;
+
+        idx->resize(sizeof(index_header) + (capacity * sizeof(index_slot)));
+
+        memset(idx->data(), 0, idx->size());
+
+        header().magic = index_magic;
+        header().capacity = capacity;
+        header().log_size = log_size;
+
+        for (const auto& s : live) {
+            insert_new(s.hash, s.offset, s.length);
+        }
+    }
+
+    // Reads through the whole log, in case the index has been lost. Anything
+    // after the first bad record is thrown away.
+    void rebuild() {
+        idx->resize(0);
+        resize_index(initial_capacity);
+
+        ifstream in(log_fn, ios::binary);
+        uint64_t offset = 0;
+        auto file_size = filesystem::file_size(log_fn);
+
+        while (offset + 8 <= file_size) {
+            uint32_t hdr[2];
+
+            in.seekg((streamoff)offset);
+            in.read((char*)hdr, sizeof(hdr));
+
+            if (!in.good() || hdr[0] != record_magic || offset + sizeof(hdr) + hdr[1] > file_size)
+                break;
+
+            string payload(hdr[1], 0);
+
+            in.read(payload.data(), hdr[1]);
+
+            if (!in.good())
+                break;
+
+            auto length = (uint32_t)(sizeof(hdr) + hdr[1]);
+
+            try {
+                insert(read_id(payload), offset, length);
+            } catch (...) {
+                break;
+            }
+
+            header().log_size = offset + length;
+            offset += length;
+        }
+
+        in.close();
+
+        if (header().log_size != file_size)
+            filesystem::resize_file(log_fn, header().log_size);
+
+        open_log();
+    }
+
+    // Writes out the live records to a new log. If make_room is set, or if it
+    // would still be over max_size, the oldest are left out until it's down to
+    // three quarters of max_size, so that we're not back here on the next store.
+    void compact_locked(bool make_room) {
+        vector<index_slot> live;
+
+        for (uint64_t i = 0; i < header().capacity; i++) {
+            if (slots()[i].state == slot_state::used)
+                live.push_back(slots()[i]);
+        }
+
+        sort(live.begin(), live.end(), [](const index_slot& a, const index_slot& b) {
+            return a.offset < b.offset;
+        });
+
+        uint64_t total = 0;
+
+        for (const auto& s : live) {
+            total += s.length;
+        }
+
+        size_t first = 0;
+
+        auto target = max_size / 4 * 3;
+
+        if (total > max_size || (make_room && total > target)) {
+            while (first < live.size() && total > target) {
+                total -= live[first].length;
+                first++;
+            }
+        }
+
+        auto tmp_fn = log_fn;
+
+        tmp_fn += ".tmp";
+
+        vector<index_slot> kept;
+
+        {
+            ofstream out(tmp_fn, ios::binary | ios::trunc);
+            uint64_t offset = 0;
+
+            for (size_t i = first; i < live.size(); i++) {
+                auto payload = read_record(live[i]);
+                uint32_t hdr[2] = { record_magic, (uint32_t)payload.length() };
+
+                out.write((const char*)hdr, sizeof(hdr));
+                out.write(payload.data(), (streamsize)payload.length());
+
+                kept.push_back(index_slot{live[i].hash, offset, live[i].length, slot_state::used});
+                offset += live[i].length;
+            }
+
+            if (!out.good()) {
+                out.close();
+
+                error_code ec;
+                filesystem::remove(tmp_fn, ec);
+
+                throw formatted_error("Could not write to {}.", tmp_fn.string());
+            }
+        }
+
+        // the index is wrong for the new log until we've rewritten it, so if we
+        // crash in between it'll be rebuilt when we're next opened
+        header().magic = 0;
+
+        log.close();
+
+        try {
+            filesystem::rename(tmp_fn, log_fn);
+        } catch (...) {
+            error_code ec;
+
+            filesystem::remove(tmp_fn, ec);
+
+            // nothing has changed, so the old log and index are still good
+            header().magic = index_magic;
+
+            // if this fails too, reopen_log will try again on the next call
+            try {
+                open_log();
+            } catch (...) {
+            }
+
+            throw;
+        }
+
+        auto capacity = max(initial_capacity, (uint64_t)kept.size() * 2);
+
+        idx->resize(sizeof(index_header) + (capacity * sizeof(index_slot)));
+        memset(idx->data(), 0, idx->size());
+
+        header().magic = index_magic;
+        header().capacity = capacity;
+
+        uint64_t log_size = 0;
+
+        for (const auto& s : kept) {
+            insert_new(s.hash, s.offset, s.length);
+            log_size = s.offset + s.length;
+        }
+
+        header().log_size = log_size;
+
+        open_log();
+    }
+
+    filesystem::path dir, log_fn;
+    uint64_t max_size;
+    mutable mutex lock;
+    unique_ptr<mapped_file> idx;
+    fstream log;
+};
+
+item_cache::item_cache(const filesystem::path& dir, uint64_t max_size) {
+    state = make_unique<impl>(dir, max_size);
+}
+
+item_cache::~item_cache() = default;
+
+bool item_cache::find(string_view id, string_view change_key, const item_shape& shape, mail_item& item) {
+    return state->find(id, change_key, shape, item);
+}
+
+void item_cache::store(const mail_item& item, const item_shape& shape) {
+    state->store(item, shape);
+}
+
+void item_cache::erase(string_view id) {
+    state->erase(id);
+}
+
+void item_cache::compact() {
+    state->compact();
+}
+
+uint64_t item_cache::size() const {
+    return state->size();
+}
+
+size_t item_cache::count() const {
+    return state->count();
+}
+
+}
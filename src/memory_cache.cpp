@@ -0,0 +1,278 @@
+#include "prospect.h"
+#include <atomic>
+#include <variant>
+
+using namespace std;
+
+namespace prospect {
+
+using item_ptr = shared_ptr<const mail_item>;
+using attachments_ptr = shared_ptr<const vector<attachment>>;
+
+struct cached_item {
+    item_ptr item;
+    item_shape shape;
+};
+
+struct cached_attachments {
+    string change_key; // of the item, if we knew it
+    attachments_ptr atts;
+};
+
+struct cache_entry {
+    string key;
+    variant<cached_item, cached_attachments> value;
+    size_t bytes;
+};
+
+// Rough, but good enough for a budget: the objects themselves plus whatever
+// their strings have had to allocate.
+static size_t string_bytes(const string& s) {
+    return s.capacity() > 15 ? s.capacity() + 1 : 0;
+}
+
+static size_t strings_bytes(const vector<string>& v) {
+    size_t n = v.capacity() * sizeof(string);
+
+    for (const auto& s : v) {
+        n += string_bytes(s);
+    }
+
+    return n;
+}
+
+static size_t item_bytes(const mail_item& item) {
+    return sizeof(mail_item) + string_bytes(item.id) + string_bytes(item.subject) + string_bytes(item.received) +
+           string_bytes(item.sender_name) + string_bytes(item.sender_email) + string_bytes(item.conversation_id) +
+           string_bytes(item.internet_id) + string_bytes(item.change_key) + string_bytes(item.body) +
+           strings_bytes(item.recipients) + strings_bytes(item.cc) + strings_bytes(item.bcc);
+}
+
+static size_t attachments_bytes(const vector<attachment>& atts) {
+    size_t n = sizeof(atts) + (atts.capacity() * sizeof(attachment));
+
+    for (const auto& a : atts) {
+        n += string_bytes(a.id) + string_bytes(a.name) + string_bytes(a.modified);
+    }
+
+    return n;
+}
+
+// Items and attachment lists share the LRU, but not keys.
+static string item_key(string_view id) {
+    return "i" + string(id);
+}
+
+static string attachments_key(string_view item_id) {
+    return "a" + string(item_id);
+}
+
+// per-entry overhead of the list node and map entry
+static const size_t entry_overhead = sizeof(cache_entry) + 64;
+
+class cache_shard {
+public:
+    // Returns the entry, moved to the front, or nullptr.
+    cache_entry* find(const string& key) {
+        auto it = index.find(key);
+
+        if (it == index.end())
+            return nullptr;
+
+        lru.splice(lru.begin(), lru, it->second);
+
+        return &*it->second;
+    }
+
+    // returns the number of entries evicted to make room
+    size_t insert(cache_entry&& e, size_t budget) {
+        remove(e.key);
+
+        if (e.bytes > budget)
+            return 0;
+
+        bytes += e.bytes;
+        lru.push_front(move(e));
+        index.emplace(lru.front().key, lru.begin());
+
+        size_t evicted = 0;
+
+        while (bytes > budget) {
+            auto& last = lru.back();
+
+            bytes -= last.bytes;
+            index.erase(last.key);
+            lru.pop_back();
+            evicted++;
+        }
+
+        return evicted;
+    }
+
+    void remove(const string& key) {
+        auto it = index.find(key);
+
+        if (it == index.end())
+            return;
+
+        bytes -= it->second->bytes;
+        lru.erase(it->second);
+        index.erase(it);
+    }
+
+    void clear() {
+        index.clear();
+        lru.clear();
+        bytes = 0;
+    }
+
+    mutex lock;
+    list<cache_entry> lru;
+    unordered_map<string_view, list<cache_entry>::iterator> index; // keys point into lru
+    size_t bytes = 0;
+};
+
+class memory_cache::impl {
+public:
+    impl(size_t max_bytes, bool validate, unsigned int num_shards) :
+         validate(validate), shards(max(num_shards, 1u)), shard_budget(max_bytes / shards.size()) {
+    }
+
+    cache_shard& shard_for(const string& key) {
+        return shards[hash<string>{}(key) % shards.size()];
+    }
+
+    void store(string key, variant<cached_item, cached_attachments> value, size_t bytes) {
+        auto& sh = shard_for(key);
+        cache_entry e{move(key), move(value), bytes + entry_overhead};
+
+        size_t evicted;
+
+        {
+            lock_guard lg(sh.lock);
+
+            evicted = sh.insert(move(e), shard_budget);
+        }
+
+        if (evicted != 0)
+            evictions += evicted;
+    }
+
+    void hit(bool found) {
+        if (found)
+            hits++;
+        else
+            misses++;
+    }
+
+    bool validate;
+    vector<cache_shard> shards;
+    size_t shard_budget;
+    atomic<uint64_t> hits = 0, misses = 0, evictions = 0;
+};
+
+memory_cache::memory_cache(size_t max_bytes, bool validate, unsigned int shards) {
+    state = make_unique<impl>(max_bytes, validate, shards);
+}
+
+memory_cache::~memory_cache() = default;
+
+shared_ptr<const mail_item> memory_cache::find_item(string_view id, string_view change_key, const item_shape& shape) {
+    auto key = item_key(id);
+    auto& sh = state->shard_for(key);
+    item_ptr ret;
+
+    {
+        lock_guard lg(sh.lock);
+
+        auto e = sh.find(key);
+
+        if (e) {
+            auto& ci = get<cached_item>(e->value);
+
+            if ((change_key.empty() || ci.item->change_key == change_key) && ci.shape.covers(shape))
+                ret = ci.item;
+        }
+    }
+
+    state->hit(!!ret);
+
+    return ret;
+}
+
+void memory_cache::store_item(const mail_item& item, const item_shape& shape) {
+    auto copy = make_shared<const mail_item>(item);
+    auto bytes = item_bytes(*copy);
+
+    state->store(item_key(item.id), cached_item{move(copy), shape}, bytes);
+}
+
+shared_ptr<const vector<attachment>> memory_cache::find_attachments(string_view item_id, string_view change_key) {
+    auto key = attachments_key(item_id);
+    auto& sh = state->shard_for(key);
+    attachments_ptr ret;
+
+    {
+        lock_guard lg(sh.lock);
+
+        auto e = sh.find(key);
+
+        if (e) {
+            auto& ca = get<cached_attachments>(e->value);
+
+            if (change_key.empty() || ca.change_key == change_key)
+                ret = ca.atts;
+        }
+    }
+
+    state->hit(!!ret);
+
+    return ret;
+}
+
+void memory_cache::store_attachments(string_view item_id, string_view change_key, const vector<attachment>& atts) {
+    auto copy = make_shared<const vector<attachment>>(atts);
+    auto bytes = attachments_bytes(*copy) + change_key.length();
+
+    state->store(attachments_key(item_id), cached_attachments{string(change_key), move(copy)}, bytes);
+}
+
+void memory_cache::erase(string_view item_id) {
+    for (const auto& key : { item_key(item_id), attachments_key(item_id) }) {
+        auto& sh = state->shard_for(key);
+        lock_guard lg(sh.lock);
+
+        sh.remove(key);
+    }
+}
+
+void memory_cache::clear() {
+    for (auto& sh : state->shards) {
+        lock_guard lg(sh.lock);
+
+        sh.clear();
+    }
+}
+
+bool memory_cache::validating() const {
+    return state->validate;
+}
+
+cache_stats memory_cache::stats() const {
+    cache_stats s;
+
+    s.hits = state->hits;
+    s.misses = state->misses;
+    s.evictions = state->evictions;
+
+    for (auto& sh : state->shards) {
+        lock_guard lg(sh.lock);
+
+        s.bytes += sh.bytes;
+        s.entries += sh.lru.size();
+    }
+
+    return s;
+}
+
+}
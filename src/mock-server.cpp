@@ -0,0 +1,209 @@
+#include "mock-server.h"
+#include "misc.h"
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+using namespace std;
+
+mock_server::mock_server(handler_func handler) : handler(move(handler)) {
+    listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+
+    if (listen_fd < 0)
+        throw formatted_error("socket failed (errno = {})", errno);
+
+    int one = 1;
+
+    setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+    sockaddr_in addr;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = 0;
+
+    if (bind(listen_fd, (sockaddr*)&addr, sizeof(addr)) < 0) {
+        close(listen_fd);
+        throw formatted_error("bind failed (errno = {})", errno);
+    }
+
+    if (listen(listen_fd, SOMAXCONN) < 0) {
+        close(listen_fd);
+        throw formatted_error("listen failed (errno = {})", errno);
+    }
+
+    socklen_t len = sizeof(addr);
+
+    getsockname(listen_fd, (sockaddr*)&addr, &len);
+    port = ntohs(addr.sin_port);
+
+    acceptor = thread([this]() {
+        accept_loop();
+    });
+}
+
+mock_server::~mock_server() {
+    stopping = true;
+
+    shutdown(listen_fd, SHUT_RDWR);
+    acceptor.join();
+    close(listen_fd);
+
+    {
+        lock_guard lg(lock);
+
+        for (auto fd : client_fds) {
+            shutdown(fd, SHUT_RDWR);
+        }
+    }
+
+    for (auto& t : workers) {
+        t.join();
+    }
+}
+
+string mock_server::url() const {
+    return "http://127.0.0.1:" + to_string(port) + "/EWS/Exchange.asmx";
+}
+
+void mock_server::accept_loop() {
+    while (!stopping) {
+        int fd = accept(listen_fd, nullptr, nullptr);
+
+        if (fd < 0) {
+            if (errno == EINTR)
+                continue;
+
+            return;
+        }
+
+        int one = 1;
+
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+        num_connections++;
+
+        lock_guard lg(lock);
+
+        if (stopping) {
+            close(fd);
+            return;
+        }
+
+        client_fds.push_back(fd);
+        workers.emplace_back([this, fd]() {
+            serve(fd);
+        });
+    }
+}
+
+static bool send_all(int fd, string_view s) {
+    while (!s.empty()) {
+        auto ret = send(fd, s.data(), s.length(), MSG_NOSIGNAL);
+
+        if (ret <= 0)
+            return false;
+
+        s.remove_prefix((size_t)ret);
+    }
+
+    return true;
+}
+
+static string_view header_value(string_view headers, string_view name) {
+    while (!headers.empty()) {
+        auto eol = headers.find("\r\n");
+        auto line = headers.substr(0, eol);
+
+        headers = eol == string_view::npos ? "" : headers.substr(eol + 2);
+
+        auto colon = line.find(':');
+
+        if (colon != name.length() || strncasecmp(line.data(), name.data(), name.length()))
+            continue;
+
+        line.remove_prefix(colon + 1);
+
+        while (!line.empty() && line.front() == ' ') {
+            line.remove_prefix(1);
+        }
+
+        return line;
+    }
+
+    return "";
+}
+
+void mock_server::serve(int fd) {
+    string buf;
+    char tmp[16384];
+
+    while (true) {
+        auto end = buf.find("\r\n\r\n");
+
+        while (end == string::npos) {
+            auto ret = recv(fd, tmp, sizeof(tmp), 0);
+
+            if (ret <= 0)
+                goto done;
+
+            buf.append(tmp, (size_t)ret);
+            end = buf.find("\r\n\r\n");
+        }
+
+        {
+            auto headers = string_view(buf).substr(0, end);
+            auto cl = header_value(headers, "Content-Length");
+            size_t length = cl.empty() ? 0 : stoul(string(cl));
+
+            auto expect = header_value(headers, "Expect");
+
+            if (expect.length() == 12 && !strncasecmp(expect.data(), "100-continue", 12)) {
+                if (!send_all(fd, "HTTP/1.1 100 Continue\r\n\r\n"))
+                    goto done;
+            }
+
+            while (buf.length() < end + 4 + length) {
+                auto ret = recv(fd, tmp, sizeof(tmp), 0);
+
+                if (ret <= 0)
+                    goto done;
+
+                buf.append(tmp, (size_t)ret);
+            }
+
+            num_requests++;
+
+            string status = "200 OK", body;
+
+            try {
+                body = "<?xml version=\"1.0\" encoding=\"utf-8\"?>"
+                       "<s:Envelope xmlns:s=\"http://schemas.xmlsoap.org/soap/envelope/\"><s:Body>" +
+                       handler(string_view(buf).substr(end + 4, length)) +
+                       "</s:Body></s:Envelope>";
+            } catch (const exception& e) {
+                status = "500 Internal Server Error";
+                body = e.what();
+            }
+
+            auto resp = "HTTP/1.1 " + status + "\r\nContent-Type: text/xml; charset=utf-8\r\nContent-Length: " +
+                        to_string(body.length()) + "\r\n\r\n" + body;
+
+            if (!send_all(fd, resp))
+                goto done;
+
+            buf.erase(0, end + 4 + length);
+        }
+    }
+
+done:
+    lock_guard lg(lock);
+
+    erase(client_fds, fd);
+    close(fd);
+}
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <string>
+#include <functional>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <atomic>
+
+// A minimal HTTP/1.1 server on the loopback interface, standing in for Exchange
+// in the benchmarks. The handler is given the body of each request and returns
+// the contents of the soap:Body to send back. There is a thread per connection,
+// so the handler may be called concurrently.
+class mock_server {
+public:
+    using handler_func = std::function<std::string(std::string_view request)>;
+
+    mock_server(handler_func handler);
+    ~mock_server();
+
+    std::string url() const;
+
+    unsigned int connections() const {
+        return num_connections;
+    }
+
+    unsigned int requests() const {
+        return num_requests;
+    }
+
+private:
+    void accept_loop();
+    void serve(int fd);
+
+    handler_func handler;
+    int listen_fd;
+    unsigned short port;
+    std::thread acceptor;
+    std::mutex lock;
+    std::vector<std::thread> workers;
+    std::vector<int> client_fds;
+    std::atomic<bool> stopping = false;
+    std::atomic<unsigned int> num_connections = 0;
+    std::atomic<unsigned int> num_requests = 0;
+};
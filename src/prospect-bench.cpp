@@ -0,0 +1,504 @@
+#include <prospect.h>
+#include <curl/curl.h>
+#include "soap.h"
+#include "xml.h"
+#include "b64.h"
+#include "mock-server.h"
+#include <iostream>
+#include <fstream>
+#include <format>
+#include <chrono>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <new>
+#include <memory_resource>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+
+using namespace std;
+
+// Allocations are counted per thread, so that the mock server's threads don't
+// get charged to whatever's being measured. libxml2's are counted too, by way
+// of xmlMemSetup; libcurl's aren't.
+
+static thread_local uint64_t alloc_count = 0, alloc_bytes = 0;
+
+void* operator new(size_t size) {
+    alloc_count++;
+    alloc_bytes += size;
+
+    if (auto p = malloc(size != 0 ? size : 1))
+        return p;
+
+    throw bad_alloc();
+}
+
+void* operator new[](size_t size) {
+    return operator new(size);
+}
+
+void operator delete(void* p) noexcept {
+    free(p);
+}
+
+void operator delete[](void* p) noexcept {
+    free(p);
+}
+
+void operator delete(void* p, size_t) noexcept {
+    free(p);
+}
+
+void operator delete[](void* p, size_t) noexcept {
+    free(p);
+}
+
+// std::pmr::new_delete_resource comes through here rather than the above
+void* operator new(size_t size, align_val_t al) {
+    alloc_count++;
+    alloc_bytes += size;
+
+    auto align = (size_t)al;
+
+    if (auto p = aligned_alloc(align, max((size + align - 1) & ~(align - 1), align)))
+        return p;
+
+    throw bad_alloc();
+}
+
+void* operator new[](size_t size, align_val_t al) {
+    return operator new(size, al);
+}
+
+void operator delete(void* p, align_val_t) noexcept {
+    free(p);
+}
+
+void operator delete[](void* p, align_val_t) noexcept {
+    free(p);
+}
+
+void operator delete(void* p, size_t, align_val_t) noexcept {
+    free(p);
+}
+
+void operator delete[](void* p, size_t, align_val_t) noexcept {
+    free(p);
+}
+
+static void* xml_malloc(size_t size) {
+    alloc_count++;
+    alloc_bytes += size;
+
+    return malloc(size);
+}
+
+static void* xml_realloc(void* p, size_t size) {
+    alloc_count++;
+    alloc_bytes += size;
+
+    return realloc(p, size);
+}
+
+static char* xml_strdup(const char* s) {
+    alloc_count++;
+    alloc_bytes += strlen(s) + 1;
+
+    return strdup(s);
+}
+
+// An EWS response recorded from Exchange, with one element in it that we can
+// repeat to get responses of any size.
+class fixture {
+public:
+    fixture(const filesystem::path& fn, string_view repeat_tag) {
+        ifstream f(fn, ios::binary);
+
+        if (!f.good())
+            throw runtime_error("Could not open " + fn.string() + ".");
+
+        string s{istreambuf_iterator<char>(f), istreambuf_iterator<char>()};
+
+        while (!s.empty() && (s.back() == '\n' || s.back() == '\r')) {
+            s.pop_back();
+        }
+
+        auto start = s.find("<" + string(repeat_tag) + ">");
+
+        if (start == string::npos)
+            start = s.find("<" + string(repeat_tag) + " ");
+
+        auto end_tag = "</" + string(repeat_tag) + ">";
+        auto end = s.rfind(end_tag);
+
+        if (start == string::npos || end == string::npos)
+            throw runtime_error(fn.string() + ": " + string(repeat_tag) + " not found.");
+
+        end += end_tag.length();
+
+        head = s.substr(0, start);
+        element = s.substr(start, end - start);
+        tail = s.substr(end);
+
+        auto id = element.find("ItemId Id=\"");
+
+        if (id == string::npos)
+            throw runtime_error(fn.string() + ": ItemId not found.");
+
+        id += 11;
+        item_id = element.substr(id, element.find('"', id) - id);
+    }
+
+    string element_for(string_view id) const {
+        string ret = element;
+        auto pos = ret.find(item_id);
+
+        ret.replace(pos, item_id.length(), id);
+
+        return ret;
+    }
+
+    string envelope(size_t n) const {
+        auto ret = head;
+
+        auto total = ret.find("TotalItemsInView=\"1\"");
+
+        if (total != string::npos)
+            ret.replace(total, 20, format("TotalItemsInView=\"{}\"", n));
+
+        for (size_t i = 0; i < n; i++) {
+            ret += element_for(item_id + to_string(i));
+        }
+
+        ret += tail;
+
+        return ret;
+    }
+
+    // what mock_server wants: the contents of the soap:Body
+    static string body(string_view envelope) {
+        auto start = envelope.find("<s:Body");
+        auto end = envelope.rfind("</s:Body>");
+
+        start = envelope.find('>', start) + 1;
+
+        return string(envelope.substr(start, end - start));
+    }
+
+    string head, element, tail, item_id;
+};
+
+class bench_runner {
+public:
+    bench_runner(double min_time, string_view filter) : min_time(min_time), filter(filter) {
+    }
+
+    // Runs func repeatedly for at least min_time seconds, after one untimed
+    // run, and prints a line of JSON. items is how many things each run
+    // handles, for the throughput figure.
+    void run(string_view name, uint64_t items, const function<void()>& func) {
+        if (!filter.empty() && name.find(filter) == string_view::npos)
+            return;
+
+        func();
+
+        vector<double> latencies;
+        uint64_t allocs = 0, bytes = 0;
+        auto start = chrono::steady_clock::now();
+        double elapsed;
+
+        do {
+            auto count_before = alloc_count, bytes_before = alloc_bytes;
+            auto t1 = chrono::steady_clock::now();
+
+            func();
+
+            auto t2 = chrono::steady_clock::now();
+
+            allocs += alloc_count - count_before;
+            bytes += alloc_bytes - bytes_before;
+            latencies.push_back(chrono::duration<double, micro>(t2 - t1).count());
+
+            elapsed = chrono::duration<double>(t2 - start).count();
+        } while (elapsed < min_time);
+
+        sort(latencies.begin(), latencies.end());
+
+        auto pct = [&](double p) {
+            return latencies[min(latencies.size() - 1, (size_t)(p * (double)latencies.size()))];
+        };
+
+        double total = 0;
+
+        for (auto l : latencies) {
+            total += l;
+        }
+
+        auto iterations = latencies.size();
+
+        cout << format("{{\"name\":\"{}\",\"iterations\":{},\"items_per_op\":{},\"ops_per_sec\":{:.1f},"
+                       "\"items_per_sec\":{:.1f},\"mean_us\":{:.2f},\"p50_us\":{:.2f},\"p90_us\":{:.2f},"
+                       "\"p99_us\":{:.2f},\"max_us\":{:.2f},\"allocs_per_op\":{:.1f},\"alloc_bytes_per_op\":{:.1f}}}\n",
+                       name, iterations, items, (double)iterations * 1000000.0 / total,
+                       (double)(iterations * items) * 1000000.0 / total, total / (double)iterations, pct(0.5), pct(0.9),
+                       pct(0.99), latencies.back(), (double)allocs / (double)iterations,
+                       (double)bytes / (double)iterations);
+        cout.flush();
+    }
+
+private:
+    double min_time;
+    string filter;
+};
+
+static void bench_xml_writer(bench_runner& r) {
+    r.run("xml_writer/find_item_request", 1, []() {
+        xml_writer req;
+
+        req.start_document();
+        req.start_element("m:FindItem");
+        req.attribute("Traversal", "Shallow");
+
+        req.start_element("m:ItemShape");
+        req.element_text("t:BaseShape", "IdOnly");
+        req.start_element("t:AdditionalProperties");
+
+        for (auto f : { "item:Subject", "item:DateTimeReceived", "message:Sender", "message:IsRead",
+                        "item:HasAttachments", "item:ConversationId", "message:InternetMessageId", "item:Importance" }) {
+            req.start_element("t:FieldURI");
+            req.attribute("FieldURI", f);
+            req.end_element();
+        }
+
+        req.end_element();
+        req.end_element();
+
+        req.start_element("m:IndexedPageItemView");
+        req.attribute("MaxEntriesReturned", "1000");
+        req.attribute("Offset", "0");
+        req.attribute("BasePoint", "Beginning");
+        req.end_element();
+
+        req.start_element("m:ParentFolderIds");
+        req.start_element("t:DistinguishedFolderId");
+        req.attribute("Id", "inbox");
+        req.end_element();
+        req.end_element();
+
+        req.end_element();
+
+        auto s = req.dump();
+    });
+
+    vector<string> ids;
+
+    for (unsigned int i = 0; i < 100; i++) {
+        ids.emplace_back(format("AAMkADk0ZjA2NDFlLTc3ZDgtNDI5Ny1hYjgwLWQ1YjU0ZjNiMjgxNgBGAAAAAAC7XQcRcKq3QJTcDdRsmBpNBw{:04}=", i));
+    }
+
+    r.run("xml_writer/get_item_request/100", 100, [&]() {
+        xml_writer req;
+
+        req.start_document();
+        req.start_element("m:GetItem");
+
+        req.start_element("m:ItemShape");
+        req.element_text("t:BaseShape", "IdOnly");
+        req.element_text("t:BodyType", "Text");
+        req.end_element();
+
+        req.start_element("m:ItemIds");
+
+        for (const auto& id : ids) {
+            req.start_element("t:ItemId");
+            req.attribute("Id", id);
+            req.end_element();
+        }
+
+        req.end_element();
+
+        req.end_element();
+
+        auto s = req.dump();
+    });
+}
+
+static void bench_extract_response(bench_runner& r, const fixture& find_item) {
+    for (size_t n : { 10, 1000, 100000 }) {
+        auto env = find_item.envelope(n);
+
+        r.run(format("extract_response/{}", n), n, [&]() {
+            auto s = extract_response(env);
+        });
+    }
+}
+
+static void bench_b64(bench_runner& r) {
+    for (size_t n : { 64, 4096, 1048576 }) {
+        string data(n, 0);
+
+        for (size_t i = 0; i < n; i++) {
+            data[i] = (char)(i * 131);
+        }
+
+        auto enc = b64encode(data);
+
+        r.run(format("b64encode/{}", n), n, [&]() {
+            auto s = b64encode(data);
+        });
+
+        r.run(format("b64decode/{}", n), n, [&]() {
+            auto s = b64decode(enc);
+        });
+    }
+}
+
+// Decoding whole responses through the public API. The server has the
+// responses ready beforehand, so what's left is mostly our parsing.
+static void bench_decode(bench_runner& r, const fixture& find_item, const fixture& get_item) {
+    for (size_t n : { 10, 1000, 100000 }) {
+        auto body = fixture::body(find_item.envelope(n));
+        mock_server server([&](string_view) {
+            return body;
+        });
+        auto p = prospect::prospect::from_url(server.url());
+
+        r.run(format("decode/find_items/{}", n), n, [&]() {
+            size_t count = 0;
+
+            p.find_items("inbox", [&](const prospect::mail_item&) {
+                count++;
+                return true;
+            }, prospect::summary_fields, (unsigned int)n);
+
+            if (count != n)
+                throw runtime_error(format("find_items returned {} items, expected {}.", count, n));
+        });
+    }
+
+    auto get_item_head = fixture::body(get_item.head + get_item.tail);
+    auto split = get_item_head.find("</m:ResponseMessages>");
+
+    mock_server server([&](string_view req) {
+        auto ret = get_item_head.substr(0, split);
+        size_t pos = 0;
+
+        while ((pos = req.find("<t:ItemId Id=\"", pos)) != string_view::npos) {
+            pos += 14;
+            ret += get_item.element_for(req.substr(pos, req.find('"', pos) - pos));
+        }
+
+        ret += get_item_head.substr(split);
+
+        return ret;
+    });
+    auto p = prospect::prospect::from_url(server.url());
+
+    for (size_t n : { 10, 1000, 100000 }) {
+        vector<string> ids;
+
+        for (size_t i = 0; i < n; i++) {
+            ids.emplace_back(get_item.item_id + to_string(i));
+        }
+
+        r.run(format("decode/get_items/{}", n), n, [&]() {
+            size_t count = 0;
+
+            p.get_items(ids, [&](const prospect::mail_item&) {
+                count++;
+                return true;
+            });
+
+            if (count != n)
+                throw runtime_error(format("get_items returned {} items, expected {}.", count, n));
+        });
+    }
+}
+
+// Single calls, where the round trip dominates.
+static void bench_end_to_end(bench_runner& r, const fixture& find_item, const fixture& get_item) {
+    auto find_body = fixture::body(find_item.envelope(50));
+    auto get_body = fixture::body(get_item.envelope(1));
+
+    mock_server server([&](string_view req) {
+        if (req.find("<m:FindItem") != string_view::npos)
+            return find_body;
+        else
+            return get_body;
+    });
+    auto p = prospect::prospect::from_url(server.url());
+
+    r.run("e2e/get_item", 1, [&]() {
+        p.get_item(get_item.item_id, [](const prospect::mail_item&) {
+            return true;
+        });
+    });
+
+    // the same, but with the request's buffers coming from an arena that's
+    // thrown away afterwards
+    vector<byte> arena(1 << 20);
+
+    r.run("e2e/get_item/arena", 1, [&]() {
+        pmr::monotonic_buffer_resource mr(arena.data(), arena.size());
+        prospect::scoped_resource sr(&mr);
+
+        p.get_item(get_item.item_id, [](const prospect::mail_item&) {
+            return true;
+        });
+    });
+
+    r.run("e2e/find_items/50", 50, [&]() {
+        p.find_items("inbox", [](const prospect::mail_item&) {
+            return true;
+        });
+    });
+}
+
+int main(int argc, char* argv[]) {
+    double min_time = 1.0;
+    string filter;
+    filesystem::path fixtures_dir = PROSPECT_FIXTURES_DIR;
+
+    for (int i = 1; i < argc; i++) {
+        string_view arg = argv[i];
+
+        if (arg == "--time" && i + 1 < argc)
+            min_time = stod(argv[++i]);
+        else if (arg == "--filter" && i + 1 < argc)
+            filter = argv[++i];
+        else if (arg == "--fixtures" && i + 1 < argc)
+            fixtures_dir = argv[++i];
+        else {
+            cerr << "Usage: prospect-bench [--time seconds] [--filter substring] [--fixtures dir]" << endl;
+            return 1;
+        }
+    }
+
+    try {
+        if (xmlMemSetup(free, xml_malloc, xml_realloc, xml_strdup) != 0)
+            throw runtime_error("xmlMemSetup failed.");
+
+        fixture find_item(fixtures_dir / "finditem.xml", "t:Message");
+        fixture get_item(fixtures_dir / "getitem.xml", "m:GetItemResponseMessage");
+        bench_runner r(min_time, filter);
+
+        bench_xml_writer(r);
+        bench_extract_response(r, find_item);
+        bench_b64(r);
+        bench_decode(r, find_item, get_item);
+        bench_end_to_end(r, find_item, get_item);
+
+        rusage ru;
+
+        getrusage(RUSAGE_SELF, &ru);
+
+        cout << format("{{\"name\":\"summary\",\"peak_rss_kb\":{}}}\n", ru.ru_maxrss);
+    } catch (const exception& e) {
+        cerr << e.what() << endl;
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,122 @@
+#include <prospect.h>
+#include <iostream>
+#include <format>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <vector>
+#include <string>
+#include "mock-server.h"
+
+using namespace std;
+
+static const string ews_ns = "xmlns:m=\"http://schemas.microsoft.com/exchange/services/2006/messages\" "
+                             "xmlns:t=\"http://schemas.microsoft.com/exchange/services/2006/types\"";
+
+static string message_xml(string_view id) {
+    return format("<t:Message><t:ItemId Id=\"{}\" ChangeKey=\"CK{}\"/><t:Subject>Subject {}</t:Subject>"
+                  "<t:DateTimeReceived>2024-01-01T00:00:00Z</t:DateTimeReceived><t:IsRead>false</t:IsRead>"
+                  "<t:HasAttachments>false</t:HasAttachments><t:Body BodyType=\"Text\">Body of {}</t:Body></t:Message>",
+                  id, id, id, id);
+}
+
+static string handle_request(string_view req) {
+    if (req.find("<m:GetItem") != string_view::npos) {
+        auto pos = req.find("<t:ItemId Id=\"");
+
+        if (pos == string_view::npos)
+            throw runtime_error("ItemId not found.");
+
+        auto id = req.substr(pos + 14);
+
+        id = id.substr(0, id.find('"'));
+
+        return format("<m:GetItemResponse {}><m:ResponseMessages><m:GetItemResponseMessage ResponseClass=\"Success\">"
+                      "<m:ResponseCode>NoError</m:ResponseCode><m:Items>{}</m:Items></m:GetItemResponseMessage>"
+                      "</m:ResponseMessages></m:GetItemResponse>", ews_ns, message_xml(id));
+    }
+
+    if (req.find("<m:FindItem") != string_view::npos) {
+        string items;
+
+        for (unsigned int i = 0; i < 50; i++) {
+            items += message_xml("item" + to_string(i));
+        }
+
+        return format("<m:FindItemResponse {}><m:ResponseMessages><m:FindItemResponseMessage ResponseClass=\"Success\">"
+                      "<m:ResponseCode>NoError</m:ResponseCode><m:RootFolder TotalItemsInView=\"50\" "
+                      "IncludesLastItemInRange=\"true\"><t:Items>{}</t:Items></m:RootFolder></m:FindItemResponseMessage>"
+                      "</m:ResponseMessages></m:FindItemResponse>", ews_ns, items);
+    }
+
+    throw runtime_error("Unexpected request.");
+}
+
+// Hammers one shared prospect object from many threads at once, checking that
+// every response comes back to the thread that asked for it.
+int main(int argc, char* argv[]) {
+    unsigned int num_threads = argc > 1 ? (unsigned int)stoul(argv[1]) : 8;
+    unsigned int per_thread = argc > 2 ? (unsigned int)stoul(argv[2]) : 1000;
+
+    try {
+        mock_server server(handle_request);
+        auto p = prospect::prospect::from_url(server.url());
+        atomic<unsigned int> errors = 0;
+        vector<thread> threads;
+
+        auto start = chrono::steady_clock::now();
+
+        for (unsigned int t = 0; t < num_threads; t++) {
+            threads.emplace_back([&, t]() {
+                try {
+                    for (unsigned int i = 0; i < per_thread; i++) {
+                        if (i % 10 == 0) {
+                            unsigned int count = 0;
+
+                            p.find_items("inbox", [&](const prospect::mail_item&) {
+                                count++;
+                                return true;
+                            });
+
+                            if (count != 50)
+                                errors++;
+                        } else {
+                            auto id = format("t{}i{}", t, i);
+
+                            auto found = p.get_item(id, [&](const prospect::mail_item& item) {
+                                if (item.id != id || item.subject != "Subject " + id)
+                                    errors++;
+
+                                return true;
+                            });
+
+                            if (!found)
+                                errors++;
+                        }
+                    }
+                } catch (const exception& e) {
+                    cerr << "Thread " << t << ": " << e.what() << endl;
+                    errors++;
+                }
+            });
+        }
+
+        for (auto& t : threads) {
+            t.join();
+        }
+
+        auto elapsed = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        auto requests = server.requests();
+
+        cout << format("threads: {}\nrequests: {}\nconnections: {}\nerrors: {}\nelapsed: {:.3f} s\nthroughput: {:.0f} req/s\n",
+                       num_threads, requests, server.connections(), (unsigned int)errors, elapsed, requests / elapsed);
+
+        if (errors != 0)
+            return 1;
+    } catch (const exception& e) {
+        cerr << e.what() << endl;
+        return 1;
+    }
+
+    return 0;
+}
@@ -6,24 +6,6 @@
 
 using namespace std;
 
-static const prospect::folder& find_inbox(const vector<prospect::folder>& folders) {
-    for (const auto& f : folders) {
-        if (f.display_name == "Inbox")
-            return f;
-    }
-
-    throw runtime_error("Folder \"Inbox\" not found.");
-}
-
-static const prospect::folder& find_folder(string_view parent, string_view name, const vector<prospect::folder>& folders) {
-    for (const auto& f : folders) {
-        if (f.parent == parent && f.display_name == name)
-            return f;
-    }
-
-    throw runtime_error("Could not find folder " + string(name) + " with parent " + string(parent) + ".");
-}
-
 static void main2() {
     prospect::prospect p;
 
@@ -36,35 +18,46 @@ static void main2() {
                        f.id, f.parent, f.change_key, f.display_name, f.total_count, f.child_folder_count, f.unread_count);
     }
 
-    const auto& inbox = find_inbox(folders);
+    auto inbox = folders.find_path("Inbox");
+
+    if (!inbox)
+        throw runtime_error("Folder \"Inbox\" not found.");
+
+    auto dir = folders.find(inbox->id, "Juno");
 
-    const auto& dir = find_folder(inbox.id, "Juno", folders);
-    const auto& processed_dir_id = p.create_folder(dir.id, "processed", folders);
+    if (!dir)
+        throw runtime_error("Could not find folder Juno with parent " + inbox->id + ".");
 
-    p.find_items(dir.id, [&](const prospect::mail_item& item) {
+    const auto& processed_dir_id = p.create_folder(dir->id, "processed", folders);
+    vector<string> processed;
+
+    p.find_items(dir->id, [&](const prospect::mail_item& item) {
         cout << format("Message {}, subject {}, received {}, read {}, has attachments {}, sender {} <{}>\n", item.id, item.subject,
                        item.received, item.read, item.has_attachments, item.sender_name, item.sender_email);
 
         if (item.has_attachments) {
             auto attachments = p.get_attachments(item.id);
 
-            for (const auto& att : attachments) {
+            p.read_attachments(attachments, [](const prospect::attachment& att, string_view content) {
                 cout << format("Attachment: ID {}, name {}, size {}, modified {}\n", att.id, att.name, att.size, att.modified);
 
-                auto str = p.read_attachment(att.id);
-
-                cout << format("Content: {}\n", str);
+                cout << format("Content: {}\n", content);
 
                 // FIXME - save attachment
-            }
+            });
         }
 
-        p.move_item(item.id, processed_dir_id);
+        processed.push_back(item.id);
 
         return true;
     });
 
-    prospect::subscription sub(p, inbox.id, { prospect::event::new_mail });
+    for (const auto& res : p.move_items(processed, processed_dir_id)) {
+        if (!res.success())
+            cerr << format("Failed to move item ({})\n", res.response_code);
+    }
+
+    prospect::subscription sub(p, inbox->id, { prospect::event::new_mail });
 
     sub.wait(1, [](enum prospect::event type, string_view timestamp, string_view item_id, string_view item_change_key, string_view parent_id, string_view parent_change_key) {
         cout << format("type = {}, timestamp = {}, item_id = {}, item_change_key = {}, parent_id = {}, parent_change_key = {}\n",
@@ -4,16 +4,32 @@
 #include <string>
 #include <iostream>
 #include <map>
+#include <future>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <fstream>
+#include <deque>
+#include <condition_variable>
+#include <semaphore>
+#include <optional>
+#include <chrono>
 #include <format>
+#include <algorithm>
 #include "prospect.h"
 #include "xml.h"
 #include "soap.h"
 #include "b64.h"
 #include "misc.h"
 
-#ifndef _WIN32
+#ifdef _WIN32
+#include <windns.h>
+#else
 #include <unistd.h>
 #include <netdb.h>
+#include <netinet/in.h>
+#include <arpa/nameser.h>
+#include <resolv.h>
 #endif
 
 using namespace std;
@@ -39,15 +55,24 @@ static string get_domain_name() {
     if (gethostname(hostname, sizeof(hostname)))
         throw formatted_error("gethostname failed (errno = {})", errno);
 
-    auto ent = gethostbyname(hostname);
+    addrinfo hints = {};
+    addrinfo* res;
+
+    hints.ai_flags = AI_CANONNAME;
+
+    auto err = getaddrinfo(hostname, nullptr, &hints, &res);
 
-    if (!ent)
-        throw formatted_error("gethostbyname returned NULL");
+    if (err != 0)
+        throw formatted_error("getaddrinfo failed ({})", gai_strerror(err));
 
-    if (!ent->h_name)
-        throw formatted_error("ent->h_name was NULL");
+    if (!res->ai_canonname) {
+        freeaddrinfo(res);
+        throw formatted_error("getaddrinfo did not return a canonical name");
+    }
+
+    string name = res->ai_canonname;
 
-    string name = ent->h_name;
+    freeaddrinfo(res);
 
     auto pos = name.find(".");
 
@@ -58,28 +83,36 @@ static string get_domain_name() {
 #endif
 }
 
+static string autodiscover(const string& domain);
+
 prospect::prospect(string_view domain) {
     string dom;
 
-    curl_global_init(CURL_GLOBAL_DEFAULT);
-
-    if (domain.empty())
-        dom = get_domain_name();
-    else
-        dom = domain;
+    acquire_libraries();
 
-    map<string, string> settings{ { "ExternalEwsUrl", "" } };
+    try {
+        if (domain.empty())
+            dom = get_domain_name();
+        else
+            dom = domain;
 
-    get_domain_settings("https://autodiscover." + dom + "/autodiscover/autodiscover.svc", dom, settings);
+        url = autodiscover(dom);
+    } catch (...) {
+        release_libraries();
+        throw;
+    }
+}
 
-    if (settings.at("ExternalEwsUrl").empty())
-        throw formatted_error("Could not find value for ExternalEwsUrl.");
+prospect::prospect(url_tag, string_view url) : url(url) {
+    acquire_libraries();
+}
 
-    url = settings.at("ExternalEwsUrl");
+prospect prospect::from_url(string_view url) {
+    return prospect(url_tag{}, url);
 }
 
 prospect::~prospect() {
-    curl_global_cleanup();
+    release_libraries();
 }
 
 static void parse_get_user_settings_response(xmlNodePtr n, map<string, string>& settings) {
@@ -141,7 +174,7 @@ void prospect::get_user_settings(const string& url, string_view mailbox, map<str
 
     auto ret = s.get(url, "http://schemas.microsoft.com/exchange/2010/Autodiscover/Autodiscover/GetUserSettings", header, req.dump());
 
-    xmlDocPtr doc = xmlReadMemory(ret.data(), (int)ret.length(), nullptr, nullptr, 0);
+    xmlDocPtr doc = read_xml(ret);
 
     if (!doc)
         throw formatted_error("Could not parse response.");
@@ -184,11 +217,17 @@ static void parse_get_domain_settings_response(xmlNodePtr n, map<string, string>
     });
 }
 
-void prospect::get_domain_settings(const string& url, string_view domain, map<string, string>& settings) {
-    soap s;
-    xml_writer req;
+// a literal rather than a string, as the SRV lookup in autodiscover may still be
+// using it after static destructors have run
+static constexpr string_view domain_settings_action = "http://schemas.microsoft.com/exchange/2010/Autodiscover/Autodiscover/GetDomainSettings";
+
+static string domain_settings_header(string_view url) {
+    return format("<a:RequestedServerVersion>Exchange2010</a:RequestedServerVersion><wsa:Action>{}</wsa:Action><wsa:To>{}</wsa:To>",
+                  domain_settings_action, url);
+}
 
-    static const string action = "http://schemas.microsoft.com/exchange/2010/Autodiscover/Autodiscover/GetDomainSettings";
+static string domain_settings_request(string_view domain, const map<string, string>& settings) {
+    xml_writer req;
 
     req.start_document();
     req.start_element("a:GetDomainSettingsRequestMessage");
@@ -209,11 +248,11 @@ void prospect::get_domain_settings(const string& url, string_view domain, map<st
     req.end_element();
     req.end_element();
 
-    string header = "<a:RequestedServerVersion>Exchange2010</a:RequestedServerVersion><wsa:Action>" + action + "</wsa:Action><wsa:To>" + url + "</wsa:To>";
-
-    auto ret = s.get(url, "http://schemas.microsoft.com/exchange/2010/Autodiscover/Autodiscover/GetDomainSettings", header, req.dump());
+    return string(req.dump());
+}
 
-    xmlDocPtr doc = xmlReadMemory(ret.data(), (int)ret.length(), nullptr, nullptr, 0);
+static void parse_domain_settings(string_view ret, map<string, string>& settings) {
+    xmlDocPtr doc = read_xml(ret);
 
     if (!doc)
         throw formatted_error("Could not parse response.");
@@ -228,72 +267,200 @@ void prospect::get_domain_settings(const string& url, string_view domain, map<st
     xmlFreeDoc(doc);
 }
 
-void mail_item::send_email() const {
+void prospect::get_domain_settings(const string& url, string_view domain, map<string, string>& settings) {
     soap s;
-    xml_writer req;
 
-    req.start_document();
-    req.start_element("m:CreateItem");
-    req.attribute("MessageDisposition", "SendAndSaveCopy");
+    auto ret = s.get(url, string(domain_settings_action), domain_settings_header(url), domain_settings_request(domain, settings));
 
-    req.start_element("m:SavedItemFolderId");
-    req.start_element("t:DistinguishedFolderId");
-    req.attribute("Id", "sentitems");
-    req.end_element();
-    req.end_element();
+    parse_domain_settings(ret, settings);
+}
 
-    req.start_element("m:Items");
+struct srv_record {
+    string target;
+    uint16_t port, priority, weight;
+};
 
-    req.start_element("t:Message");
-    req.element_text("t:Subject", subject);
+// Returns the SRV records for name, most preferred first. Any failure just
+// means there aren't any.
+static vector<srv_record> srv_lookup(const string& name) {
+    vector<srv_record> ret;
 
-    req.start_element("t:Body");
-    req.attribute("BodyType", "HTML");
-    req.text(body);
-    req.end_element();
+#ifdef _WIN32
+    DNS_RECORDA* results;
 
-    if (!recipients.empty()) {
-        req.start_element("t:ToRecipients");
+    if (DnsQuery_A(name.c_str(), DNS_TYPE_SRV, DNS_QUERY_STANDARD, nullptr, (PDNS_RECORD*)&results, nullptr) != ERROR_SUCCESS)
+        return ret;
 
-        for (const auto& ad : recipients) {
-            req.start_element("t:Mailbox");
-            req.element_text("t:EmailAddress", ad);
-            req.end_element();
-        }
+    for (auto r = results; r; r = r->pNext) {
+        if (r->wType != DNS_TYPE_SRV || r->Flags.S.Section != DnsSectionAnswer)
+            continue;
 
-        req.end_element();
+        ret.emplace_back(r->Data.SRV.pNameTarget, r->Data.SRV.wPort, r->Data.SRV.wPriority, r->Data.SRV.wWeight);
     }
 
-    if (!cc.empty()) {
-        req.start_element("t:CcRecipients");
+    DnsRecordListFree(results, DnsFreeRecordList);
+#else
+    unsigned char answer[4096];
+    ns_msg msg;
+    struct __res_state st;
 
-        for (const auto& ad : cc) {
-            req.start_element("t:Mailbox");
-            req.element_text("t:EmailAddress", ad);
-            req.end_element();
-        }
+    memset(&st, 0, sizeof(st));
 
-        req.end_element();
+    if (res_ninit(&st) != 0)
+        return ret;
+
+    // the answer is no use once the race is over, so give up on a dead nameserver quickly
+    st.retrans = 2;
+    st.retry = 1;
+
+    auto len = res_nquery(&st, name.c_str(), ns_c_in, ns_t_srv, answer, sizeof(answer));
+
+    res_nclose(&st);
+
+    if (len < 0 || ns_initparse(answer, len, &msg) < 0)
+        return ret;
+
+    for (unsigned int i = 0; i < ns_msg_count(msg, ns_s_an); i++) {
+        ns_rr rr;
+        char target[NS_MAXDNAME];
+
+        if (ns_parserr(&msg, ns_s_an, (int)i, &rr) < 0 || ns_rr_type(rr) != ns_t_srv || ns_rr_rdlen(rr) < 7)
+            continue;
+
+        auto rdata = ns_rr_rdata(rr);
+
+        if (dn_expand(ns_msg_base(msg), ns_msg_end(msg), rdata + 6, target, sizeof(target)) < 0)
+            continue;
+
+        ret.emplace_back(target, (uint16_t)ns_get16(rdata + 4), (uint16_t)ns_get16(rdata), (uint16_t)ns_get16(rdata + 2));
+    }
+#endif
+
+    // a target of "." means the service definitely isn't available
+    erase_if(ret, [](const srv_record& r) {
+        return r.target.empty() || r.target == ".";
+    });
+
+    ranges::stable_sort(ret, [](const srv_record& a, const srv_record& b) {
+        if (a.priority != b.priority)
+            return a.priority < b.priority;
+
+        return a.weight > b.weight;
+    });
+
+    return ret;
+}
+
+static string autodiscover_url(string_view host, uint16_t port = 443) {
+    if (port == 443)
+        return format("https://{}/autodiscover/autodiscover.svc", host);
+    else
+        return format("https://{}:{}/autodiscover/autodiscover.svc", host, port);
+}
+
+static const auto autodiscover_timeout = chrono::seconds(30);
+
+// Autodiscover might be at the domain itself, at autodiscover.domain, or
+// wherever an SRV record for _autodiscover._tcp.domain points. Rather than try
+// them in turn, which would mean waiting for each dead one to time out, we ask
+// them all at once and go with whoever answers first. Returns the EWS URL.
+static string autodiscover(const string& domain) {
+    vector<race_candidate> candidates;
+
+    for (const auto& u : { autodiscover_url(domain), autodiscover_url("autodiscover." + domain) }) {
+        candidates.emplace_back(u, domain_settings_header(u));
     }
 
-    if (!bcc.empty()) {
-        req.start_element("t:BccRecipients");
+    // this can outlive us, so it gets its own copies of everything
+    auto lookup = [domain, candidates]() {
+        vector<race_candidate> found;
 
-        for (const auto& ad : bcc) {
-            req.start_element("t:Mailbox");
-            req.element_text("t:EmailAddress", ad);
-            req.end_element();
+        for (const auto& r : srv_lookup("_autodiscover._tcp." + domain)) {
+            auto u = autodiscover_url(r.target, r.port);
+
+            if (ranges::none_of(candidates, [&](const race_candidate& c) { return c.url == u; }) &&
+                ranges::none_of(found, [&](const race_candidate& c) { return c.url == u; })) {
+                found.emplace_back(u, domain_settings_header(u));
+            }
         }
 
+        return found;
+    };
+
+    map<string, string> settings{ { "ExternalEwsUrl", "" } };
+    string url;
+
+    soap::race(candidates, lookup, string(domain_settings_action), domain_settings_request(domain, settings),
+               [&](string_view ret) {
+        auto s = settings;
+
+        parse_domain_settings(ret, s);
+
+        if (s.at("ExternalEwsUrl").empty())
+            throw formatted_error("Could not find value for ExternalEwsUrl.");
+
+        url = s.at("ExternalEwsUrl");
+    }, autodiscover_timeout);
+
+    return url;
+}
+
+static void write_recipients(xml_writer& req, string_view tag, const vector<string>& addresses) {
+    if (addresses.empty())
+        return;
+
+    req.start_element(tag);
+
+    for (const auto& ad : addresses) {
+        req.start_element("t:Mailbox");
+        req.element_text("t:EmailAddress", ad);
         req.end_element();
     }
 
+    req.end_element();
+}
+
+static void write_importance(xml_writer& req, enum importance importance) {
     if (importance == importance::low)
         req.element_text("t:Importance", "Low");
     else if (importance == importance::high)
         req.element_text("t:Importance", "High");
+}
+
+static void write_message(xml_writer& req, const mail_item& item) {
+    req.start_element("t:Message");
+    req.element_text("t:Subject", item.subject);
+
+    req.start_element("t:Body");
+    req.attribute("BodyType", "HTML");
+    req.text(item.body);
+    req.end_element();
+
+    write_recipients(req, "t:ToRecipients", item.recipients);
+    write_recipients(req, "t:CcRecipients", item.cc);
+    write_recipients(req, "t:BccRecipients", item.bcc);
+    write_importance(req, item.importance);
+
+    req.end_element();
+}
+
+void mail_item::send_email() const {
+    soap s;
+    xml_writer req;
+
+    req.start_document();
+    req.start_element("m:CreateItem");
+    req.attribute("MessageDisposition", "SendAndSaveCopy");
 
+    req.start_element("m:SavedItemFolderId");
+    req.start_element("t:DistinguishedFolderId");
+    req.attribute("Id", "sentitems");
     req.end_element();
+    req.end_element();
+
+    req.start_element("m:Items");
+
+    write_message(req, *this);
 
     req.end_element();
 
@@ -301,7 +468,7 @@ void mail_item::send_email() const {
 
     auto ret = s.get(p.url, "", "<t:RequestServerVersion Version=\"Exchange2010\" />", req.dump());
 
-    xmlDocPtr doc = xmlReadMemory(ret.data(), (int)ret.length(), nullptr, nullptr, 0);
+    xmlDocPtr doc = read_xml(ret);
 
     if (!doc)
         throw formatted_error("Could not parse response.");
@@ -359,46 +526,10 @@ void mail_item::send_reply(string_view item_id, string_view change_key, bool rep
     if (!subject.empty())
         req.element_text("t:Subject", subject);
 
-    if (!recipients.empty()) {
-        req.start_element("t:ToRecipients");
-
-        for (const auto& ad : recipients) {
-            req.start_element("t:Mailbox");
-            req.element_text("t:EmailAddress", ad);
-            req.end_element();
-        }
-
-        req.end_element();
-    }
-
-    if (!cc.empty()) {
-        req.start_element("t:CcRecipients");
-
-        for (const auto& ad : cc) {
-            req.start_element("t:Mailbox");
-            req.element_text("t:EmailAddress", ad);
-            req.end_element();
-        }
-
-        req.end_element();
-    }
-
-    if (!bcc.empty()) {
-        req.start_element("t:BccRecipients");
-
-        for (const auto& ad : bcc) {
-            req.start_element("t:Mailbox");
-            req.element_text("t:EmailAddress", ad);
-            req.end_element();
-        }
-
-        req.end_element();
-    }
-
-    if (importance == importance::low)
-        req.element_text("t:Importance", "Low");
-    else if (importance == importance::high)
-        req.element_text("t:Importance", "High");
+    write_recipients(req, "t:ToRecipients", recipients);
+    write_recipients(req, "t:CcRecipients", cc);
+    write_recipients(req, "t:BccRecipients", bcc);
+    write_importance(req, importance);
 
     req.end_element();
 
@@ -408,7 +539,7 @@ void mail_item::send_reply(string_view item_id, string_view change_key, bool rep
 
     auto ret = s.get(p.url, "", "<t:RequestServerVersion Version=\"Exchange2010\" />", req.dump());
 
-    xmlDocPtr doc = xmlReadMemory(ret.data(), (int)ret.length(), nullptr, nullptr, 0);
+    xmlDocPtr doc = read_xml(ret);
 
     if (!doc)
         throw formatted_error("Could not parse response.");
@@ -435,13 +566,252 @@ void mail_item::send_reply(string_view item_id, string_view change_key, bool rep
     xmlFreeDoc(doc);
 }
 
+// results are returned in the same order as the messages that were passed in
+vector<item_result> prospect::send_emails(span<const mail_item> items) {
+    static const size_t max_batch_count = 100;
+    static const size_t max_batch_size = 8 * 1024 * 1024;
+
+    vector<item_result> results;
+    vector<string> batch;
+    size_t batch_size = 0;
+
+    results.reserve(items.size());
+
+    auto send_batch = [&]() {
+        soap s;
+        xml_writer req;
+        auto start = results.size();
+
+        req.start_document();
+        req.start_element("m:CreateItem");
+        req.attribute("MessageDisposition", "SendAndSaveCopy");
+
+        req.start_element("m:SavedItemFolderId");
+        req.start_element("t:DistinguishedFolderId");
+        req.attribute("Id", "sentitems");
+        req.end_element();
+        req.end_element();
+
+        req.start_element("m:Items");
+
+        for (const auto& msg : batch) {
+            req.raw(msg);
+        }
+
+        req.end_element();
+
+        req.end_element();
+
+        auto ret = s.get(url, "", "<t:RequestServerVersion Version=\"Exchange2010\" />", req.dump());
+
+        xmlDocPtr doc = read_xml(ret);
+
+        if (!doc)
+            throw formatted_error("Could not parse response.");
+
+        try {
+            auto response = find_tag(xmlDocGetRootElement(doc), messages_ns, "CreateItemResponse");
+
+            auto response_messages = find_tag(response, messages_ns, "ResponseMessages");
+
+            find_tags(response_messages, messages_ns, "CreateItemResponseMessage", [&](xmlNodePtr c) {
+                results.emplace_back("", find_tag_content(c, messages_ns, "ResponseCode"));
+
+                return true;
+            });
+
+            if (results.size() != start + batch.size())
+                throw formatted_error("CreateItem returned {} responses, expected {}.", results.size() - start, batch.size());
+        } catch (...) {
+            xmlFreeDoc(doc);
+            throw;
+        }
+
+        xmlFreeDoc(doc);
+
+        batch.clear();
+        batch_size = 0;
+    };
+
+    for (const auto& item : items) {
+        xml_writer msg;
+
+        write_message(msg, item);
+
+        auto frag = string(msg.dump());
+
+        if (!batch.empty() && (batch.size() == max_batch_count || batch_size + frag.length() > max_batch_size))
+            send_batch();
+
+        batch_size += frag.length();
+        batch.push_back(move(frag));
+    }
+
+    if (!batch.empty())
+        send_batch();
+
+    return results;
+}
+
 static void field_uri(xml_writer& req, string_view uri) {
     req.start_element("t:FieldURI");
     req.attribute("FieldURI", uri);
     req.end_element();
 }
 
-vector<folder> prospect::find_folders(string_view mailbox) {
+static string_view field_uri_name(item_field field) {
+    switch (field) {
+        case item_field::subject:
+            return "item:Subject";
+        case item_field::date_time_received:
+            return "item:DateTimeReceived";
+        case item_field::sender:
+            return "message:Sender";
+        case item_field::is_read:
+            return "message:IsRead";
+        case item_field::has_attachments:
+            return "item:HasAttachments";
+        case item_field::conversation_id:
+            return "item:ConversationId";
+        case item_field::internet_message_id:
+            return "message:InternetMessageId";
+        case item_field::importance:
+            return "item:Importance";
+        case item_field::to_recipients:
+            return "message:ToRecipients";
+        case item_field::cc_recipients:
+            return "message:CcRecipients";
+        case item_field::bcc_recipients:
+            return "message:BccRecipients";
+        case item_field::body:
+            return "item:Body";
+        default:
+            throw formatted_error("Unrecognized field {}.", (unsigned int)field);
+    }
+}
+
+static string_view containment_mode_name(containment_mode mode) {
+    switch (mode) {
+        case containment_mode::full_string:
+            return "FullString";
+        case containment_mode::prefixed:
+            return "Prefixed";
+        case containment_mode::substring:
+            return "Substring";
+        case containment_mode::prefix_on_words:
+            return "PrefixOnWords";
+        case containment_mode::exact_phrase:
+            return "ExactPhrase";
+        default:
+            throw formatted_error("Unrecognized containment mode {}.", (unsigned int)mode);
+    }
+}
+
+static void write_restriction(xml_writer& req, const restriction& r) {
+    string_view tag;
+
+    switch (r.type) {
+        case restriction_type::is_equal_to:
+            tag = "t:IsEqualTo";
+            break;
+
+        case restriction_type::is_not_equal_to:
+            tag = "t:IsNotEqualTo";
+            break;
+
+        case restriction_type::is_greater_than:
+            tag = "t:IsGreaterThan";
+            break;
+
+        case restriction_type::is_greater_than_or_equal_to:
+            tag = "t:IsGreaterThanOrEqualTo";
+            break;
+
+        case restriction_type::is_less_than:
+            tag = "t:IsLessThan";
+            break;
+
+        case restriction_type::is_less_than_or_equal_to:
+            tag = "t:IsLessThanOrEqualTo";
+            break;
+
+        case restriction_type::contains:
+            req.start_element("t:Contains");
+            req.attribute("ContainmentMode", containment_mode_name(r.mode));
+            req.attribute("ContainmentComparison", r.ignore_case ? "IgnoreCase" : "Exact");
+            field_uri(req, field_uri_name(r.field));
+            req.start_element("t:Constant");
+            req.attribute("Value", r.value);
+            req.end_element();
+            req.end_element();
+            return;
+
+        case restriction_type::exists:
+            req.start_element("t:Exists");
+            field_uri(req, field_uri_name(r.field));
+            req.end_element();
+            return;
+
+        case restriction_type::all:
+        case restriction_type::any:
+            req.start_element(r.type == restriction_type::all ? "t:And" : "t:Or");
+
+            for (const auto& c : r.children) {
+                write_restriction(req, c);
+            }
+
+            req.end_element();
+            return;
+
+        case restriction_type::negate:
+            if (r.children.size() != 1)
+                throw formatted_error("Not restriction must have exactly one child.");
+
+            req.start_element("t:Not");
+            write_restriction(req, r.children.front());
+            req.end_element();
+            return;
+
+        default:
+            throw formatted_error("Unrecognized restriction type {}.", (unsigned int)r.type);
+    }
+
+    req.start_element(tag);
+    field_uri(req, field_uri_name(r.field));
+    req.start_element("t:FieldURIOrConstant");
+    req.start_element("t:Constant");
+    req.attribute("Value", r.value);
+    req.end_element();
+    req.end_element();
+    req.end_element();
+}
+
+static folder parse_folder(xmlNodePtr c) {
+    auto folder_id = find_tag(c, types_ns, "FolderId");
+    auto parent = get_prop(find_tag(c, types_ns, "ParentFolderId"), "Id");
+    auto id = get_prop(folder_id, "Id");
+    auto change_key = get_prop(folder_id, "ChangeKey");
+
+    auto display_name = find_tag_content(c, types_ns, "DisplayName");
+    auto total_count = (unsigned int)stoul(find_tag_content(c, types_ns, "TotalCount"));
+    auto child_folder_count = (unsigned int)stoul(find_tag_content(c, types_ns, "ChildFolderCount"));
+    auto unread_count = (unsigned int)stoul(find_tag_content(c, types_ns, "UnreadCount"));
+
+    return folder(id, parent, change_key, display_name, total_count, child_folder_count, unread_count);
+}
+
+folder_tree prospect::find_folders(string_view mailbox) {
+    return fetch_folders(mailbox, pmr::get_default_resource());
+}
+
+folder_tree prospect::find_folders(string_view mailbox, pmr::memory_resource* mr) {
+    scoped_resource sr(mr);
+
+    return fetch_folders(mailbox, mr);
+}
+
+// The request's buffers come from the thread's request resource, the result's from mr.
+folder_tree prospect::fetch_folders(string_view mailbox, pmr::memory_resource* mr) {
     soap s;
     xml_writer req;
 
@@ -476,12 +846,12 @@ vector<folder> prospect::find_folders(string_view mailbox) {
 
     auto ret = s.get(url, "", "<t:RequestServerVersion Version=\"Exchange2010\" />", req.dump());
 
-    xmlDocPtr doc = xmlReadMemory(ret.data(), (int)ret.length(), nullptr, nullptr, 0);
+    xmlDocPtr doc = read_xml(ret);
 
     if (!doc)
         throw formatted_error("Could not parse response.");
 
-    vector<folder> folders;
+    folder_tree folders(mr);
 
     try {
         auto response = find_tag(xmlDocGetRootElement(doc), messages_ns, "FindFolderResponse");
@@ -503,17 +873,7 @@ vector<folder> prospect::find_folders(string_view mailbox) {
         auto folders_tag = find_tag(root_folder, types_ns, "Folders");
 
         find_tags(folders_tag, types_ns, "Folder", [&](xmlNodePtr c) {
-            auto folder_id = find_tag(c, types_ns, "FolderId");
-            auto parent = get_prop(find_tag(c, types_ns, "ParentFolderId"), "Id");
-            auto id = get_prop(folder_id, "Id");
-            auto change_key = get_prop(folder_id, "ChangeKey");
-
-            auto display_name = find_tag_content(c, types_ns, "DisplayName");
-            auto total_count = stoul(find_tag_content(c, types_ns, "TotalCount"));
-            auto child_folder_count = stoul(find_tag_content(c, types_ns, "ChildFolderCount"));
-            auto unread_count = stoul(find_tag_content(c, types_ns, "UnreadCount"));
-
-            folders.emplace_back(id, parent, change_key, display_name, total_count, child_folder_count, unread_count);
+            folders.insert(parse_folder(c));
 
             return true;
         });
@@ -527,762 +887,860 @@ vector<folder> prospect::find_folders(string_view mailbox) {
     return folders;
 }
 
-static enum importance parse_importance(string_view s) {
-    if (s == "Low")
-        return importance::low;
-    else if (s == "High")
-        return importance::high;
-    else if (s == "Normal" || s.empty())
-        return importance::normal;
+bool prospect::sync_folders(folder_hierarchy& h, string_view mailbox) {
+    bool changed = false, last;
 
-    throw formatted_error("Unknown importance {}.", s);
-}
+    do {
+        soap s;
+        xml_writer req;
 
-void prospect::find_items(string_view folder, const function<bool(const mail_item&)>& func) {
-    soap s;
-    xml_writer req;
+        req.start_document();
+        req.start_element("m:SyncFolderHierarchy");
 
-    req.start_document();
-    req.start_element("m:FindItem");
-    req.attribute("Traversal", "Shallow");
+        req.start_element("m:FolderShape");
+        req.element_text("t:BaseShape", "Default");
 
-    req.start_element("m:ItemShape");
-    req.element_text("t:BaseShape", "IdOnly");
+        req.start_element("t:AdditionalProperties");
+        field_uri(req, "folder:ParentFolderId");
+        req.end_element();
 
-    req.start_element("t:AdditionalProperties");
-    field_uri(req, "item:Subject");
-    field_uri(req, "item:DateTimeReceived");
-    field_uri(req, "message:Sender");
-    field_uri(req, "message:IsRead");
-    field_uri(req, "item:HasAttachments");
-    field_uri(req, "item:ConversationId");
-    field_uri(req, "message:InternetMessageId");
-    field_uri(req, "item:Importance");
-    req.end_element();
-    req.end_element();
+        req.end_element();
 
-    // Exchange ignores message:ToRecipients, message:CcRecipients, and message:BccRecipients in FindItem
+        req.start_element("m:SyncFolderId");
+        req.start_element("t:DistinguishedFolderId");
+        req.attribute("Id", "root");
 
-    req.start_element("m:SortOrder");
-    req.start_element("t:FieldOrder");
-    req.attribute("Order", "Ascending");
-    field_uri(req, "item:DateTimeReceived");
-    req.end_element();
-    req.end_element();
-
-    req.start_element("m:ParentFolderIds");
-    req.start_element("t:FolderId");
-    req.attribute("Id", folder);
-    req.end_element();
-    req.end_element();
-
-    req.end_element();
+        if (!mailbox.empty()) {
+            req.start_element("t:Mailbox");
+            req.element_text("t:EmailAddress", mailbox);
+            req.end_element();
+        }
 
-    // FIXME - only get so many at once?
+        req.end_element();
+        req.end_element();
 
-    auto ret = s.get(url, "", "<t:RequestServerVersion Version=\"Exchange2010\" />", req.dump());
+        if (!h.sync_state.empty())
+            req.element_text("m:SyncState", h.sync_state);
 
-    xmlDocPtr doc = xmlReadMemory(ret.data(), (int)ret.length(), nullptr, nullptr, 0);
+        req.end_element();
 
-    if (!doc)
-        throw formatted_error("Could not parse response.");
+        auto ret = s.get(url, "", "<t:RequestServerVersion Version=\"Exchange2010\" />", req.dump());
 
-    try {
-        auto response = find_tag(xmlDocGetRootElement(doc), messages_ns, "FindItemResponse");
+        xmlDocPtr doc = read_xml(ret);
 
-        auto response_messages = find_tag(response, messages_ns, "ResponseMessages");
+        if (!doc)
+            throw formatted_error("Could not parse response.");
 
-        auto ffrm = find_tag(response_messages, messages_ns, "FindItemResponseMessage");
+        try {
+            auto response = find_tag(xmlDocGetRootElement(doc), messages_ns, "SyncFolderHierarchyResponse");
 
-        auto response_class = get_prop(ffrm, "ResponseClass");
+            auto response_messages = find_tag(response, messages_ns, "ResponseMessages");
 
-        if (response_class != "Success") {
-            auto response_code = find_tag_content(ffrm, messages_ns, "ResponseCode");
+            auto sfhrm = find_tag(response_messages, messages_ns, "SyncFolderHierarchyResponseMessage");
 
-            throw formatted_error("FindItem failed ({}, {}).", response_class, response_code);
-        }
+            auto response_class = get_prop(sfhrm, "ResponseClass");
 
-        auto root_folder = find_tag(ffrm, messages_ns, "RootFolder");
+            if (response_class != "Success") {
+                auto response_code = find_tag_content(sfhrm, messages_ns, "ResponseCode");
 
-        auto items_tag = find_tag(root_folder, types_ns, "Items");
+                throw formatted_error("SyncFolderHierarchy failed ({}, {}).", response_class, response_code);
+            }
 
-        find_tags(items_tag, types_ns, "Message", [&](xmlNodePtr c) {
-            auto id = get_prop(find_tag(c, types_ns, "ItemId"), "Id");
-            auto change_key = get_prop(find_tag(c, types_ns, "ItemId"), "ChangeKey");
-            auto subj = find_tag_content(c, types_ns, "Subject");
-            auto received = find_tag_content(c, types_ns, "DateTimeReceived");
-            bool read = find_tag_content(c, types_ns, "IsRead") == "true";
-            bool has_attachments = find_tag_content(c, types_ns, "HasAttachments") == "true";
+            auto changes = find_tag(sfhrm, messages_ns, "Changes");
 
-            auto sender = find_tag(c, types_ns, "Sender");
-            auto sender_mailbox = find_tag(sender, types_ns, "Mailbox");
+            for (auto c = changes->children; c; c = c->next) {
+                if (c->type != XML_ELEMENT_NODE || !c->ns || strcmp((char*)c->ns->href, types_ns.c_str()))
+                    continue;
 
-            auto sender_name = find_tag_content(sender_mailbox, types_ns, "Name");
-            auto sender_email = find_tag_content(sender_mailbox, types_ns, "EmailAddress");
+                if (!strcmp((char*)c->name, "Create") || !strcmp((char*)c->name, "Update")) {
+                    // as with find_folders, only mail folders are tracked
+                    find_tags(c, types_ns, "Folder", [&](xmlNodePtr c) {
+                        h.folders.insert(parse_folder(c));
+                        changed = true;
 
-            auto conversation_id = find_tag_prop(c, types_ns, "ConversationId", "Id");
-            auto internet_id = find_tag_content(c, types_ns, "InternetMessageId");
+                        return false;
+                    });
+                } else if (!strcmp((char*)c->name, "Delete")) {
+                    if (h.folders.erase(find_tag_prop(c, types_ns, "FolderId", "Id")) != 0)
+                        changed = true;
+                }
+            }
 
-            mail_item item(*this);
+            h.sync_state = find_tag_content(sfhrm, messages_ns, "SyncState");
+            last = find_tag_content(sfhrm, messages_ns, "IncludesLastFolderInRange") != "false";
+        } catch (...) {
+            xmlFreeDoc(doc);
+            throw;
+        }
 
-            item.id = id;
-            item.subject = subj;
-            item.received = received;
-            item.read = read;
-            item.sender_name = sender_name;
-            item.sender_email = sender_email;
-            item.has_attachments = has_attachments;
-            item.conversation_id = conversation_id;
-            item.internet_id = internet_id;
-            item.change_key = change_key;
-            item.importance = parse_importance(find_tag_content(c, types_ns, "Importance"));
-
-            return func(item);
-        });
-    } catch (...) {
         xmlFreeDoc(doc);
-        throw;
-    }
+    } while (!last);
 
-    xmlFreeDoc(doc);
+    return changed;
 }
 
-bool prospect::get_item(string_view id, const function<bool(const mail_item&)>& func) {
-    soap s;
-    xml_writer req;
-    bool found = false;
-
-    req.start_document();
-    req.start_element("m:GetItem");
+static enum importance parse_importance(string_view s) {
+    if (s == "Low")
+        return importance::low;
+    else if (s == "High")
+        return importance::high;
+    else if (s == "Normal" || s.empty())
+        return importance::normal;
 
-    req.start_element("m:ItemShape");
-    req.element_text("t:BaseShape", "IdOnly");
+    throw formatted_error("Unknown importance {}.", s);
+}
 
-    req.start_element("t:AdditionalProperties");
-    field_uri(req, "item:Subject");
-    field_uri(req, "item:DateTimeReceived");
-    field_uri(req, "message:Sender");
-    field_uri(req, "message:IsRead");
-    field_uri(req, "item:HasAttachments");
-    field_uri(req, "item:ConversationId");
-    field_uri(req, "message:InternetMessageId");
-    field_uri(req, "message:ToRecipients");
-    field_uri(req, "message:CcRecipients");
-    field_uri(req, "message:BccRecipients");
-    field_uri(req, "item:Body");
-    field_uri(req, "item:Importance");
-    req.end_element();
-    req.end_element();
+static void parse_recipients(xmlNodePtr c, string_view tag, vector<string>& v) {
+    find_tags(c, types_ns, string(tag), [&](xmlNodePtr c) {
+        find_tags(c, types_ns, "Mailbox", [&](xmlNodePtr c) {
+            auto addr = find_tag_content(c, types_ns, "EmailAddress");
 
-    req.start_element("m:ItemIds");
-    req.start_element("t:ItemId");
-    req.attribute("Id", id);
-    req.end_element();
-    req.end_element();
+            if (!addr.empty())
+                v.push_back(addr);
 
-    req.end_element();
+            return true;
+        });
 
-    auto ret = s.get(url, "", "<t:RequestServerVersion Version=\"Exchange2010\" />", req.dump());
+        return false;
+    });
+}
 
-    xmlDocPtr doc = xmlReadMemory(ret.data(), (int)ret.length(), nullptr, nullptr, 0);
+static void parse_message(xmlNodePtr c, mail_item& item, item_field fields) {
+    auto item_id = find_tag(c, types_ns, "ItemId");
 
-    if (!doc)
-        throw formatted_error("Could not parse response.");
+    item.id = get_prop(item_id, "Id");
+    item.change_key = get_prop(item_id, "ChangeKey");
 
-    try {
-        auto response = find_tag(xmlDocGetRootElement(doc), messages_ns, "GetItemResponse");
+    if (has_field(fields, item_field::subject))
+        item.subject = find_tag_content(c, types_ns, "Subject");
 
-        auto response_messages = find_tag(response, messages_ns, "ResponseMessages");
+    if (has_field(fields, item_field::date_time_received))
+        item.received = find_tag_content(c, types_ns, "DateTimeReceived");
 
-        auto girm = find_tag(response_messages, messages_ns, "GetItemResponseMessage");
+    if (has_field(fields, item_field::is_read))
+        item.read = find_tag_content(c, types_ns, "IsRead") == "true";
 
-        auto response_class = get_prop(girm, "ResponseClass");
+    if (has_field(fields, item_field::has_attachments))
+        item.has_attachments = find_tag_content(c, types_ns, "HasAttachments") == "true";
 
-        if (response_class != "Success") {
-            auto response_code = find_tag_content(girm, messages_ns, "ResponseCode");
+    if (has_field(fields, item_field::sender)) {
+        find_tags(c, types_ns, "Sender", [&](xmlNodePtr c) {
+            find_tags(c, types_ns, "Mailbox", [&](xmlNodePtr c) {
+                item.sender_name = find_tag_content(c, types_ns, "Name");
+                item.sender_email = find_tag_content(c, types_ns, "EmailAddress");
 
-            if (response_code == "ErrorItemNotFound") {
-                xmlFreeDoc(doc);
                 return false;
-            }
-
-            throw formatted_error("GetItem failed ({}, {}).", response_class, response_code);
-        }
-
-        auto items_tag = find_tag(girm, messages_ns, "Items");
-
-        find_tags(items_tag, types_ns, "Message", [&](xmlNodePtr c) {
-            auto id = get_prop(find_tag(c, types_ns, "ItemId"), "Id");
-            auto change_key = get_prop(find_tag(c, types_ns, "ItemId"), "ChangeKey");
-            auto subj = find_tag_content(c, types_ns, "Subject");
-            auto received = find_tag_content(c, types_ns, "DateTimeReceived");
-            bool read = find_tag_content(c, types_ns, "IsRead") == "true";
-            bool has_attachments = find_tag_content(c, types_ns, "HasAttachments") == "true";
+            });
 
-            auto sender = find_tag(c, types_ns, "Sender");
-            auto sender_mailbox = find_tag(sender, types_ns, "Mailbox");
+            return false;
+        });
+    }
 
-            auto sender_name = find_tag_content(sender_mailbox, types_ns, "Name");
-            auto sender_email = find_tag_content(sender_mailbox, types_ns, "EmailAddress");
+    if (has_field(fields, item_field::conversation_id))
+        item.conversation_id = find_tag_prop(c, types_ns, "ConversationId", "Id");
 
-            auto conversation_id = find_tag_prop(c, types_ns, "ConversationId", "Id");
-            auto internet_id = find_tag_content(c, types_ns, "InternetMessageId");
+    if (has_field(fields, item_field::internet_message_id))
+        item.internet_id = find_tag_content(c, types_ns, "InternetMessageId");
 
-            mail_item item(*this);
+    if (has_field(fields, item_field::importance))
+        item.importance = parse_importance(find_tag_content(c, types_ns, "Importance"));
 
-            item.id = id;
-            item.subject = subj;
-            item.received = received;
-            item.read = read;
-            item.sender_name = sender_name;
-            item.sender_email = sender_email;
-            item.has_attachments = has_attachments;
-            item.conversation_id = conversation_id;
-            item.internet_id = internet_id;
-            item.change_key = change_key;
+    if (has_field(fields, item_field::to_recipients))
+        parse_recipients(c, "ToRecipients", item.recipients);
 
-            find_tags(c, types_ns, "ToRecipients", [&](xmlNodePtr c) {
-                find_tags(c, types_ns, "Mailbox", [&](xmlNodePtr c) {
-                    auto addr = find_tag_content(c, types_ns, "EmailAddress");
+    if (has_field(fields, item_field::cc_recipients))
+        parse_recipients(c, "CcRecipients", item.cc);
 
-                    if (!addr.empty())
-                        item.recipients.push_back(addr);
+    if (has_field(fields, item_field::bcc_recipients))
+        parse_recipients(c, "BccRecipients", item.bcc);
 
-                    return true;
-                });
+    if (has_field(fields, item_field::body))
+        item.body = find_tag_content(c, types_ns, "Body");
+}
 
-                return false;
-            });
+static void write_item_shape(xml_writer& req, const item_shape& shape) {
+    req.start_element("m:ItemShape");
+    req.element_text("t:BaseShape", "IdOnly");
 
-            find_tags(c, types_ns, "CcRecipients", [&](xmlNodePtr c) {
-                find_tags(c, types_ns, "Mailbox", [&](xmlNodePtr c) {
-                    auto addr = find_tag_content(c, types_ns, "EmailAddress");
+    if (has_field(shape.fields, item_field::body)) {
+        switch (shape.body_type) {
+            case body_type::html:
+                req.element_text("t:BodyType", "HTML");
+                break;
 
-                    if (!addr.empty())
-                        item.cc.push_back(addr);
+            case body_type::text:
+                req.element_text("t:BodyType", "Text");
+                break;
 
-                    return true;
-                });
+            default:
+                break;
+        }
 
-                return false;
-            });
+        if (shape.max_body_size != 0)
+            req.element_text("t:MaximumBodySize", to_string(shape.max_body_size));
+    }
 
-            find_tags(c, types_ns, "BccRecipients", [&](xmlNodePtr c) {
-                find_tags(c, types_ns, "Mailbox", [&](xmlNodePtr c) {
-                    auto addr = find_tag_content(c, types_ns, "EmailAddress");
+    if (shape.fields != item_field{}) {
+        req.start_element("t:AdditionalProperties");
 
-                    if (!addr.empty())
-                        item.bcc.push_back(addr);
+        for (uint32_t f = 1; f <= (uint32_t)item_field::body; f <<= 1) {
+            if (has_field(shape.fields, (item_field)f))
+                field_uri(req, field_uri_name((item_field)f));
+        }
 
-                    return true;
-                });
+        req.end_element();
+    }
 
-                return false;
-            });
+    req.end_element();
+}
 
-            item.body = find_tag_content(c, types_ns, "Body");
-            item.importance = parse_importance(find_tag_content(c, types_ns, "Importance"));
+static string request_header(const item_shape& shape) {
+    // MaximumBodySize was added in Exchange 2013
+    if (has_field(shape.fields, item_field::body) && shape.max_body_size != 0)
+        return "<t:RequestServerVersion Version=\"Exchange2013\" />";
 
-            found = true;
-            func(item);
+    return "<t:RequestServerVersion Version=\"Exchange2010\" />";
+}
 
-            return false;
-        });
-    } catch (...) {
-        xmlFreeDoc(doc);
-        throw;
-    }
+// Exchange ignores message:ToRecipients, message:CcRecipients, and message:BccRecipients
+// in FindItem, and rejects item:Body, so they're left out of what we ask for
+static item_shape find_items_shape(const item_shape& shape) {
+    auto ret = shape;
 
-    xmlFreeDoc(doc);
+    ret.fields = ret.fields & ~(item_field::to_recipients | item_field::cc_recipients | item_field::bcc_recipients |
+                                item_field::body);
+    ret.max_body_size = 0;
 
-    return found;
+    return ret;
 }
 
-vector<attachment> prospect::get_attachments(string_view item_id) {
-    soap s;
+// shape should already have been through find_items_shape
+static string find_items_request(string_view folder, const restriction& restr, const item_shape& shape, unsigned int page_size,
+                                 unsigned int offset) {
     xml_writer req;
 
     req.start_document();
-    req.start_element("m:GetItem");
+    req.start_element("m:FindItem");
+    req.attribute("Traversal", "Shallow");
 
-    req.start_element("m:ItemShape");
-    req.element_text("t:BaseShape", "IdOnly");
-    req.start_element("t:AdditionalProperties");
-    field_uri(req, "item:Attachments");
-    req.end_element();
+    write_item_shape(req, shape);
+
+    req.start_element("m:IndexedPageItemView");
+    req.attribute("MaxEntriesReturned", to_string(page_size));
+    req.attribute("Offset", to_string(offset));
+    req.attribute("BasePoint", "Beginning");
     req.end_element();
 
-    req.start_element("m:ItemIds");
-    req.start_element("t:ItemId");
-    req.attribute("Id", item_id);
+    if (restr.type != restriction_type::none) {
+        req.start_element("m:Restriction");
+        write_restriction(req, restr);
+        req.end_element();
+    }
+
+    req.start_element("m:SortOrder");
+    req.start_element("t:FieldOrder");
+    req.attribute("Order", "Ascending");
+    field_uri(req, "item:DateTimeReceived");
     req.end_element();
     req.end_element();
 
+    req.start_element("m:ParentFolderIds");
+    req.start_element("t:FolderId");
+    req.attribute("Id", folder);
+    req.end_element();
     req.end_element();
 
-    auto ret = s.get(url, "", "<t:RequestServerVersion Version=\"Exchange2010\" />", req.dump());
-
-    xmlDocPtr doc = xmlReadMemory(ret.data(), (int)ret.length(), nullptr, nullptr, 0);
+    req.end_element();
 
-    if (!doc)
-        throw formatted_error("Could not parse response.");
+    return string(req.dump());
+}
 
-    vector<attachment> v;
+// Returns the offset of the page after this one, or nullopt if this was the last.
+static optional<unsigned int> find_items_page(xmlDocPtr doc, xmlNodePtr& items_tag) {
+    auto response = find_tag(xmlDocGetRootElement(doc), messages_ns, "FindItemResponse");
 
-    try {
-        auto response = find_tag(xmlDocGetRootElement(doc), messages_ns, "GetItemResponse");
+    auto response_messages = find_tag(response, messages_ns, "ResponseMessages");
 
-        auto response_messages = find_tag(response, messages_ns, "ResponseMessages");
+    auto ffrm = find_tag(response_messages, messages_ns, "FindItemResponseMessage");
 
-        auto ffrm = find_tag(response_messages, messages_ns, "GetItemResponseMessage");
+    auto response_class = get_prop(ffrm, "ResponseClass");
 
-        auto response_class = get_prop(ffrm, "ResponseClass");
+    if (response_class != "Success") {
+        auto response_code = find_tag_content(ffrm, messages_ns, "ResponseCode");
 
-        if (response_class != "Success") {
-            auto response_code = find_tag_content(ffrm, messages_ns, "ResponseCode");
+        throw formatted_error("FindItem failed ({}, {}).", response_class, response_code);
+    }
 
-            throw formatted_error("GetItem failed ({}, {}).", response_class, response_code);
-        }
+    auto root_folder = find_tag(ffrm, messages_ns, "RootFolder");
 
-        auto items_tag = find_tag(ffrm, messages_ns, "Items");
+    items_tag = find_tag(root_folder, types_ns, "Items");
 
-        find_tags(items_tag, types_ns, "Message", [&](xmlNodePtr c) {
-            auto attachments = find_tag(c, types_ns, "Attachments");
+    if (get_prop(root_folder, "IncludesLastItemInRange") != "false")
+        return nullopt;
 
-            find_tags(attachments, types_ns, "FileAttachment", [&](xmlNodePtr c) {
-                bool is_inline = find_tag_content(c, types_ns, "IsInline") == "true";
-                bool is_contact_photo = find_tag_content(c, types_ns, "IsContactPhoto") == "true";
+    auto next_offset = get_prop(root_folder, "IndexedPagingOffset");
 
-                if (!is_inline && !is_contact_photo) {
-                    auto id = get_prop(find_tag(c, types_ns, "AttachmentId"), "Id");
-                    auto name = find_tag_content(c, types_ns, "Name");
-                    auto size = stoull(find_tag_content(c, types_ns, "Size"));
-                    auto modified = find_tag_content(c, types_ns, "LastModifiedTime");
+    if (next_offset.empty())
+        throw formatted_error("IndexedPagingOffset not returned.");
 
-                    v.emplace_back(id, name, size, modified);
-                }
+    return (unsigned int)stoul(next_offset);
+}
 
-                return true;
-            });
+void prospect::find_items(string_view folder, const function<bool(const mail_item&)>& func, const item_shape& shape,
+                          unsigned int page_size, unsigned int offset) {
+    find_items(folder, restriction(), func, shape, page_size, offset);
+}
 
-            return true;
+// A request made on another thread for the next page of find_items, which
+// can be called off if the caller stops before it's wanted. The soap is made
+// on that thread, so that its buffers come from that thread's resource.
+class page_prefetch {
+public:
+    page_prefetch(function<pmr::string(soap&)> fetch) {
+        result = async(launch::async, [this, fetch = move(fetch)]() {
+            return run(fetch);
         });
-    } catch (...) {
-        xmlFreeDoc(doc);
-        throw;
     }
 
-    xmlFreeDoc(doc);
-
-    return v;
-}
+    ~page_prefetch() {
+        if (!result.valid())
+            return;
 
-string prospect::read_attachment(string_view id) {
-    soap s;
-    xml_writer req;
+        {
+            lock_guard lg(lock);
 
-    req.start_document();
-    req.start_element("m:GetAttachment");
+            cancelled = true;
 
-    req.start_element("m:AttachmentIds");
-    req.start_element("t:AttachmentId");
-    req.attribute("Id", id);
-    req.end_element();
-    req.end_element();
+            if (current)
+                current->abort();
+        }
 
-    req.end_element();
+        result.wait();
+    }
 
-    auto ret = s.get(url, "", "<t:RequestServerVersion Version=\"Exchange2010\" />", req.dump());
+    page_prefetch(const page_prefetch&) = delete;
+    page_prefetch& operator=(const page_prefetch&) = delete;
 
-    xmlDocPtr doc = xmlReadMemory(ret.data(), (int)ret.length(), nullptr, nullptr, 0);
+    pmr::string get() {
+        return result.get();
+    }
 
-    if (!doc)
-        throw formatted_error("Could not parse response.");
+private:
+    pmr::string run(const function<pmr::string(soap&)>& fetch) {
+        soap s;
 
-    string content;
+        {
+            lock_guard lg(lock);
 
-    try {
-        auto response = find_tag(xmlDocGetRootElement(doc), messages_ns, "GetAttachmentResponse");
+            if (cancelled)
+                return {};
 
-        auto response_messages = find_tag(response, messages_ns, "ResponseMessages");
+            current = &s;
+        }
 
-        auto ffrm = find_tag(response_messages, messages_ns, "GetAttachmentResponseMessage");
+        try {
+            auto ret = fetch(s);
 
-        auto response_class = get_prop(ffrm, "ResponseClass");
+            lock_guard lg(lock);
+            current = nullptr;
 
-        if (response_class != "Success") {
-            auto response_code = find_tag_content(ffrm, messages_ns, "ResponseCode");
+            return ret;
+        } catch (...) {
+            lock_guard lg(lock);
+            current = nullptr;
 
-            throw formatted_error("GetAttachment failed ({}, {}).", response_class, response_code);
+            throw;
         }
+    }
 
-        auto attachments = find_tag(ffrm, messages_ns, "Attachments");
+    mutex lock;
+    soap* current = nullptr;
+    bool cancelled = false;
+    future<pmr::string> result;
+};
 
-        auto file_att = find_tag(attachments, types_ns, "FileAttachment");
+void prospect::find_items(string_view folder, const restriction& restr, const function<bool(const mail_item&)>& func,
+                          const item_shape& shape, unsigned int page_size, unsigned int offset) {
+    if (page_size == 0)
+        throw formatted_error("Page size cannot be zero.");
 
-        content = find_tag_content(file_att, types_ns, "Content");
-    } catch (...) {
-        xmlFreeDoc(doc);
-        throw;
-    }
+    auto fetch = [this, folder = string(folder), &restr, find_shape = find_items_shape(shape), page_size](soap& s,
+                                                                                                           unsigned int offset) {
+        return s.get(url, "", request_header(find_shape), find_items_request(folder, restr, find_shape, page_size, offset));
+    };
 
-    xmlFreeDoc(doc);
+    auto ret = [&]() {
+        soap s;
 
-    return b64decode(content);
-}
+        return fetch(s, offset);
+    }();
 
-string prospect::move_item(string_view id, string_view folder) {
-    soap s;
-    xml_writer req;
-    string new_id;
+    // after fetch, so that it's gone before anything it uses
+    optional<page_prefetch> next;
 
-    req.start_document();
-    req.start_element("m:MoveItem");
+    while (true) {
+        bool last;
 
-    req.start_element("m:ToFolderId");
-    req.start_element("t:FolderId");
-    req.attribute("Id", folder);
-    req.end_element();
-    req.end_element();
+        xmlDocPtr doc = read_xml(ret);
 
-    req.start_element("m:ItemIds");
-    req.start_element("t:ItemId");
-    req.attribute("Id", id);
-    req.end_element();
-    req.end_element();
+        if (!doc)
+            throw formatted_error("Could not parse response.");
 
-    req.end_element();
-
-    auto ret = s.get(url, "", "<t:RequestServerVersion Version=\"Exchange2010\" />", req.dump());
-
-    xmlDocPtr doc = xmlReadMemory(ret.data(), (int)ret.length(), nullptr, nullptr, 0);
+        ret.clear();
 
-    if (!doc)
-        throw formatted_error("Could not parse response.");
+        try {
+            xmlNodePtr items_tag;
+            auto next_offset = find_items_page(doc, items_tag);
 
-    try {
-        auto response = find_tag(xmlDocGetRootElement(doc), messages_ns, "MoveItemResponse");
+            last = !next_offset.has_value();
 
-        auto response_messages = find_tag(response, messages_ns, "ResponseMessages");
+            // request the next page while the caller is busy with this one
+            if (!last) {
+                next.emplace([&fetch, next_offset = *next_offset](soap& s) {
+                    return fetch(s, next_offset);
+                });
+            }
 
-        auto mirm = find_tag(response_messages, messages_ns, "MoveItemResponseMessage");
+            find_tags(items_tag, types_ns, "Message", [&](xmlNodePtr c) {
+                mail_item item(*this);
 
-        auto response_class = get_prop(mirm, "ResponseClass");
+                parse_message(c, item, shape.fields);
 
-        if (response_class != "Success") {
-            auto response_code = find_tag_content(mirm, messages_ns, "ResponseCode");
+                if (!func(item)) {
+                    last = true;
+                    return false;
+                }
 
-            throw formatted_error("MoveItem failed ({}, {}).", response_class, response_code);
+                return true;
+            });
+        } catch (...) {
+            xmlFreeDoc(doc);
+            throw;
         }
 
-        auto items = find_tag(mirm, messages_ns, "Items");
-
-        auto msg = find_tag(items, types_ns, "Message");
-
-        auto item_id = find_tag(msg, types_ns, "ItemId");
-
-        new_id = get_prop(item_id, "Id");
-    } catch (...) {
         xmlFreeDoc(doc);
-        throw;
-    }
-
-    xmlFreeDoc(doc);
 
-    return new_id;
-}
+        // if we're stopping early, the destructor of next aborts any outstanding request
+        if (last)
+            break;
 
-string prospect::create_folder(string_view parent, string_view name, const vector<folder>& folders) {
-    for (const auto& f : folders) {
-        if (f.parent == parent && f.display_name == name)
-            return f.id;
+        ret = next->get();
+        next.reset();
     }
+}
 
-    soap s;
-    xml_writer req;
+generator<mail_item> prospect::items(string folder, const item_shape& shape, unsigned int page_size, unsigned int offset) {
+    return items(move(folder), restriction(), shape, page_size, offset);
+}
 
-    req.start_document();
-    req.start_element("m:CreateFolder");
+// Not a coroutine itself, so that bad arguments are reported here rather than
+// when iteration starts.
+generator<mail_item> prospect::items(string folder, restriction restr, item_shape shape, unsigned int page_size,
+                                     unsigned int offset) {
+    if (page_size == 0)
+        throw formatted_error("Page size cannot be zero.");
 
-    req.start_element("m:ParentFolderId");
-    req.start_element("t:FolderId");
-    req.attribute("Id", string(parent));
-    req.end_element();
-    req.end_element();
+    return generate_items(move(folder), move(restr), move(shape), page_size, offset);
+}
 
-    req.start_element("m:Folders");
-    req.start_element("t:Folder");
-    req.element_text("t:FolderClass", "IPF.Note");
-    req.element_text("t:DisplayName", string(name));
-    req.end_element();
-    req.end_element();
+// There's no prefetching here, unlike in find_items, so that abandoning the
+// generator never leaves a request in flight.
+generator<mail_item> prospect::generate_items(string folder, restriction restr, item_shape shape, unsigned int page_size,
+                                              unsigned int offset) {
+    optional<unsigned int> next = offset;
 
-    req.end_element();
+    while (next) {
+        vector<mail_item> page;
 
-    auto ret = s.get(url, "", "<t:RequestServerVersion Version=\"Exchange2010\" />", req.dump());
+        {
+            soap s;
 
-    xmlDocPtr doc = xmlReadMemory(ret.data(), (int)ret.length(), nullptr, nullptr, 0);
+            auto find_shape = find_items_shape(shape);
+            auto ret = s.get(url, "", request_header(find_shape),
+                             find_items_request(folder, restr, find_shape, page_size, *next));
 
-    if (!doc)
-        throw formatted_error("Could not parse response.");
+            xmlDocPtr doc = read_xml(ret);
 
-    string id;
+            if (!doc)
+                throw formatted_error("Could not parse response.");
 
-    try {
-        auto response = find_tag(xmlDocGetRootElement(doc), messages_ns, "CreateFolderResponse");
+            try {
+                xmlNodePtr items_tag;
 
-        auto response_messages = find_tag(response, messages_ns, "ResponseMessages");
+                next = find_items_page(doc, items_tag);
 
-        auto ffrm = find_tag(response_messages, messages_ns, "CreateFolderResponseMessage");
+                find_tags(items_tag, types_ns, "Message", [&](xmlNodePtr c) {
+                    auto& item = page.emplace_back(*this);
 
-        auto response_class = get_prop(ffrm, "ResponseClass");
+                    parse_message(c, item, shape.fields);
 
-        if (response_class != "Success") {
-            auto response_code = find_tag_content(ffrm, messages_ns, "ResponseCode");
+                    return true;
+                });
+            } catch (...) {
+                xmlFreeDoc(doc);
+                throw;
+            }
 
-            throw formatted_error("CreateFolder failed ({}, {}).", response_class, response_code);
+            xmlFreeDoc(doc);
         }
 
-        auto folders = find_tag(ffrm, messages_ns, "Folders");
-
-        auto folder = find_tag(folders, types_ns, "Folder");
-
-        id = get_prop(find_tag(folder, types_ns, "FolderId"), "Id");
-    } catch (...) {
-        xmlFreeDoc(doc);
-        throw;
+        for (auto& item : page) {
+            co_yield move(item);
+        }
     }
-
-    xmlFreeDoc(doc);
-
-    return id;
 }
 
-subscription::subscription(prospect& p, string_view parent, const vector<enum event>& events) : p(p) {
-    soap s;
-    xml_writer req;
+string prospect::sync_items(string_view folder, string_view sync_state, const function<void(enum sync_change, const mail_item&)>& func,
+                            const item_shape& shape, const function<void(string_view)>& page_done) {
+    string state{sync_state};
+    bool last;
 
-    req.start_document();
-    req.start_element("m:Subscribe");
+    do {
+        soap s;
+        xml_writer req;
 
-    req.start_element("m:StreamingSubscriptionRequest");
+        req.start_document();
+        req.start_element("m:SyncFolderItems");
 
-    req.start_element("t:FolderIds");
-    req.start_element("t:FolderId");
-    req.attribute("Id", string(parent));
-    req.end_element();
-    req.end_element();
+        write_item_shape(req, shape);
 
-    req.start_element("t:EventTypes");
+        req.start_element("m:SyncFolderId");
+        req.start_element("t:FolderId");
+        req.attribute("Id", folder);
+        req.end_element();
+        req.end_element();
 
-    for (auto ev : events) {
-        switch (ev) {
-            case event::new_mail:
-                req.element_text("t:EventType", "NewMailEvent");
-                break;
+        if (!state.empty())
+            req.element_text("m:SyncState", state);
 
-            case event::created:
-                req.element_text("t:EventType", "CreatedEvent");
-                break;
+        req.element_text("m:MaxChangesReturned", "512");
 
-            case event::deleted:
-                req.element_text("t:EventType", "DeletedEvent");
-                break;
+        req.end_element();
 
-            case event::modified:
-                req.element_text("t:EventType", "ModifiedEvent");
-                break;
+        auto ret = s.get(url, "", request_header(shape), req.dump());
 
-            case event::moved:
-                req.element_text("t:EventType", "MovedEvent");
-                break;
+        xmlDocPtr doc = read_xml(ret);
 
-            case event::copied:
-                req.element_text("t:EventType", "CopiedEvent");
-                break;
+        if (!doc)
+            throw formatted_error("Could not parse response.");
 
-            case event::free_busy_changed:
-                req.element_text("t:EventType", "FreeBusyChangedEvent");
-                break;
+        try {
+            auto response = find_tag(xmlDocGetRootElement(doc), messages_ns, "SyncFolderItemsResponse");
 
-            case event::status:
-                req.element_text("t:EventType", "StatusEvent");
-                break;
+            auto response_messages = find_tag(response, messages_ns, "ResponseMessages");
 
-            default:
-                throw formatted_error("Unrecognized event type {}.", (unsigned int)ev);
-        }
-    }
+            auto sfirm = find_tag(response_messages, messages_ns, "SyncFolderItemsResponseMessage");
 
-    req.end_element();
+            auto response_class = get_prop(sfirm, "ResponseClass");
 
-    req.end_element();
+            if (response_class != "Success") {
+                auto response_code = find_tag_content(sfirm, messages_ns, "ResponseCode");
 
-    req.end_element();
+                throw formatted_error("SyncFolderItems failed ({}, {}).", response_class, response_code);
+            }
 
-    auto ret = s.get(p.url, "", "<t:RequestServerVersion Version=\"Exchange2010\" />", req.dump());
+            auto changes = find_tag(sfirm, messages_ns, "Changes");
 
-    xmlDocPtr doc = xmlReadMemory(ret.data(), (int)ret.length(), nullptr, nullptr, 0);
+            for (auto c = changes->children; c; c = c->next) {
+                if (c->type != XML_ELEMENT_NODE || !c->ns || strcmp((char*)c->ns->href, types_ns.c_str()))
+                    continue;
 
-    if (!doc)
-        throw formatted_error("Could not parse response.");
+                mail_item item(*this);
 
-    try {
-        auto response = find_tag(xmlDocGetRootElement(doc), messages_ns, "SubscribeResponse");
-        auto response_messages = find_tag(response, messages_ns, "ResponseMessages");
+                if (!strcmp((char*)c->name, "Create") || !strcmp((char*)c->name, "Update")) {
+                    auto type = !strcmp((char*)c->name, "Create") ? sync_change::created : sync_change::updated;
 
-        auto srm = find_tag(response_messages, messages_ns, "SubscribeResponseMessage");
+                    for (auto n = c->children; n; n = n->next) {
+                        if (n->type == XML_ELEMENT_NODE) {
+                            parse_message(n, item, shape.fields);
+                            func(type, item);
+                            break;
+                        }
+                    }
+                } else if (!strcmp((char*)c->name, "Delete")) {
+                    item.id = find_tag_prop(c, types_ns, "ItemId", "Id");
+                    item.change_key = find_tag_prop(c, types_ns, "ItemId", "ChangeKey");
 
-        auto response_class = get_prop(srm, "ResponseClass");
+                    func(sync_change::deleted, item);
+                } else if (!strcmp((char*)c->name, "ReadFlagChange")) {
+                    item.id = find_tag_prop(c, types_ns, "ItemId", "Id");
+                    item.change_key = find_tag_prop(c, types_ns, "ItemId", "ChangeKey");
+                    item.read = find_tag_content(c, types_ns, "IsRead") == "true";
 
-        if (response_class != "Success") {
-            auto response_code = find_tag_content(srm, messages_ns, "ResponseCode");
+                    func(sync_change::read_flag_changed, item);
+                }
+            }
 
-            throw formatted_error("Subscribe failed ({}, {}).", response_class, response_code);
+            state = find_tag_content(sfirm, messages_ns, "SyncState");
+            last = find_tag_content(sfirm, messages_ns, "IncludesLastItemInRange") != "false";
+        } catch (...) {
+            xmlFreeDoc(doc);
+            throw;
         }
 
-        id = find_tag_content(srm, messages_ns, "SubscriptionId");
-
-        if (id.empty())
-            throw formatted_error("No SubscriptionId returned.");
-    } catch (...) {
         xmlFreeDoc(doc);
-        throw;
-    }
 
-    xmlFreeDoc(doc);
-}
+        if (page_done)
+            page_done(state);
+    } while (!last);
 
-subscription::~subscription() {
-    try {
-        if (!cancelled)
-            cancel();
-    } catch (...) {
-        // can't throw in destructor
-    }
+    return state;
 }
 
-void subscription::cancel() {
+bool prospect::fetch_item(string_view id, const function<bool(const mail_item&)>& func, const item_shape& shape) {
     soap s;
     xml_writer req;
+    bool found = false;
 
     req.start_document();
-    req.start_element("m:Unsubscribe");
-    req.element_text("m:SubscriptionId", id);
+    req.start_element("m:GetItem");
+
+    write_item_shape(req, shape);
+
+    req.start_element("m:ItemIds");
+    req.start_element("t:ItemId");
+    req.attribute("Id", id);
+    req.end_element();
     req.end_element();
 
-    auto ret = s.get(p.url, "", "<t:RequestServerVersion Version=\"Exchange2010\" />", req.dump());
+    req.end_element();
 
-    xmlDocPtr doc = xmlReadMemory(ret.data(), (int)ret.length(), nullptr, nullptr, 0);
+    auto ret = s.get(url, "", request_header(shape), req.dump());
+
+    xmlDocPtr doc = read_xml(ret);
 
     if (!doc)
         throw formatted_error("Could not parse response.");
 
     try {
-        auto response = find_tag(xmlDocGetRootElement(doc), messages_ns, "UnsubscribeResponse");
+        auto response = find_tag(xmlDocGetRootElement(doc), messages_ns, "GetItemResponse");
+
         auto response_messages = find_tag(response, messages_ns, "ResponseMessages");
 
-        auto usrm = find_tag(response_messages, messages_ns, "UnsubscribeResponseMessage");
+        auto girm = find_tag(response_messages, messages_ns, "GetItemResponseMessage");
 
-        auto response_class = get_prop(usrm, "ResponseClass");
+        auto response_class = get_prop(girm, "ResponseClass");
 
         if (response_class != "Success") {
-            auto response_code = find_tag_content(usrm, messages_ns, "ResponseCode");
+            auto response_code = find_tag_content(girm, messages_ns, "ResponseCode");
 
-            throw formatted_error("Unsubscribe failed ({}, {}).", response_class, response_code);
+            if (response_code == "ErrorItemNotFound") {
+                xmlFreeDoc(doc);
+                return false;
+            }
+
+            throw formatted_error("GetItem failed ({}, {}).", response_class, response_code);
         }
 
-        cancelled = true;
+        auto items_tag = find_tag(girm, messages_ns, "Items");
+
+        find_tags(items_tag, types_ns, "Message", [&](xmlNodePtr c) {
+            mail_item item(*this);
+
+            parse_message(c, item, shape.fields);
+
+            found = true;
+            func(item);
+
+            return false;
+        });
     } catch (...) {
         xmlFreeDoc(doc);
         throw;
     }
 
     xmlFreeDoc(doc);
+
+    return found;
 }
 
-void subscription::wait(unsigned int timeout, const function<void(enum event, string_view, string_view, string_view, string_view, string_view)>& func) {
+bool prospect::get_change_key(string_view id, string& change_key) {
+    return fetch_item(id, [&](const mail_item& item) {
+        change_key = item.change_key;
+        return true;
+    }, item_shape(item_field{}));
+}
 
-    soap s;
-    xml_writer req;
+bool prospect::fetch_and_cache_item(string_view id, const function<bool(const mail_item&)>& func, const item_shape& shape) {
+    return fetch_item(id, [&](const mail_item& item) {
+        if (cache)
+            cache->store(item, shape);
 
-    req.start_document();
-    req.start_element("m:GetStreamingEvents");
+        if (mem_cache)
+            mem_cache->store_item(item, shape);
 
-    req.start_element("m:SubscriptionIds");
-    req.element_text("t:SubscriptionId", id);
-    req.end_element();
+        return func(item);
+    }, shape);
+}
 
-    req.element_text("m:ConnectionTimeout", to_string(timeout));
+bool prospect::get_item(string_view id, const function<bool(const mail_item&)>& func, const item_shape& shape) {
+    if (!cache && !mem_cache)
+        return fetch_item(id, func, shape);
 
-    req.end_element();
+    if (mem_cache && !mem_cache->validating()) {
+        if (auto item = mem_cache->find_item(id, "", shape)) {
+            func(*item);
+            return true;
+        }
+    }
 
-    s.get_stream(p.url, "", "<t:RequestServerVersion Version=\"Exchange2010\" />", req.dump(), [&](string_view ret) {
-        xmlDocPtr doc = xmlReadMemory(ret.data(), (int)ret.length(), nullptr, nullptr, 0);
+    if (!cache && !mem_cache->validating())
+        return fetch_and_cache_item(id, func, shape);
 
-        if (!doc)
-            throw formatted_error("Could not parse response.");
+    // an IdOnly fetch is cheap, and tells us whether what we've got is still current
+    string change_key;
 
-        try {
-            auto response = find_tag(xmlDocGetRootElement(doc), messages_ns, "GetStreamingEventsResponse");
+    if (!get_change_key(id, change_key)) {
+        if (cache)
+            cache->erase(id);
 
-            auto response_messages = find_tag(response, messages_ns, "ResponseMessages");
+        if (mem_cache)
+            mem_cache->erase(id);
 
-            auto serm = find_tag(response_messages, messages_ns, "GetStreamingEventsResponseMessage");
+        return false;
+    }
 
-            auto response_class = get_prop(serm, "ResponseClass");
+    if (mem_cache && mem_cache->validating()) {
+        if (auto item = mem_cache->find_item(id, change_key, shape)) {
+            func(*item);
+            return true;
+        }
+    }
 
-            if (response_class != "Success") {
-                auto response_code = find_tag_content(serm, messages_ns, "ResponseCode");
+    if (cache) {
+        mail_item item(*this);
 
-                throw formatted_error("GetStreamingEvents failed ({}, {}).", response_class, response_code);
-            }
+        if (cache->find(id, change_key, shape, item)) {
+            if (mem_cache)
+                mem_cache->store_item(item, shape);
 
-            find_tags(serm, messages_ns, "Notifications", [&](xmlNodePtr c) {
-                find_tags(c, messages_ns, "Notification", [&](xmlNodePtr c) {
-                    c = c->children;
-
-                    while (c) {
-                        if (c->type == XML_ELEMENT_NODE && c->ns && !strcmp((char*)c->ns->href, types_ns.c_str())) { // && !strcmp((char*)c->name, tag.c_str()))
-                            enum event ev;
-
-                            if (!strcmp((char*)c->name, "CopiedEvent"))
-                                ev = event::copied;
-                            else if (!strcmp((char*)c->name, "CreatedEvent"))
-                                ev = event::created;
-                            else if (!strcmp((char*)c->name, "DeletedEvent"))
-                                ev = event::deleted;
-                            else if (!strcmp((char*)c->name, "ModifiedEvent"))
-                                ev = event::modified;
-                            else if (!strcmp((char*)c->name, "MovedEvent"))
-                                ev = event::moved;
-                            else if (!strcmp((char*)c->name, "NewMailEvent"))
-                                ev = event::new_mail;
-                            else if (!strcmp((char*)c->name, "StatusEvent"))
-                                ev = event::status;
-                            else if (!strcmp((char*)c->name, "FreeBusyChangedEvent"))
-                                ev = event::free_busy_changed;
-                            else {
-                                c = c->next;
-                                continue;
-                            }
-
-                            auto timestamp = find_tag_content(c, types_ns, "TimeStamp");
-                            auto item_id = get_prop(find_tag(c, types_ns, "ItemId"), "Id");
-                            auto item_change_key = get_prop(find_tag(c, types_ns, "ItemId"), "ChangeKey");
-                            auto parent_id = get_prop(find_tag(c, types_ns, "ParentFolderId"), "Id");
-                            auto parent_change_key = get_prop(find_tag(c, types_ns, "ParentFolderId"), "ChangeKey");
-
-                            func(ev, timestamp, item_id, item_change_key, parent_id, parent_change_key);
-                        }
+            func(item);
+            return true;
+        }
+    }
 
-                        c = c->next;
-                    }
+    return fetch_and_cache_item(id, func, shape);
+}
 
-                    return true;
-                });
+// For when the caller already knows the current ChangeKey, e.g. from FindItem or
+// a notification, which saves a round trip on a cache hit.
+bool prospect::get_item(string_view id, string_view change_key, const function<bool(const mail_item&)>& func,
+                        const item_shape& shape) {
+    if (!cache && !mem_cache)
+        return fetch_item(id, func, shape);
 
-                return true;
+    if (mem_cache) {
+        if (auto item = mem_cache->find_item(id, change_key, shape)) {
+            func(*item);
+            return true;
+        }
+    }
+
+    if (cache) {
+        mail_item item(*this);
+
+        if (cache->find(id, change_key, shape, item)) {
+            if (mem_cache)
+                mem_cache->store_item(item, shape);
+
+            func(item);
+            return true;
+        }
+    }
+
+    return fetch_and_cache_item(id, func, shape);
+}
+
+void prospect::set_item_cache(shared_ptr<item_cache> cache) {
+    this->cache = move(cache);
+}
+
+void prospect::set_memory_cache(shared_ptr<memory_cache> cache) {
+    mem_cache = move(cache);
+}
+
+void record_transport(const filesystem::path& dir) {
+    soap_record(dir);
+}
+
+void replay_transport(const filesystem::path& dir, double latency_scale) {
+    soap_replay(dir, latency_scale);
+}
+
+void live_transport() {
+    soap_live();
+}
+
+scoped_resource::scoped_resource(pmr::memory_resource* mr) {
+    prev = set_request_resource(mr);
+}
+
+scoped_resource::~scoped_resource() {
+    set_request_resource(prev);
+}
+
+void prospect::get_items(span<const string> ids, const function<bool(const mail_item&)>& func, const item_shape& shape) {
+    static const size_t batch_size = 100;
+
+    for (size_t start = 0; start < ids.size(); start += batch_size) {
+        auto batch = ids.subspan(start, min(batch_size, ids.size() - start));
+        soap s;
+        xml_writer req;
+        bool stop = false;
+
+        req.start_document();
+        req.start_element("m:GetItem");
+
+        write_item_shape(req, shape);
+
+        req.start_element("m:ItemIds");
+
+        for (const auto& id : batch) {
+            req.start_element("t:ItemId");
+            req.attribute("Id", id);
+            req.end_element();
+        }
+
+        req.end_element();
+
+        req.end_element();
+
+        auto ret = s.get(url, "", request_header(shape), req.dump());
+
+        xmlDocPtr doc = read_xml(ret);
+
+        if (!doc)
+            throw formatted_error("Could not parse response.");
+
+        try {
+            auto response = find_tag(xmlDocGetRootElement(doc), messages_ns, "GetItemResponse");
+
+            auto response_messages = find_tag(response, messages_ns, "ResponseMessages");
+
+            find_tags(response_messages, messages_ns, "GetItemResponseMessage", [&](xmlNodePtr c) {
+                auto response_class = get_prop(c, "ResponseClass");
+
+                if (response_class != "Success") {
+                    auto response_code = find_tag_content(c, messages_ns, "ResponseCode");
+
+                    if (response_code == "ErrorItemNotFound")
+                        return true;
+
+                    throw formatted_error("GetItem failed ({}, {}).", response_class, response_code);
+                }
+
+                find_tags(find_tag(c, messages_ns, "Items"), types_ns, "Message", [&](xmlNodePtr c) {
+                    mail_item item(*this);
+
+                    parse_message(c, item, shape.fields);
+
+                    if (!func(item))
+                        stop = true;
+
+                    return !stop;
+                });
+
+                return !stop;
             });
         } catch (...) {
             xmlFreeDoc(doc);
@@ -1290,7 +1748,2254 @@ void subscription::wait(unsigned int timeout, const function<void(enum event, st
         }
 
         xmlFreeDoc(doc);
+
+        if (stop)
+            break;
+    }
+}
+
+static void parse_attachments(xmlNodePtr n, vector<attachment>& v) {
+    find_tags(n, types_ns, "Attachments", [&](xmlNodePtr c) {
+        find_tags(c, types_ns, "FileAttachment", [&](xmlNodePtr c) {
+            bool is_inline = find_tag_content(c, types_ns, "IsInline") == "true";
+            bool is_contact_photo = find_tag_content(c, types_ns, "IsContactPhoto") == "true";
+
+            if (!is_inline && !is_contact_photo) {
+                auto id = get_prop(find_tag(c, types_ns, "AttachmentId"), "Id");
+                auto name = find_tag_content(c, types_ns, "Name");
+                auto size = stoull(find_tag_content(c, types_ns, "Size"));
+                auto modified = find_tag_content(c, types_ns, "LastModifiedTime");
+
+                v.emplace_back(id, name, size, modified);
+            }
+
+            return true;
+        });
+
+        return false;
     });
 }
 
+vector<attachment> prospect::get_attachments(string_view item_id) {
+    if (!mem_cache)
+        return fetch_attachments(item_id, nullptr);
+
+    string change_key;
+
+    if (mem_cache->validating()) {
+        if (get_change_key(item_id, change_key)) {
+            if (auto atts = mem_cache->find_attachments(item_id, change_key))
+                return *atts;
+        } else
+            mem_cache->erase(item_id);
+    } else if (auto atts = mem_cache->find_attachments(item_id, ""))
+        return *atts;
+
+    auto v = fetch_attachments(item_id, &change_key);
+
+    mem_cache->store_attachments(item_id, change_key, v);
+
+    return v;
+}
+
+// The request and response buffers come from mr too. The attachments' own
+// strings are still on the heap, as attachment's members are plain std::strings,
+// but are moved rather than copied into the result.
+pmr::vector<attachment> prospect::get_attachments(string_view item_id, pmr::memory_resource* mr) {
+    scoped_resource sr(mr);
+
+    auto v = get_attachments(item_id);
+
+    return pmr::vector<attachment>(make_move_iterator(v.begin()), make_move_iterator(v.end()), mr);
+}
+
+vector<attachment> prospect::fetch_attachments(string_view item_id, string* change_key) {
+    soap s;
+    xml_writer req;
+
+    req.start_document();
+    req.start_element("m:GetItem");
+
+    req.start_element("m:ItemShape");
+    req.element_text("t:BaseShape", "IdOnly");
+    req.start_element("t:AdditionalProperties");
+    field_uri(req, "item:Attachments");
+    req.end_element();
+    req.end_element();
+
+    req.start_element("m:ItemIds");
+    req.start_element("t:ItemId");
+    req.attribute("Id", item_id);
+    req.end_element();
+    req.end_element();
+
+    req.end_element();
+
+    auto ret = s.get(url, "", "<t:RequestServerVersion Version=\"Exchange2010\" />", req.dump());
+
+    xmlDocPtr doc = read_xml(ret);
+
+    if (!doc)
+        throw formatted_error("Could not parse response.");
+
+    vector<attachment> v;
+
+    try {
+        auto response = find_tag(xmlDocGetRootElement(doc), messages_ns, "GetItemResponse");
+
+        auto response_messages = find_tag(response, messages_ns, "ResponseMessages");
+
+        auto ffrm = find_tag(response_messages, messages_ns, "GetItemResponseMessage");
+
+        auto response_class = get_prop(ffrm, "ResponseClass");
+
+        if (response_class != "Success") {
+            auto response_code = find_tag_content(ffrm, messages_ns, "ResponseCode");
+
+            throw formatted_error("GetItem failed ({}, {}).", response_class, response_code);
+        }
+
+        auto items_tag = find_tag(ffrm, messages_ns, "Items");
+
+        find_tags(items_tag, types_ns, "Message", [&](xmlNodePtr c) {
+            if (change_key)
+                *change_key = get_prop(find_tag(c, types_ns, "ItemId"), "ChangeKey");
+
+            parse_attachments(c, v);
+
+            return true;
+        });
+    } catch (...) {
+        xmlFreeDoc(doc);
+        throw;
+    }
+
+    xmlFreeDoc(doc);
+
+    return v;
+}
+
+string prospect::read_attachment(string_view id) {
+    soap s;
+    xml_writer req;
+
+    req.start_document();
+    req.start_element("m:GetAttachment");
+
+    req.start_element("m:AttachmentIds");
+    req.start_element("t:AttachmentId");
+    req.attribute("Id", id);
+    req.end_element();
+    req.end_element();
+
+    req.end_element();
+
+    auto ret = s.get(url, "", "<t:RequestServerVersion Version=\"Exchange2010\" />", req.dump());
+
+    xmlDocPtr doc = read_xml(ret);
+
+    if (!doc)
+        throw formatted_error("Could not parse response.");
+
+    string content;
+
+    try {
+        auto response = find_tag(xmlDocGetRootElement(doc), messages_ns, "GetAttachmentResponse");
+
+        auto response_messages = find_tag(response, messages_ns, "ResponseMessages");
+
+        auto ffrm = find_tag(response_messages, messages_ns, "GetAttachmentResponseMessage");
+
+        auto response_class = get_prop(ffrm, "ResponseClass");
+
+        if (response_class != "Success") {
+            auto response_code = find_tag_content(ffrm, messages_ns, "ResponseCode");
+
+            throw formatted_error("GetAttachment failed ({}, {}).", response_class, response_code);
+        }
+
+        auto attachments = find_tag(ffrm, messages_ns, "Attachments");
+
+        auto file_att = find_tag(attachments, types_ns, "FileAttachment");
+
+        content = find_tag_content(file_att, types_ns, "Content");
+    } catch (...) {
+        xmlFreeDoc(doc);
+        throw;
+    }
+
+    xmlFreeDoc(doc);
+
+    return b64decode(content);
+}
+
+map<string, vector<attachment>> prospect::get_attachments_for_items(span<const string> ids) {
+    static const size_t batch_size = 100;
+    map<string, vector<attachment>> ret_map;
+
+    for (size_t start = 0; start < ids.size(); start += batch_size) {
+        auto batch = ids.subspan(start, min(batch_size, ids.size() - start));
+        soap s;
+        xml_writer req;
+
+        req.start_document();
+        req.start_element("m:GetItem");
+
+        req.start_element("m:ItemShape");
+        req.element_text("t:BaseShape", "IdOnly");
+        req.start_element("t:AdditionalProperties");
+        field_uri(req, "item:Attachments");
+        req.end_element();
+        req.end_element();
+
+        req.start_element("m:ItemIds");
+
+        for (const auto& id : batch) {
+            req.start_element("t:ItemId");
+            req.attribute("Id", id);
+            req.end_element();
+        }
+
+        req.end_element();
+
+        req.end_element();
+
+        auto ret = s.get(url, "", "<t:RequestServerVersion Version=\"Exchange2010\" />", req.dump());
+
+        xmlDocPtr doc = read_xml(ret);
+
+        if (!doc)
+            throw formatted_error("Could not parse response.");
+
+        try {
+            auto response = find_tag(xmlDocGetRootElement(doc), messages_ns, "GetItemResponse");
+
+            auto response_messages = find_tag(response, messages_ns, "ResponseMessages");
+
+            size_t i = 0;
+
+            find_tags(response_messages, messages_ns, "GetItemResponseMessage", [&](xmlNodePtr c) {
+                if (i >= batch.size())
+                    throw formatted_error("GetItem returned more responses than expected.");
+
+                const auto& id = batch[i];
+
+                i++;
+
+                auto response_class = get_prop(c, "ResponseClass");
+
+                if (response_class != "Success") {
+                    auto response_code = find_tag_content(c, messages_ns, "ResponseCode");
+
+                    if (response_code == "ErrorItemNotFound")
+                        return true;
+
+                    throw formatted_error("GetItem failed ({}, {}).", response_class, response_code);
+                }
+
+                auto& v = ret_map[id];
+
+                find_tags(find_tag(c, messages_ns, "Items"), types_ns, "Message", [&](xmlNodePtr c) {
+                    parse_attachments(c, v);
+
+                    return true;
+                });
+
+                return true;
+            });
+        } catch (...) {
+            xmlFreeDoc(doc);
+            throw;
+        }
+
+        xmlFreeDoc(doc);
+    }
+
+    return ret_map;
+}
+
+// Picks the content of each attachment out of a GetAttachment response as it
+// streams in, and hands it on to the sink a piece at a time.
+class attachment_parser {
+public:
+    attachment_parser(span<const attachment> batch, attachment_sink& sink) : batch(batch), sink(sink) {
+        xmlSAXHandler sax;
+
+        memset(&sax, 0, sizeof(sax));
+
+        sax.initialized = XML_SAX2_MAGIC;
+        sax.startElementNs = start_element_cb;
+        sax.endElementNs = end_element_cb;
+        sax.characters = characters_cb;
+
+        ctxt = xmlCreatePushParserCtxt(&sax, this, nullptr, 0, nullptr);
+
+        if (!ctxt)
+            throw formatted_error("xmlCreatePushParserCtxt failed.");
+    }
+
+    ~attachment_parser() {
+        xmlFreeParserCtxt(ctxt);
+    }
+
+    void parse(string_view sv, bool end) {
+        if (error)
+            return;
+
+        auto ret = xmlParseChunk(ctxt, sv.data(), (int)sv.length(), end ? 1 : 0);
+
+        if (error)
+            rethrow_exception(error);
+
+        if (ret != 0)
+            throw formatted_error("Could not parse response (error {}).", ret);
+    }
+
+    vector<item_result> results;
+
+private:
+    static void start_element_cb(void* ctx, const xmlChar* localname, const xmlChar*, const xmlChar* uri, int, const xmlChar**,
+                                 int, int, const xmlChar**) {
+        auto& p = *(attachment_parser*)ctx;
+
+        if (p.error || !uri)
+            return;
+
+        try {
+            if (!strcmp((char*)uri, messages_ns.c_str())) {
+                if (!strcmp((char*)localname, "GetAttachmentResponseMessage")) {
+                    if (p.results.size() >= p.batch.size())
+                        throw formatted_error("GetAttachment returned more responses than expected.");
+
+                    p.response_code.clear();
+                    p.got_content = false;
+                } else if (!strcmp((char*)localname, "ResponseCode"))
+                    p.in_code = true;
+            } else if (!strcmp((char*)uri, types_ns.c_str()) && !strcmp((char*)localname, "Content")) {
+                if (p.results.size() >= p.batch.size())
+                    return;
+
+                p.in_content = true;
+                p.got_content = true;
+                p.dec = b64_decoder{};
+                p.sink.start(p.batch[p.results.size()]);
+            }
+        } catch (...) {
+            p.fail();
+        }
+    }
+
+    static void end_element_cb(void* ctx, const xmlChar* localname, const xmlChar*, const xmlChar* uri) {
+        auto& p = *(attachment_parser*)ctx;
+
+        if (p.error || !uri)
+            return;
+
+        try {
+            if (!strcmp((char*)uri, messages_ns.c_str())) {
+                if (!strcmp((char*)localname, "GetAttachmentResponseMessage")) {
+                    const auto& att = p.batch[p.results.size()];
+
+                    // item attachments have no Content for us to give
+                    if (p.response_code == "NoError" && !p.got_content)
+                        p.response_code = "NoContent";
+
+                    p.results.emplace_back(att.id, p.response_code);
+                } else if (!strcmp((char*)localname, "ResponseCode"))
+                    p.in_code = false;
+            } else if (!strcmp((char*)uri, types_ns.c_str()) && !strcmp((char*)localname, "Content") && p.in_content) {
+                p.in_content = false;
+                p.sink.finish(p.batch[p.results.size()]);
+            }
+        } catch (...) {
+            p.fail();
+        }
+    }
+
+    static void characters_cb(void* ctx, const xmlChar* ch, int len) {
+        auto& p = *(attachment_parser*)ctx;
+
+        if (p.error)
+            return;
+
+        try {
+            if (p.in_code)
+                p.response_code.append((char*)ch, len);
+            else if (p.in_content) {
+                auto data = p.dec.decode(string_view((char*)ch, len));
+
+                if (!data.empty())
+                    p.sink.write(p.batch[p.results.size()], data);
+            }
+        } catch (...) {
+            p.fail();
+        }
+    }
+
+    // we can't throw through libxml2, so stash the exception and rethrow it in parse
+    void fail() {
+        error = current_exception();
+        xmlStopParser(ctxt);
+    }
+
+    span<const attachment> batch;
+    attachment_sink& sink;
+    xmlParserCtxtPtr ctxt;
+    exception_ptr error;
+    string response_code;
+    bool in_code = false, in_content = false, got_content = false;
+    b64_decoder dec;
+};
+
+// Results are in the same order as atts. A failed attachment doesn't stop the
+// others being fetched; only a failure of the request as a whole throws.
+vector<item_result> prospect::read_attachments(span<const attachment> atts, attachment_sink& sink) {
+    static const size_t max_batch_count = 50;
+    static const size_t max_batch_size = 16 * 1024 * 1024;
+
+    vector<item_result> results;
+    size_t start = 0;
+
+    results.reserve(atts.size());
+
+    while (start < atts.size()) {
+        size_t count = 0, batch_size = 0;
+
+        // always take at least one, so that large attachments get a request to themselves
+        do {
+            batch_size += atts[start + count].size;
+            count++;
+        } while (start + count < atts.size() && count < max_batch_count &&
+                 batch_size + atts[start + count].size <= max_batch_size);
+
+        auto batch = atts.subspan(start, count);
+        soap s;
+        xml_writer req;
+        attachment_parser parser(batch, sink);
+
+        req.start_document();
+        req.start_element("m:GetAttachment");
+
+        req.start_element("m:AttachmentIds");
+
+        for (const auto& att : batch) {
+            req.start_element("t:AttachmentId");
+            req.attribute("Id", att.id);
+            req.end_element();
+        }
+
+        req.end_element();
+
+        req.end_element();
+
+        s.get_raw(url, "", "<t:RequestServerVersion Version=\"Exchange2010\" />", req.dump(), [&](string_view sv) {
+            parser.parse(sv, false);
+        });
+
+        parser.parse("", true);
+
+        if (parser.results.size() != batch.size())
+            throw formatted_error("GetAttachment returned {} responses, expected {}.", parser.results.size(), batch.size());
+
+        move(parser.results.begin(), parser.results.end(), back_inserter(results));
+
+        start += count;
+    }
+
+    return results;
+}
+
+// Gathers up each attachment's content, so it can be given to func in one piece.
+class buffered_attachment_sink : public attachment_sink {
+public:
+    buffered_attachment_sink(const function<void(const attachment&, string_view)>& func) : func(func) {
+    }
+
+    void start(const attachment& att) {
+        buf.clear();
+        buf.reserve(att.size);
+    }
+
+    void write(const attachment&, string_view data) {
+        buf.append(data);
+    }
+
+    void finish(const attachment& att) {
+        func(att, buf);
+        buf.clear();
+    }
+
+private:
+    const function<void(const attachment&, string_view)>& func;
+    string buf;
+};
+
+vector<item_result> prospect::read_attachments(span<const attachment> atts,
+                                               const function<void(const attachment&, string_view)>& func) {
+    buffered_attachment_sink sink(func);
+
+    return read_attachments(atts, sink);
+}
+
+class export_parser {
+public:
+    export_parser(item_sink& sink) : sink(sink) {
+        xmlSAXHandler sax;
+
+        memset(&sax, 0, sizeof(sax));
+
+        sax.initialized = XML_SAX2_MAGIC;
+        sax.startElementNs = start_element_cb;
+        sax.endElementNs = end_element_cb;
+        sax.characters = characters_cb;
+
+        ctxt = xmlCreatePushParserCtxt(&sax, this, nullptr, 0, nullptr);
+
+        if (!ctxt)
+            throw formatted_error("xmlCreatePushParserCtxt failed.");
+    }
+
+    ~export_parser() {
+        xmlFreeParserCtxt(ctxt);
+    }
+
+    void parse(string_view sv, bool end) {
+        if (error)
+            return;
+
+        auto ret = xmlParseChunk(ctxt, sv.data(), (int)sv.length(), end ? 1 : 0);
+
+        if (error)
+            rethrow_exception(error);
+
+        if (ret != 0)
+            throw formatted_error("Could not parse response (error {}).", ret);
+    }
+
+    vector<item_result> results;
+
+private:
+    static void start_element_cb(void* ctx, const xmlChar* localname, const xmlChar*, const xmlChar* uri, int, const xmlChar**,
+                                 int nb_attributes, int, const xmlChar** attributes) {
+        auto& p = *(export_parser*)ctx;
+
+        if (p.error || !uri || strcmp((char*)uri, messages_ns.c_str()))
+            return;
+
+        auto get_attribute = [&](const char* name) -> string {
+            for (int i = 0; i < nb_attributes; i++) {
+                auto att = &attributes[i * 5];
+
+                if (!strcmp((char*)att[0], name))
+                    return string((char*)att[3], att[4] - att[3]);
+            }
+
+            return "";
+        };
+
+        try {
+            if (!strcmp((char*)localname, "ExportItemsResponseMessage")) {
+                p.response_code.clear();
+                p.item_id.clear();
+            } else if (!strcmp((char*)localname, "ResponseCode"))
+                p.in_code = true;
+            else if (!strcmp((char*)localname, "ItemId"))
+                p.item_id = get_attribute("Id");
+            else if (!strcmp((char*)localname, "Data")) {
+                p.in_data = true;
+                p.dec = b64_decoder{};
+                p.sink.start(p.item_id);
+            }
+        } catch (...) {
+            p.fail();
+        }
+    }
+
+    static void end_element_cb(void* ctx, const xmlChar* localname, const xmlChar*, const xmlChar* uri) {
+        auto& p = *(export_parser*)ctx;
+
+        if (p.error || !uri || strcmp((char*)uri, messages_ns.c_str()))
+            return;
+
+        try {
+            if (!strcmp((char*)localname, "ExportItemsResponseMessage"))
+                p.results.emplace_back(p.item_id, p.response_code);
+            else if (!strcmp((char*)localname, "ResponseCode"))
+                p.in_code = false;
+            else if (!strcmp((char*)localname, "Data")) {
+                p.in_data = false;
+                p.sink.finish(p.item_id);
+            }
+        } catch (...) {
+            p.fail();
+        }
+    }
+
+    static void characters_cb(void* ctx, const xmlChar* ch, int len) {
+        auto& p = *(export_parser*)ctx;
+
+        if (p.error)
+            return;
+
+        try {
+            if (p.in_code)
+                p.response_code.append((char*)ch, len);
+            else if (p.in_data) {
+                auto data = p.dec.decode(string_view((char*)ch, len));
+
+                if (!data.empty())
+                    p.sink.write(p.item_id, data);
+            }
+        } catch (...) {
+            p.fail();
+        }
+    }
+
+    // we can't throw through libxml2, so stash the exception and rethrow it in parse
+    void fail() {
+        error = current_exception();
+        xmlStopParser(ctxt);
+    }
+
+    item_sink& sink;
+    xmlParserCtxtPtr ctxt;
+    exception_ptr error;
+    string item_id, response_code;
+    bool in_code = false, in_data = false;
+    b64_decoder dec;
+};
+
+static vector<item_result> export_batch(const string& url, span<const string> ids, item_sink& sink) {
+    soap s;
+    xml_writer req;
+    export_parser parser(sink);
+
+    req.start_document();
+    req.start_element("m:ExportItems");
+
+    req.start_element("m:ItemIds");
+
+    for (const auto& id : ids) {
+        req.start_element("t:ItemId");
+        req.attribute("Id", id);
+        req.end_element();
+    }
+
+    req.end_element();
+
+    req.end_element();
+
+    // the blobs can be huge, so decode them as they arrive rather than waiting for the whole response
+    s.get_raw(url, "", "<t:RequestServerVersion Version=\"Exchange2010_SP1\" />", req.dump(), [&](string_view sv) {
+        parser.parse(sv, false);
+    });
+
+    parser.parse("", true);
+
+    if (parser.results.size() != ids.size())
+        throw formatted_error("ExportItems returned {} responses, expected {}.", parser.results.size(), ids.size());
+
+    // failures don't include the ItemId
+    for (size_t i = 0; i < ids.size(); i++) {
+        if (parser.results[i].id.empty())
+            parser.results[i].id = ids[i];
+    }
+
+    return move(parser.results);
+}
+
+// results are returned in the same order as the IDs that were passed in
+vector<item_result> prospect::export_items(span<const string> ids, item_sink& sink, unsigned int concurrency) {
+    static const size_t batch_size = 20;
+
+    auto num_batches = (ids.size() + batch_size - 1) / batch_size;
+    vector<item_result> results(ids.size(), item_result("", ""));
+    atomic<size_t> next_batch = 0;
+    atomic<bool> failed = false;
+    exception_ptr error;
+    mutex error_lock;
+    vector<thread> threads;
+
+    auto worker = [&]() {
+        while (!failed) {
+            auto b = next_batch++;
+
+            if (b >= num_batches)
+                return;
+
+            auto start = b * batch_size;
+
+            try {
+                auto ret = export_batch(url, ids.subspan(start, min(batch_size, ids.size() - start)), sink);
+
+                move(ret.begin(), ret.end(), results.begin() + (ptrdiff_t)start);
+            } catch (...) {
+                lock_guard lg(error_lock);
+
+                if (!error)
+                    error = current_exception();
+
+                failed = true;
+            }
+        }
+    };
+
+    concurrency = (unsigned int)min<size_t>(max(concurrency, 1u), num_batches);
+
+    for (unsigned int i = 1; i < concurrency; i++) {
+        threads.emplace_back(worker);
+    }
+
+    worker();
+
+    for (auto& t : threads) {
+        t.join();
+    }
+
+    if (error)
+        rethrow_exception(error);
+
+    return results;
+}
+
+class file_sink : public item_sink {
+public:
+    file_sink(const filesystem::path& dir) : dir(dir) {
+    }
+
+    // anything still here is from a batch that failed part-way through
+    ~file_sink() {
+        for (auto& [item_id, f] : files) {
+            error_code ec;
+
+            f.close();
+            filesystem::remove(filename(item_id).string() + ".tmp", ec);
+        }
+    }
+
+    // item IDs are base64, so use the URL-safe alphabet to get something usable as a filename
+    filesystem::path filename(string_view item_id) const {
+        string name{item_id};
+
+        for (auto& c : name) {
+            if (c == '/')
+                c = '_';
+            else if (c == '+')
+                c = '-';
+        }
+
+        return dir / (name + ".bin");
+    }
+
+    void start(string_view item_id) {
+        auto fn = filename(item_id);
+        ofstream f(fn.string() + ".tmp", ios::binary | ios::trunc);
+
+        if (!f.good())
+            throw formatted_error("Could not open {} for writing.", fn.string());
+
+        lock_guard lg(lock);
+
+        files.insert_or_assign(string(item_id), move(f));
+    }
+
+    void write(string_view item_id, string_view data) {
+        ofstream* f;
+
+        {
+            lock_guard lg(lock);
+
+            f = &files.at(string(item_id));
+        }
+
+        f->write(data.data(), (streamsize)data.length());
+
+        if (!f->good())
+            throw formatted_error("Error writing to {}.", filename(item_id).string());
+    }
+
+    void finish(string_view item_id) {
+        auto fn = filename(item_id);
+        ofstream* f;
+
+        {
+            lock_guard lg(lock);
+
+            f = &files.at(string(item_id));
+        }
+
+        f->close();
+
+        if (!f->good())
+            throw formatted_error("Error writing to {}.", fn.string());
+
+        filesystem::rename(fn.string() + ".tmp", fn);
+
+        lock_guard lg(lock);
+
+        files.erase(string(item_id));
+    }
+
+private:
+    filesystem::path dir;
+    mutex lock;
+    map<string, ofstream> files;
+};
+
+vector<item_result> prospect::export_items(span<const string> ids, const filesystem::path& dir, unsigned int concurrency) {
+    file_sink sink(dir);
+
+    return export_items(ids, sink, concurrency);
+}
+
+class upload_reader {
+public:
+    virtual ~upload_reader() = default;
+
+    virtual bool next() = 0;
+    virtual size_t size() const = 0;
+    virtual void write(xml_writer& req) = 0;
+};
+
+class file_upload_reader : public upload_reader {
+public:
+    file_upload_reader(span<const filesystem::path> files) : files(files) {
+    }
+
+    bool next() {
+        if (pos == files.size())
+            return false;
+
+        const auto& fn = files[pos];
+
+        pos++;
+
+        f.close();
+        f.clear();
+        f.open(fn, ios::binary);
+
+        if (!f.good())
+            throw formatted_error("Could not open {} for reading.", fn.string());
+
+        file_size = (size_t)filesystem::file_size(fn);
+
+        return true;
+    }
+
+    size_t size() const {
+        return file_size;
+    }
+
+    // encode as we read, so we never hold both the raw and the encoded file
+    void write(xml_writer& req) {
+        string buf;
+
+        buf.resize(48 * 1024); // multiple of 3, so the pieces can be concatenated
+
+        while (f) {
+            f.read(buf.data(), (streamsize)buf.size());
+
+            auto len = (size_t)f.gcount();
+
+            if (len == 0)
+                break;
+
+            req.raw(b64encode(string_view(buf.data(), len)));
+        }
+    }
+
+private:
+    span<const filesystem::path> files;
+    size_t pos = 0;
+    ifstream f;
+    size_t file_size = 0;
+};
+
+class generator_upload_reader : public upload_reader {
+public:
+    generator_upload_reader(const function<bool(string&)>& source) : source(source) {
+    }
+
+    bool next() {
+        blob.clear();
+
+        return source(blob);
+    }
+
+    size_t size() const {
+        return blob.length();
+    }
+
+    void write(xml_writer& req) {
+        req.raw(b64encode(blob));
+
+        blob.clear();
+        blob.shrink_to_fit();
+    }
+
+private:
+    const function<bool(string&)>& source;
+    string blob;
+};
+
+static vector<item_result> upload_batch(const string& url, const string& body, size_t count) {
+    soap s;
+    vector<item_result> results;
+
+    auto ret = s.get(url, "", "<t:RequestServerVersion Version=\"Exchange2010_SP1\" />", body);
+
+    xmlDocPtr doc = read_xml(ret);
+
+    if (!doc)
+        throw formatted_error("Could not parse response.");
+
+    try {
+        auto response = find_tag(xmlDocGetRootElement(doc), messages_ns, "UploadItemsResponse");
+
+        auto response_messages = find_tag(response, messages_ns, "ResponseMessages");
+
+        find_tags(response_messages, messages_ns, "UploadItemsResponseMessage", [&](xmlNodePtr c) {
+            results.emplace_back(find_tag_prop(c, messages_ns, "ItemId", "Id"), find_tag_content(c, messages_ns, "ResponseCode"));
+
+            return true;
+        });
+
+        if (results.size() != count)
+            throw formatted_error("UploadItems returned {} responses, expected {}.", results.size(), count);
+    } catch (...) {
+        xmlFreeDoc(doc);
+        throw;
+    }
+
+    xmlFreeDoc(doc);
+
+    return results;
+}
+
+// Memory use is bounded by the batch size times one more than the concurrency:
+// one batch being built, and the rest in flight.
+static vector<item_result> upload_from_reader(const string& url, string_view folder, upload_reader& reader, unsigned int concurrency) {
+    static const size_t max_batch_count = 100;
+    static const size_t max_batch_size = 16 * 1024 * 1024;
+
+    // what the item adds to the request, once it's been base64-encoded
+    auto encoded_size = [&]() {
+        return (reader.size() + 2) / 3 * 4;
+    };
+
+    vector<item_result> results;
+    deque<future<vector<item_result>>> in_flight;
+    bool have = reader.next();
+
+    concurrency = max(concurrency, 1u);
+
+    auto collect = [&]() {
+        auto ret = in_flight.front().get();
+
+        in_flight.pop_front();
+
+        move(ret.begin(), ret.end(), back_inserter(results));
+    };
+
+    while (have) {
+        xml_writer req;
+        size_t count = 0, batch_size = 0;
+
+        req.start_document();
+        req.start_element("m:UploadItems");
+        req.start_element("m:Items");
+
+        // always take at least one, so that large items get a request to themselves
+        do {
+            // before write, which may let go of the data
+            batch_size += encoded_size();
+            count++;
+
+            req.start_element("t:Item");
+            req.attribute("CreateAction", "CreateNew");
+
+            req.start_element("t:ParentFolderId");
+            req.attribute("Id", folder);
+            req.end_element();
+
+            req.start_element("t:Data");
+            reader.write(req);
+            req.end_element();
+
+            req.end_element();
+
+            have = reader.next();
+        } while (have && count < max_batch_count && batch_size + encoded_size() <= max_batch_size);
+
+        req.end_element();
+        req.end_element();
+
+        if (in_flight.size() >= concurrency)
+            collect();
+
+        in_flight.push_back(async(launch::async, [&url, body = string(req.dump()), count]() {
+            return upload_batch(url, body, count);
+        }));
+    }
+
+    while (!in_flight.empty()) {
+        collect();
+    }
+
+    return results;
+}
+
+// results are returned in the same order as the source gives us the items
+vector<item_result> prospect::upload_items(string_view folder, const function<bool(string&)>& source, unsigned int concurrency) {
+    generator_upload_reader reader(source);
+
+    return upload_from_reader(url, folder, reader, concurrency);
+}
+
+vector<item_result> prospect::upload_items(string_view folder, span<const filesystem::path> files, unsigned int concurrency) {
+    file_upload_reader reader(files);
+
+    return upload_from_reader(url, folder, reader, concurrency);
+}
+
+string prospect::move_item(string_view id, string_view folder) {
+    soap s;
+    xml_writer req;
+    string new_id;
+
+    req.start_document();
+    req.start_element("m:MoveItem");
+
+    req.start_element("m:ToFolderId");
+    req.start_element("t:FolderId");
+    req.attribute("Id", folder);
+    req.end_element();
+    req.end_element();
+
+    req.start_element("m:ItemIds");
+    req.start_element("t:ItemId");
+    req.attribute("Id", id);
+    req.end_element();
+    req.end_element();
+
+    req.end_element();
+
+    auto ret = s.get(url, "", "<t:RequestServerVersion Version=\"Exchange2010\" />", req.dump());
+
+    xmlDocPtr doc = read_xml(ret);
+
+    if (!doc)
+        throw formatted_error("Could not parse response.");
+
+    try {
+        auto response = find_tag(xmlDocGetRootElement(doc), messages_ns, "MoveItemResponse");
+
+        auto response_messages = find_tag(response, messages_ns, "ResponseMessages");
+
+        auto mirm = find_tag(response_messages, messages_ns, "MoveItemResponseMessage");
+
+        auto response_class = get_prop(mirm, "ResponseClass");
+
+        if (response_class != "Success") {
+            auto response_code = find_tag_content(mirm, messages_ns, "ResponseCode");
+
+            throw formatted_error("MoveItem failed ({}, {}).", response_class, response_code);
+        }
+
+        auto items = find_tag(mirm, messages_ns, "Items");
+
+        auto msg = find_tag(items, types_ns, "Message");
+
+        auto item_id = find_tag(msg, types_ns, "ItemId");
+
+        new_id = get_prop(item_id, "Id");
+    } catch (...) {
+        xmlFreeDoc(doc);
+        throw;
+    }
+
+    xmlFreeDoc(doc);
+
+    return new_id;
+}
+
+// results are returned in the same order as the IDs that were passed in
+static vector<item_result> move_or_copy_items(const string& url, span<const string> ids, string_view folder, bool copy) {
+    static const size_t batch_size = 100;
+    const string op = copy ? "CopyItem" : "MoveItem";
+    vector<item_result> results;
+
+    results.reserve(ids.size());
+
+    for (size_t start = 0; start < ids.size(); start += batch_size) {
+        auto batch = ids.subspan(start, min(batch_size, ids.size() - start));
+        soap s;
+        xml_writer req;
+
+        req.start_document();
+        req.start_element("m:" + op);
+
+        req.start_element("m:ToFolderId");
+        req.start_element("t:FolderId");
+        req.attribute("Id", folder);
+        req.end_element();
+        req.end_element();
+
+        req.start_element("m:ItemIds");
+
+        for (const auto& id : batch) {
+            req.start_element("t:ItemId");
+            req.attribute("Id", id);
+            req.end_element();
+        }
+
+        req.end_element();
+
+        req.end_element();
+
+        auto ret = s.get(url, "", "<t:RequestServerVersion Version=\"Exchange2010\" />", req.dump());
+
+        xmlDocPtr doc = read_xml(ret);
+
+        if (!doc)
+            throw formatted_error("Could not parse response.");
+
+        try {
+            auto response = find_tag(xmlDocGetRootElement(doc), messages_ns, op + "Response");
+
+            auto response_messages = find_tag(response, messages_ns, "ResponseMessages");
+
+            find_tags(response_messages, messages_ns, op + "ResponseMessage", [&](xmlNodePtr c) {
+                auto response_code = find_tag_content(c, messages_ns, "ResponseCode");
+                string new_id;
+
+                // new ID is only returned if the destination is in the same mailbox
+                find_tags(c, messages_ns, "Items", [&](xmlNodePtr c) {
+                    for (auto n = c->children; n; n = n->next) {
+                        if (n->type == XML_ELEMENT_NODE) {
+                            new_id = find_tag_prop(n, types_ns, "ItemId", "Id");
+                            break;
+                        }
+                    }
+
+                    return false;
+                });
+
+                results.emplace_back(new_id, response_code);
+
+                return true;
+            });
+
+            if (results.size() != start + batch.size())
+                throw formatted_error("{} returned {} responses, expected {}.", op, results.size() - start, batch.size());
+        } catch (...) {
+            xmlFreeDoc(doc);
+            throw;
+        }
+
+        xmlFreeDoc(doc);
+    }
+
+    return results;
+}
+
+vector<item_result> prospect::move_items(span<const string> ids, string_view folder) {
+    return move_or_copy_items(url, ids, folder, false);
+}
+
+vector<item_result> prospect::copy_items(span<const string> ids, string_view folder) {
+    return move_or_copy_items(url, ids, folder, true);
+}
+
+string prospect::create_folder(string_view parent, string_view name, folder_tree& folders) {
+    if (auto f = folders.find(parent, name))
+        return f->id;
+
+    soap s;
+    xml_writer req;
+
+    req.start_document();
+    req.start_element("m:CreateFolder");
+
+    req.start_element("m:ParentFolderId");
+    req.start_element("t:FolderId");
+    req.attribute("Id", string(parent));
+    req.end_element();
+    req.end_element();
+
+    req.start_element("m:Folders");
+    req.start_element("t:Folder");
+    req.element_text("t:FolderClass", "IPF.Note");
+    req.element_text("t:DisplayName", string(name));
+    req.end_element();
+    req.end_element();
+
+    req.end_element();
+
+    auto ret = s.get(url, "", "<t:RequestServerVersion Version=\"Exchange2010\" />", req.dump());
+
+    xmlDocPtr doc = read_xml(ret);
+
+    if (!doc)
+        throw formatted_error("Could not parse response.");
+
+    string id, change_key;
+
+    try {
+        auto response = find_tag(xmlDocGetRootElement(doc), messages_ns, "CreateFolderResponse");
+
+        auto response_messages = find_tag(response, messages_ns, "ResponseMessages");
+
+        auto ffrm = find_tag(response_messages, messages_ns, "CreateFolderResponseMessage");
+
+        auto response_class = get_prop(ffrm, "ResponseClass");
+
+        if (response_class != "Success") {
+            auto response_code = find_tag_content(ffrm, messages_ns, "ResponseCode");
+
+            throw formatted_error("CreateFolder failed ({}, {}).", response_class, response_code);
+        }
+
+        auto folders = find_tag(ffrm, messages_ns, "Folders");
+
+        auto folder = find_tag(folders, types_ns, "Folder");
+
+        auto folder_id = find_tag(folder, types_ns, "FolderId");
+
+        id = get_prop(folder_id, "Id");
+        change_key = get_prop(folder_id, "ChangeKey");
+    } catch (...) {
+        xmlFreeDoc(doc);
+        throw;
+    }
+
+    xmlFreeDoc(doc);
+
+    folders.insert(folder(id, parent, change_key, name, 0, 0, 0));
+
+    return id;
+}
+
+static void write_event_types(xml_writer& req, const vector<enum event>& events) {
+    req.start_element("t:EventTypes");
+
+    for (auto ev : events) {
+        switch (ev) {
+            case event::new_mail:
+                req.element_text("t:EventType", "NewMailEvent");
+                break;
+
+            case event::created:
+                req.element_text("t:EventType", "CreatedEvent");
+                break;
+
+            case event::deleted:
+                req.element_text("t:EventType", "DeletedEvent");
+                break;
+
+            case event::modified:
+                req.element_text("t:EventType", "ModifiedEvent");
+                break;
+
+            case event::moved:
+                req.element_text("t:EventType", "MovedEvent");
+                break;
+
+            case event::copied:
+                req.element_text("t:EventType", "CopiedEvent");
+                break;
+
+            case event::free_busy_changed:
+                req.element_text("t:EventType", "FreeBusyChangedEvent");
+                break;
+
+            case event::status:
+                req.element_text("t:EventType", "StatusEvent");
+                break;
+
+            default:
+                throw formatted_error("Unrecognized event type {}.", (unsigned int)ev);
+        }
+    }
+
+    req.end_element();
+}
+
+// Returns the SubscriptionId, and the Watermark if it's a pull subscription. If
+// watermark is given, the pull subscription starts from there.
+static string subscribe(const string& url, string_view parent, const vector<enum event>& events, bool pull,
+                        string_view watermark = "", string* new_watermark = nullptr) {
+    soap s;
+    xml_writer req;
+    string id;
+
+    req.start_document();
+    req.start_element("m:Subscribe");
+
+    req.start_element(pull ? "m:PullSubscriptionRequest" : "m:StreamingSubscriptionRequest");
+
+    req.start_element("t:FolderIds");
+    req.start_element("t:FolderId");
+    req.attribute("Id", string(parent));
+    req.end_element();
+    req.end_element();
+
+    write_event_types(req, events);
+
+    if (pull) {
+        if (!watermark.empty())
+            req.element_text("t:Watermark", watermark);
+
+        req.element_text("t:Timeout", "10"); // minutes
+    }
+
+    req.end_element();
+
+    req.end_element();
+
+    auto ret = s.get(url, "", "<t:RequestServerVersion Version=\"Exchange2010\" />", req.dump());
+
+    xmlDocPtr doc = read_xml(ret);
+
+    if (!doc)
+        throw formatted_error("Could not parse response.");
+
+    try {
+        auto response = find_tag(xmlDocGetRootElement(doc), messages_ns, "SubscribeResponse");
+        auto response_messages = find_tag(response, messages_ns, "ResponseMessages");
+
+        auto srm = find_tag(response_messages, messages_ns, "SubscribeResponseMessage");
+
+        auto response_class = get_prop(srm, "ResponseClass");
+
+        if (response_class != "Success") {
+            auto response_code = find_tag_content(srm, messages_ns, "ResponseCode");
+
+            throw formatted_error("Subscribe failed ({}, {}).", response_class, response_code);
+        }
+
+        id = find_tag_content(srm, messages_ns, "SubscriptionId");
+
+        if (id.empty())
+            throw formatted_error("No SubscriptionId returned.");
+
+        if (new_watermark)
+            *new_watermark = find_tag_content(srm, messages_ns, "Watermark");
+    } catch (...) {
+        xmlFreeDoc(doc);
+        throw;
+    }
+
+    xmlFreeDoc(doc);
+
+    return id;
+}
+
+static void unsubscribe(const string& url, string_view id) {
+    soap s;
+    xml_writer req;
+
+    req.start_document();
+    req.start_element("m:Unsubscribe");
+    req.element_text("m:SubscriptionId", id);
+    req.end_element();
+
+    auto ret = s.get(url, "", "<t:RequestServerVersion Version=\"Exchange2010\" />", req.dump());
+
+    xmlDocPtr doc = read_xml(ret);
+
+    if (!doc)
+        throw formatted_error("Could not parse response.");
+
+    try {
+        auto response = find_tag(xmlDocGetRootElement(doc), messages_ns, "UnsubscribeResponse");
+        auto response_messages = find_tag(response, messages_ns, "ResponseMessages");
+
+        auto usrm = find_tag(response_messages, messages_ns, "UnsubscribeResponseMessage");
+
+        auto response_class = get_prop(usrm, "ResponseClass");
+
+        if (response_class != "Success") {
+            auto response_code = find_tag_content(usrm, messages_ns, "ResponseCode");
+
+            throw formatted_error("Unsubscribe failed ({}, {}).", response_class, response_code);
+        }
+    } catch (...) {
+        xmlFreeDoc(doc);
+        throw;
+    }
+
+    xmlFreeDoc(doc);
+}
+
+subscription::subscription(prospect& p, string_view parent, const vector<enum event>& events) :
+                           p(p), parent(parent), events(events) {
+    id = subscribe(p.url, parent, events, false);
+}
+
+subscription::~subscription() {
+    try {
+        if (!cancelled)
+            cancel();
+    } catch (...) {
+        // can't throw in destructor
+    }
+}
+
+void subscription::cancel() {
+    unsubscribe(p.url, current_id());
+
+    cancelled = true;
+}
+
+string subscription::current_id() const {
+    lock_guard lg(lock);
+
+    return id;
+}
+
+string subscription::watermark() const {
+    lock_guard lg(lock);
+
+    return last_watermark;
+}
+
+void subscription::record_watermark(string_view watermark) {
+    if (watermark.empty())
+        return;
+
+    lock_guard lg(lock);
+
+    last_watermark = watermark;
+}
+
+static bool parse_event_type(const char* name, enum event& ev) {
+    if (!strcmp(name, "CopiedEvent"))
+        ev = event::copied;
+    else if (!strcmp(name, "CreatedEvent"))
+        ev = event::created;
+    else if (!strcmp(name, "DeletedEvent"))
+        ev = event::deleted;
+    else if (!strcmp(name, "ModifiedEvent"))
+        ev = event::modified;
+    else if (!strcmp(name, "MovedEvent"))
+        ev = event::moved;
+    else if (!strcmp(name, "NewMailEvent"))
+        ev = event::new_mail;
+    else if (!strcmp(name, "StatusEvent"))
+        ev = event::status;
+    else if (!strcmp(name, "FreeBusyChangedEvent"))
+        ev = event::free_busy_changed;
+    else
+        return false;
+
+    return true;
+}
+
+static void parse_notification(xmlNodePtr c, const function<void(string_view subscription_id, notification& n)>& func) {
+    auto subscription_id = find_tag_content(c, types_ns, "SubscriptionId");
+
+    c = c->children;
+
+    while (c) {
+        enum event ev;
+
+        if (c->type == XML_ELEMENT_NODE && c->ns && !strcmp((char*)c->ns->href, types_ns.c_str()) &&
+            parse_event_type((char*)c->name, ev)) {
+            notification n{ev, find_tag_content(c, types_ns, "TimeStamp"),
+                           find_tag_prop(c, types_ns, "ItemId", "Id"),
+                           find_tag_prop(c, types_ns, "ItemId", "ChangeKey"),
+                           find_tag_prop(c, types_ns, "ParentFolderId", "Id"),
+                           find_tag_prop(c, types_ns, "ParentFolderId", "ChangeKey"),
+                           find_tag_content(c, types_ns, "Watermark")};
+
+            func(subscription_id, n);
+        }
+
+        c = c->next;
+    }
+}
+
+// The server no longer knows the subscription - it has expired, or the server
+// has been restarted.
+class subscription_not_found : public formatted_error {
+public:
+    subscription_not_found() : formatted_error("GetStreamingEvents failed (Error, ErrorSubscriptionNotFound).") {
+    }
+};
+
+// Runs one GetStreamingEvents request, calling func for each event as it arrives.
+// heartbeat, if given, is called for every message from the server, including
+// the keep-alives.
+static void get_streaming_events(soap& s, const string& url, span<const string> ids, unsigned int timeout,
+                                 const function<void(string_view subscription_id, notification& n)>& func,
+                                 const function<void()>& heartbeat) {
+    xml_writer req;
+
+    req.start_document();
+    req.start_element("m:GetStreamingEvents");
+
+    req.start_element("m:SubscriptionIds");
+
+    for (const auto& id : ids) {
+        req.element_text("t:SubscriptionId", id);
+    }
+
+    req.end_element();
+
+    req.element_text("m:ConnectionTimeout", to_string(timeout));
+
+    req.end_element();
+
+    s.get_stream(url, "", "<t:RequestServerVersion Version=\"Exchange2010\" />", req.dump(), [&](string_view ret) {
+        xmlDocPtr doc = read_xml(ret);
+
+        if (!doc)
+            throw formatted_error("Could not parse response.");
+
+        try {
+            if (heartbeat)
+                heartbeat();
+
+            auto response = find_tag(xmlDocGetRootElement(doc), messages_ns, "GetStreamingEventsResponse");
+
+            auto response_messages = find_tag(response, messages_ns, "ResponseMessages");
+
+            auto serm = find_tag(response_messages, messages_ns, "GetStreamingEventsResponseMessage");
+
+            auto response_class = get_prop(serm, "ResponseClass");
+
+            if (response_class != "Success") {
+                auto response_code = find_tag_content(serm, messages_ns, "ResponseCode");
+
+                // someone has opened a new connection for the subscription, which
+                // is how we renew, so this one is simply finished
+                if (response_code == "ErrorNewEventStreamConnectionOpened") {
+                    xmlFreeDoc(doc);
+                    return;
+                }
+
+                if (response_code == "ErrorSubscriptionNotFound")
+                    throw subscription_not_found();
+
+                throw formatted_error("GetStreamingEvents failed ({}, {}).", response_class, response_code);
+            }
+
+            find_tags(serm, messages_ns, "Notifications", [&](xmlNodePtr c) {
+                find_tags(c, messages_ns, "Notification", [&](xmlNodePtr c) {
+                    parse_notification(c, func);
+
+                    return true;
+                });
+
+                return true;
+            });
+        } catch (...) {
+            xmlFreeDoc(doc);
+            throw;
+        }
+
+        xmlFreeDoc(doc);
+    });
+}
+
+void subscription::wait(unsigned int timeout, const function<void(enum event, string_view, string_view, string_view, string_view, string_view)>& func) {
+    soap s;
+    auto sub_id = current_id();
+
+    get_streaming_events(s, p.url, span(&sub_id, 1), timeout, [&](string_view, notification& n) {
+        record_watermark(n.watermark);
+
+        func(n.type, n.timestamp, n.item_id, n.item_change_key, n.parent_id, n.parent_change_key);
+    }, nullptr);
+}
+
+// Returns false once the server says there's nothing more to come.
+static bool get_events(const string& url, const string& id, string& watermark,
+                       const function<void(const notification&)>& func) {
+    soap s;
+    xml_writer req;
+    bool more = false;
+
+    req.start_document();
+    req.start_element("m:GetEvents");
+    req.element_text("m:SubscriptionId", id);
+    req.element_text("m:Watermark", watermark);
+    req.end_element();
+
+    auto ret = s.get(url, "", "<t:RequestServerVersion Version=\"Exchange2010\" />", req.dump());
+
+    xmlDocPtr doc = read_xml(ret);
+
+    if (!doc)
+        throw formatted_error("Could not parse response.");
+
+    try {
+        auto response = find_tag(xmlDocGetRootElement(doc), messages_ns, "GetEventsResponse");
+        auto response_messages = find_tag(response, messages_ns, "ResponseMessages");
+
+        auto germ = find_tag(response_messages, messages_ns, "GetEventsResponseMessage");
+
+        auto response_class = get_prop(germ, "ResponseClass");
+
+        if (response_class != "Success") {
+            auto response_code = find_tag_content(germ, messages_ns, "ResponseCode");
+
+            throw formatted_error("GetEvents failed ({}, {}).", response_class, response_code);
+        }
+
+        auto notif = find_tag(germ, messages_ns, "Notification");
+
+        more = find_tag_content(notif, types_ns, "MoreEvents") == "true";
+
+        parse_notification(notif, [&](string_view, notification& n) {
+            if (!n.watermark.empty())
+                watermark = n.watermark;
+
+            // a pull subscription always returns at least a StatusEvent
+            if (n.type != event::status)
+                func(n);
+        });
+    } catch (...) {
+        xmlFreeDoc(doc);
+        throw;
+    }
+
+    xmlFreeDoc(doc);
+
+    return more;
+}
+
+// Fetches the events since watermark, using a short-lived pull subscription.
+// Exchange only keeps watermarks for so long; if this one has expired, this
+// throws and the caller will have to fall back to sync_items.
+void subscription::catch_up(string_view watermark, const function<void(const notification&)>& func) {
+    string wm;
+    auto pull_id = subscribe(p.url, parent, events, true, watermark, &wm);
+
+    try {
+        if (wm.empty())
+            wm = watermark;
+
+        while (get_events(p.url, pull_id, wm, [&](const notification& n) {
+            record_watermark(n.watermark);
+            func(n);
+        })) {
+        }
+    } catch (...) {
+        try {
+            unsubscribe(p.url, pull_id);
+        } catch (...) {
+        }
+
+        throw;
+    }
+
+    unsubscribe(p.url, pull_id);
+}
+
+// Replaces a subscription that the server has lost. The new one is set up before
+// we catch up from the last watermark, so nothing can fall between the two -
+// though the same event may be seen twice.
+void subscription::resume(const function<void(const notification&)>& func) {
+    auto new_id = subscribe(p.url, parent, events, false);
+    auto wm = watermark();
+
+    {
+        lock_guard lg(lock);
+        id = new_id;
+    }
+
+    if (!wm.empty())
+        catch_up(wm, func);
+}
+
+// Keeps GetStreamingEvents requests going back to back on a background thread.
+// Each new request is started before the old one is due to time out, and the
+// old one is only dropped once the new one has heard from the server.
+class stream_keeper {
+public:
+    using stream_func = function<void(soap& s, unsigned int timeout, const function<void()>& heartbeat)>;
+
+    stream_keeper(stream_func func, unsigned int timeout, bool active = true) :
+                  func(move(func)), timeout(clamp(timeout, 1u, 30u)), active(active) {
+        supervisor = thread([this]() {
+            run();
+        });
+    }
+
+    ~stream_keeper() {
+        stop();
+    }
+
+    void stop() {
+        {
+            lock_guard lg(lock);
+
+            if (stopping)
+                return;
+
+            stopping = true;
+        }
+
+        cv.notify_all();
+        supervisor.join();
+    }
+
+    // Starts a new request now, overlapping with the current one as for a renewal.
+    void restart() {
+        {
+            lock_guard lg(lock);
+            restart_requested = true;
+        }
+
+        cv.notify_all();
+    }
+
+    // While inactive, no request is kept open.
+    void set_active(bool a) {
+        {
+            lock_guard lg(lock);
+            active = a;
+        }
+
+        cv.notify_all();
+    }
+
+    atomic<uint64_t> reconnects = 0;
+    atomic<uint64_t> errors = 0;
+
+private:
+    struct stream {
+        soap s;
+        thread t;
+        bool connected = false;
+        bool finished = false;
+        bool failed = false;
+    };
+
+    unique_ptr<stream> start_stream() {
+        auto st = make_unique<stream>();
+        auto ptr = st.get();
+
+        st->t = thread([this, ptr]() {
+            bool failed = false;
+
+            try {
+                func(ptr->s, timeout, [this, ptr]() {
+                    lock_guard lg(lock);
+
+                    if (!ptr->connected) {
+                        ptr->connected = true;
+                        cv.notify_all();
+                    }
+                });
+            } catch (...) {
+                failed = true;
+                errors++;
+            }
+
+            {
+                lock_guard lg(lock);
+
+                ptr->finished = true;
+                ptr->failed = failed;
+            }
+
+            cv.notify_all();
+        });
+
+        return st;
+    }
+
+    void finish(unique_ptr<stream>& st, unique_lock<mutex>& ul) {
+        st->s.abort();
+
+        ul.unlock();
+        st->t.join();
+        ul.lock();
+
+        st.reset();
+    }
+
+    void run() {
+        auto lifetime = chrono::seconds(timeout * 60);
+        auto overlap = min(chrono::seconds(60), lifetime / 2);
+        auto backoff = chrono::seconds(1);
+        unique_ptr<stream> current;
+        bool first = true;
+        unique_lock ul(lock);
+
+        while (!stopping) {
+            if (!active) {
+                if (current)
+                    finish(current, ul);
+
+                cv.wait(ul, [&]() { return stopping || active; });
+                continue;
+            }
+
+            restart_requested = false;
+
+            auto next = start_stream();
+
+            if (!first)
+                reconnects++;
+
+            first = false;
+
+            if (current) {
+                // The old stream is only dropped once the new one has connected, or
+                // if it ends by itself. If the new one fails without connecting, we
+                // keep the old one going and try again after a while.
+                while (!stopping && !next->connected && !current->finished) {
+                    cv.wait(ul, [&]() { return stopping || next->connected || next->finished || current->finished; });
+
+                    if (next->finished && !next->connected) {
+                        finish(next, ul);
+
+                        cv.wait_for(ul, backoff, [&]() { return stopping || current->finished; });
+                        backoff = min(backoff * 2, chrono::seconds(60));
+
+                        if (stopping)
+                            break;
+
+                        next = start_stream();
+                        reconnects++;
+                    }
+                }
+
+                finish(current, ul);
+
+                if (!next)
+                    break;
+            }
+
+            current = move(next);
+
+            cv.wait_for(ul, lifetime - overlap, [&]() {
+                return stopping || current->finished || restart_requested || !active;
+            });
+
+            if (current->connected)
+                backoff = chrono::seconds(1);
+
+            if (current->finished) {
+                // don't hammer the server if it's refusing us
+                bool retry_later = current->failed || !current->connected;
+
+                finish(current, ul);
+
+                if (retry_later) {
+                    cv.wait_for(ul, backoff, [&]() { return stopping; });
+                    backoff = min(backoff * 2, chrono::seconds(60));
+                }
+            }
+        }
+
+        if (current)
+            finish(current, ul);
+    }
+
+    stream_func func;
+    unsigned int timeout;
+    mutex lock;
+    condition_variable cv;
+    bool stopping = false;
+    bool active;
+    bool restart_requested = false;
+    thread supervisor;
+};
+
+struct notification_node {
+    atomic<notification_node*> next = nullptr;
+    notification n;
+};
+
+// Vyukov's multiple-producer, single-consumer queue. Pushing is one atomic
+// exchange, so the stream threads never wait on each other or on the consumer.
+// The semaphore is only there so that pop can sleep when the queue is empty.
+class notification_queue {
+public:
+    notification_queue() : head(&stub), tail(&stub) {
+    }
+
+    ~notification_queue() {
+        while (tail) {
+            auto next = tail->next.load(memory_order_relaxed);
+
+            if (tail != &stub)
+                delete tail;
+
+            tail = next;
+        }
+    }
+
+    void push(notification&& n) {
+        auto node = new notification_node;
+
+        node->n = move(n);
+
+        auto prev = head.exchange(node, memory_order_acq_rel);
+
+        prev->next.store(node, memory_order_release);
+
+        available.release();
+    }
+
+    bool pop(notification& n, chrono::milliseconds timeout) {
+        if (!available.try_acquire_for(timeout))
+            return false;
+
+        notification_node* next;
+
+        // a producer may have swapped the head but not linked its node in yet
+        while (!(next = tail->next.load(memory_order_acquire))) {
+            this_thread::yield();
+        }
+
+        n = move(next->n);
+
+        if (tail != &stub)
+            delete tail;
+
+        tail = next;
+
+        return true;
+    }
+
+private:
+    notification_node stub;
+    atomic<notification_node*> head;
+    notification_node* tail;
+    counting_semaphore<> available{0};
+};
+
+// e.g. 2024-05-01T10:20:30Z, perhaps with fractions of a second
+static optional<chrono::system_clock::time_point> parse_timestamp(const string& s) {
+    int year;
+    unsigned int month, day, hour, minute;
+    double second;
+
+    if (sscanf(s.c_str(), "%d-%u-%uT%u:%u:%lf", &year, &month, &day, &hour, &minute, &second) != 6)
+        return nullopt;
+
+    auto ymd = chrono::year{year} / chrono::month{month} / chrono::day{day};
+
+    if (!ymd.ok())
+        return nullopt;
+
+    chrono::system_clock::time_point tp = chrono::sys_days{ymd};
+
+    tp += chrono::hours{hour} + chrono::minutes{minute};
+    tp += chrono::duration_cast<chrono::system_clock::duration>(chrono::duration<double>(second));
+
+    return tp;
+}
+
+class subscription_runner::impl {
+public:
+    impl(subscription& sub, const string& url, unsigned int timeout) :
+         keeper([this, &sub, url](soap& s, unsigned int timeout, const function<void()>& heartbeat) {
+             auto id = sub.current_id();
+
+             try {
+                 get_streaming_events(s, url, span(&id, 1), timeout, [&](string_view, notification& n) {
+                     sub.record_watermark(n.watermark);
+                     queue.push(move(n));
+                 }, heartbeat);
+             } catch (const subscription_not_found&) {
+                 // the next stream will use the new subscription
+                 sub.resume([&](const notification& n) {
+                     queue.push(notification(n));
+                 });
+             }
+         }, timeout) {
+    }
+
+    bool pop(notification& n, chrono::milliseconds timeout) {
+        if (!queue.pop(n, timeout))
+            return false;
+
+        events++;
+
+        if (auto ts = parse_timestamp(n.timestamp)) {
+            auto latency = chrono::duration_cast<chrono::microseconds>(chrono::system_clock::now() - *ts).count();
+
+            latency = max(latency, (int64_t)0);
+
+            latency_count++;
+            latency_sum += (uint64_t)latency;
+
+            auto prev = latency_max.load();
+
+            while ((uint64_t)latency > prev && !latency_max.compare_exchange_weak(prev, (uint64_t)latency)) {
+            }
+        }
+
+        return true;
+    }
+
+    runner_stats stats() const {
+        runner_stats st;
+
+        st.events = events;
+        st.reconnects = keeper.reconnects;
+        st.errors = keeper.errors;
+
+        if (latency_count != 0)
+            st.mean_latency = chrono::microseconds(latency_sum / latency_count);
+
+        st.max_latency = chrono::microseconds(latency_max);
+
+        return st;
+    }
+
+    notification_queue queue;
+    atomic<uint64_t> events = 0;
+    atomic<uint64_t> latency_count = 0;
+    atomic<uint64_t> latency_sum = 0;
+    atomic<uint64_t> latency_max = 0;
+    stream_keeper keeper; // last, so that its threads are gone before the queue is
+};
+
+subscription_runner::subscription_runner(subscription& sub, unsigned int timeout) : sub(sub) {
+    state = make_unique<impl>(sub, sub.p.url, timeout);
+}
+
+subscription_runner::~subscription_runner() {
+    stop();
+}
+
+bool subscription_runner::pop(notification& n, chrono::milliseconds timeout) {
+    return state->pop(n, timeout);
+}
+
+runner_stats subscription_runner::stats() const {
+    return state->stats();
+}
+
+void subscription_runner::stop() {
+    state->keeper.stop();
+}
+
+class subscription_group::impl {
+public:
+    struct member {
+        subscription* sub;
+        shared_ptr<handler_func> handler;
+    };
+
+    impl(const string& url, unsigned int timeout) :
+         keeper([this, url](soap& s, unsigned int timeout, const function<void()>& heartbeat) {
+             try {
+                 get_streaming_events(s, url, ids(), timeout, [&](string_view subscription_id, notification& n) {
+                     member m;
+
+                     {
+                         lock_guard lg(lock);
+
+                         auto it = members.find(subscription_id);
+
+                         // not a member any more
+                         if (it == members.end())
+                             return;
+
+                         m = it->second;
+                     }
+
+                     dispatch(m, [&]() {
+                         m.sub->record_watermark(n.watermark);
+                         (*m.handler)(n);
+                     });
+                 }, heartbeat);
+             } catch (const subscription_not_found&) {
+                 resume_all();
+             }
+         }, timeout, false) {
+    }
+
+    vector<string> ids() {
+        lock_guard lg(lock);
+        vector<string> v;
+
+        v.reserve(members.size());
+
+        for (const auto& m : members) {
+            v.emplace_back(m.first);
+        }
+
+        return v;
+    }
+
+    // Marks the member as busy while func runs, so that remove can wait for it.
+    // m must already have been looked up under the lock.
+    void dispatch(const member& m, const function<void()>& func) {
+        struct busy_guard {
+            busy_guard(impl& g, subscription* sub) : g(g), sub(sub), prev(exchange(dispatching, &g)) {
+                lock_guard lg(g.lock);
+
+                g.busy[sub]++;
+            }
+
+            ~busy_guard() {
+                dispatching = prev;
+
+                lock_guard lg(g.lock);
+
+                if (--g.busy[sub] == 0)
+                    g.busy.erase(sub);
+
+                g.idle.notify_all();
+            }
+
+            impl& g;
+            subscription* sub;
+            impl* prev;
+        };
+
+        busy_guard bg(*this, m.sub);
+
+        func();
+    }
+
+    map<string, member, less<>>::iterator find_member(const subscription& sub) {
+        return find_if(members.begin(), members.end(), [&](const auto& m) {
+            return m.second.sub == &sub;
+        });
+    }
+
+    // The server doesn't tell us which of the subscriptions it has lost, but
+    // this usually means it's been restarted and they've all gone. Each member
+    // is re-keyed as soon as it's been resumed, so one failure doesn't leave the
+    // rest under their dead IDs.
+    void resume_all() {
+        vector<member> v;
+
+        {
+            lock_guard lg(lock);
+
+            for (const auto& m : members) {
+                v.push_back(m.second);
+            }
+        }
+
+        for (const auto& m : v) {
+            string old_id;
+            bool failed = false;
+
+            {
+                lock_guard lg(lock);
+
+                auto it = find_member(*m.sub);
+
+                // removed while we were resuming the others
+                if (it == members.end())
+                    continue;
+
+                old_id = it->first;
+            }
+
+            dispatch(m, [&]() {
+                try {
+                    m.sub->resume([&](const notification& n) {
+                        (*m.handler)(n);
+                    });
+                } catch (...) {
+                    failed = true;
+                }
+            });
+
+            lock_guard lg(lock);
+
+            auto it = find_member(*m.sub);
+
+            if (it == members.end())
+                continue;
+
+            auto new_id = m.sub->current_id();
+
+            members.erase(it);
+
+            // If catching up failed, the new subscription is still good, and
+            // we carry on without the events we missed. If resubscribing
+            // failed, there's nothing left to stream.
+            if (!failed || new_id != old_id)
+                members.emplace(new_id, m);
+        }
+    }
+
+    mutable mutex lock;
+    condition_variable idle;
+    map<string, member, less<>> members;
+    map<subscription*, unsigned int> busy;
+    static thread_local impl* dispatching;
+    stream_keeper keeper; // last, so that its threads are gone before the members are
+};
+
+thread_local subscription_group::impl* subscription_group::impl::dispatching = nullptr;
+
+subscription_group::subscription_group(prospect& p, unsigned int timeout) : p(p) {
+    state = make_unique<impl>(p.url, timeout);
+}
+
+subscription_group::~subscription_group() {
+    stop();
+}
+
+void subscription_group::add(subscription& sub, handler_func handler) {
+    bool was_empty;
+
+    {
+        lock_guard lg(state->lock);
+
+        was_empty = state->members.empty();
+        state->members[sub.current_id()] = impl::member{&sub, make_shared<handler_func>(move(handler))};
+    }
+
+    if (was_empty)
+        state->keeper.set_active(true);
+    else
+        state->keeper.restart();
+}
+
+void subscription_group::remove(subscription& sub) {
+    bool now_empty;
+
+    {
+        unique_lock ul(state->lock);
+
+        // found by address rather than ID, as the ID changes if it's resumed
+        auto it = state->find_member(sub);
+
+        if (it == state->members.end())
+            return;
+
+        state->members.erase(it);
+        now_empty = state->members.empty();
+
+        // a handler removing a member can't wait for itself
+        if (impl::dispatching != state.get()) {
+            state->idle.wait(ul, [&]() {
+                return !state->busy.contains(&sub);
+            });
+        }
+    }
+
+    if (now_empty)
+        state->keeper.set_active(false);
+    else
+        state->keeper.restart();
+}
+
+size_t subscription_group::size() const {
+    lock_guard lg(state->lock);
+
+    return state->members.size();
+}
+
+void subscription_group::stop() {
+    state->keeper.stop();
+}
+
 }
@@ -3,7 +3,21 @@
 #include <string>
 #include <map>
 #include <vector>
+#include <list>
+#include <unordered_map>
 #include <functional>
+#include <stdint.h>
+#include <span>
+#include <filesystem>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <memory_resource>
+#include <coroutine>
+#include <exception>
+#include <optional>
+#include <ranges>
+#include <utility>
 
 #ifdef _WIN32
 
@@ -53,6 +67,64 @@ public:
     unsigned int total_count, child_folder_count, unread_count;
 };
 
+class PROSPECT folder_tree {
+public:
+    using const_iterator = std::pmr::list<folder>::const_iterator;
+
+    folder_tree() = default;
+    folder_tree(std::pmr::memory_resource* mr);
+    folder_tree(const folder_tree& t);
+    folder_tree(folder_tree&&) = default;
+    folder_tree& operator=(const folder_tree& t);
+    folder_tree& operator=(folder_tree&& t);
+
+    const folder* find(std::string_view id) const;
+    const folder* find(std::string_view parent, std::string_view name) const;
+    const folder* find_path(std::string_view path, std::string_view root = "") const;
+    const folder& insert(folder f);
+    bool erase(std::string_view id);
+    std::string_view root_id() const;
+
+    size_t size() const {
+        return folders.size();
+    }
+
+    bool empty() const {
+        return folders.empty();
+    }
+
+    const_iterator begin() const {
+        return folders.begin();
+    }
+
+    const_iterator end() const {
+        return folders.end();
+    }
+
+private:
+    struct name_key {
+        std::string_view parent, name;
+
+        bool operator==(const name_key&) const = default;
+    };
+
+    struct name_key_hash {
+        size_t operator()(const name_key& k) const noexcept;
+    };
+
+    // index keys are views into the folders in the list, which never move
+    std::pmr::list<folder> folders;
+    std::pmr::unordered_map<std::string_view, std::pmr::list<folder>::iterator> by_id;
+    std::pmr::unordered_map<name_key, std::pmr::list<folder>::iterator, name_key_hash> by_name;
+    std::pmr::unordered_multimap<std::string_view, std::pmr::list<folder>::iterator> by_parent;
+};
+
+class PROSPECT folder_hierarchy {
+public:
+    std::string sync_state;
+    folder_tree folders;
+};
+
 class prospect;
 
 class PROSPECT mail_item {
@@ -64,9 +136,9 @@ public:
 
     prospect& p;
     std::string id, subject, received;
-    bool read;
+    bool read = false;
     std::string sender_name, sender_email;
-    bool has_attachments;
+    bool has_attachments = false;
     std::string conversation_id, internet_id, change_key, body;
     std::vector<std::string> recipients, cc, bcc;
     enum importance importance = importance::normal;
@@ -83,28 +155,533 @@ public:
     std::string modified;
 };
 
+class PROSPECT item_result {
+public:
+    item_result(std::string_view id, std::string_view response_code) : id(id), response_code(response_code) {
+    }
+
+    bool success() const {
+        return response_code == "NoError";
+    }
+
+    std::string id, response_code;
+};
+
+enum class item_field : uint32_t {
+    subject = 1 << 0,
+    date_time_received = 1 << 1,
+    sender = 1 << 2,
+    is_read = 1 << 3,
+    has_attachments = 1 << 4,
+    conversation_id = 1 << 5,
+    internet_message_id = 1 << 6,
+    importance = 1 << 7,
+    to_recipients = 1 << 8,
+    cc_recipients = 1 << 9,
+    bcc_recipients = 1 << 10,
+    body = 1 << 11
+};
+
+constexpr item_field operator|(item_field a, item_field b) {
+    return (item_field)((uint32_t)a | (uint32_t)b);
+}
+
+constexpr item_field operator&(item_field a, item_field b) {
+    return (item_field)((uint32_t)a & (uint32_t)b);
+}
+
+constexpr item_field operator~(item_field a) {
+    return (item_field)(~(uint32_t)a);
+}
+
+constexpr bool has_field(item_field fields, item_field f) {
+    return (uint32_t)(fields & f) != 0;
+}
+
+// what find_items has always returned - Exchange won't give us recipients or the body in FindItem
+inline constexpr item_field summary_fields = item_field::subject | item_field::date_time_received | item_field::sender |
+                                             item_field::is_read | item_field::has_attachments | item_field::conversation_id |
+                                             item_field::internet_message_id | item_field::importance;
+
+inline constexpr item_field all_fields = summary_fields | item_field::to_recipients | item_field::cc_recipients |
+                                         item_field::bcc_recipients | item_field::body;
+
+enum class body_type {
+    best,
+    html,
+    text
+};
+
+class PROSPECT item_shape {
+public:
+    constexpr item_shape(item_field fields, enum body_type body_type = body_type::best, unsigned int max_body_size = 0) :
+                         fields(fields), body_type(body_type), max_body_size(max_body_size) {
+    }
+
+    // whether an item fetched with this shape has everything that other asks for
+    constexpr bool covers(const item_shape& other) const {
+        if ((fields & other.fields) != other.fields)
+            return false;
+
+        if (has_field(other.fields, item_field::body))
+            return body_type == other.body_type && max_body_size == other.max_body_size;
+
+        return true;
+    }
+
+    item_field fields;
+    enum body_type body_type;
+    unsigned int max_body_size; // needs Exchange 2013 or later
+};
+
+enum class containment_mode {
+    full_string,
+    prefixed,
+    substring,
+    prefix_on_words,
+    exact_phrase
+};
+
+enum class restriction_type {
+    none,
+    is_equal_to,
+    is_not_equal_to,
+    is_greater_than,
+    is_greater_than_or_equal_to,
+    is_less_than,
+    is_less_than_or_equal_to,
+    contains,
+    exists,
+    all,
+    any,
+    negate
+};
+
+class PROSPECT restriction {
+public:
+    restriction() = default;
+
+    static restriction is_equal_to(item_field field, std::string_view value);
+    static restriction is_not_equal_to(item_field field, std::string_view value);
+    static restriction is_greater_than(item_field field, std::string_view value);
+    static restriction is_greater_than_or_equal_to(item_field field, std::string_view value);
+    static restriction is_less_than(item_field field, std::string_view value);
+    static restriction is_less_than_or_equal_to(item_field field, std::string_view value);
+    static restriction contains(item_field field, std::string_view value, containment_mode mode = containment_mode::substring,
+                                bool ignore_case = true);
+    static restriction exists(item_field field);
+    static restriction all(std::vector<restriction> children);
+    static restriction any(std::vector<restriction> children);
+    static restriction negate(restriction r);
+
+    restriction_type type = restriction_type::none;
+    item_field field = item_field::subject;
+    std::string value;
+    containment_mode mode = containment_mode::substring;
+    bool ignore_case = true;
+    std::vector<restriction> children;
+};
+
+inline restriction operator&&(restriction a, restriction b) {
+    return restriction::all({ std::move(a), std::move(b) });
+}
+
+inline restriction operator||(restriction a, restriction b) {
+    return restriction::any({ std::move(a), std::move(b) });
+}
+
+inline restriction operator!(restriction r) {
+    return restriction::negate(std::move(r));
+}
+
+enum class sync_change {
+    created,
+    updated,
+    deleted,
+    read_flag_changed
+};
+
+// Methods may be called from several threads at once, but all the calls for
+// any one item will come from the same thread.
+class PROSPECT item_sink {
+public:
+    virtual ~item_sink() = default;
+
+    virtual void start(std::string_view item_id) = 0;
+    virtual void write(std::string_view item_id, std::string_view data) = 0;
+    virtual void finish(std::string_view item_id) = 0;
+};
+
+// Given the content of attachments as it's decoded, in order: start, any number
+// of writes, then finish. If the request breaks off partway through, the last
+// attachment started won't get its finish. Successful attachments without any
+// content, such as item attachments, are reported with a response code of
+// "NoContent", and the sink isn't called for them.
+class PROSPECT attachment_sink {
+public:
+    virtual ~attachment_sink() = default;
+
+    virtual void start(const attachment& att) = 0;
+    virtual void write(const attachment& att, std::string_view data) = 0;
+    virtual void finish(const attachment& att) = 0;
+};
+
+// A persistent cache of items fetched by get_item, kept in dir as an append-only
+// log with a memory-mapped index. An item is only served from the cache if its
+// ChangeKey still matches, and if it was fetched with at least the fields now
+// being asked for. Once the log grows past max_size it is compacted, dropping
+// the oldest items if need be. find leaves item alone if it returns false.
+// get_item without a ChangeKey has to look the current one up with an IdOnly
+// GetItem first, so a miss costs two round trips; pass the ChangeKey from
+// find_items or a notification where you have it.
+class PROSPECT item_cache {
+public:
+    item_cache(const std::filesystem::path& dir, uint64_t max_size = 256 * 1024 * 1024);
+    ~item_cache();
+
+    bool find(std::string_view id, std::string_view change_key, const item_shape& shape, mail_item& item);
+    void store(const mail_item& item, const item_shape& shape);
+    void erase(std::string_view id);
+    void compact();
+    uint64_t size() const;
+    size_t count() const;
+
+private:
+    class impl;
+
+    std::unique_ptr<impl> state;
+};
+
+class PROSPECT cache_stats {
+public:
+    uint64_t hits = 0, misses = 0, evictions = 0;
+    size_t bytes = 0, entries = 0;
+};
+
+// An in-process LRU cache in front of get_item and get_attachments, split into
+// shards so that threads seldom wait on each other. Entries are evicted once
+// their estimated size passes max_bytes. If validate is set, the item's
+// ChangeKey is checked with an IdOnly GetItem before a cached copy is used;
+// otherwise entries are trusted until they're evicted. An empty change_key
+// passed to the find functions matches anything.
+class PROSPECT memory_cache {
+public:
+    memory_cache(size_t max_bytes = 64 * 1024 * 1024, bool validate = true, unsigned int shards = 16);
+    ~memory_cache();
+
+    std::shared_ptr<const mail_item> find_item(std::string_view id, std::string_view change_key, const item_shape& shape);
+    void store_item(const mail_item& item, const item_shape& shape);
+    std::shared_ptr<const std::vector<attachment>> find_attachments(std::string_view item_id, std::string_view change_key);
+    void store_attachments(std::string_view item_id, std::string_view change_key, const std::vector<attachment>& atts);
+    void erase(std::string_view item_id);
+    void clear();
+    bool validating() const;
+    cache_stats stats() const;
+
+private:
+    class impl;
+
+    std::unique_ptr<impl> state;
+};
+
+class PROSPECT store_stats {
+public:
+    uint64_t downloaded = 0, deduplicated = 0, stored = 0;
+    uint64_t bytes_stored = 0, bytes_saved = 0; // saved is what didn't need to be written, whether downloaded or not
+};
+
+// Keeps the content of attachments in dir, under objects/ by SHA-256, so that
+// each distinct attachment is written once. An index from (name, size,
+// modified) to hash lets us skip downloading anything that looks like an
+// attachment we've already got. fetch returns the hash of each attachment's
+// content, in the same order - or an empty string for any that couldn't be
+// downloaded - and path turns a hash into a filename.
+class PROSPECT attachment_store {
+public:
+    attachment_store(prospect& p, const std::filesystem::path& dir);
+    ~attachment_store();
+
+    std::vector<std::string> fetch(std::span<const attachment> atts);
+    std::filesystem::path path(std::string_view hash) const;
+    store_stats stats() const;
+
+private:
+    class impl;
+
+    prospect& p;
+    std::unique_ptr<impl> state;
+};
+
+// Record and replay of all traffic to Exchange, from every prospect object in
+// the process, so that a workload can be captured once and rerun offline.
+// record_transport writes each request and its response to dir, along with
+// when each chunk of the response arrived. replay_transport serves those
+// responses instead of going to the network: requests are matched on their
+// URL, SOAPAction and body, and repeats of a request get the recorded responses
+// in order. Latency is reproduced multiplied by latency_scale, so 0 replays as
+// fast as possible. live_transport goes back to the network. Autodiscover's
+// DNS lookup isn't covered, so replays should use prospect::from_url.
+PROSPECT void record_transport(const std::filesystem::path& dir);
+PROSPECT void replay_transport(const std::filesystem::path& dir, double latency_scale = 1.0);
+PROSPECT void live_transport();
+
+// While one of these is alive, requests made on this thread take their working
+// buffers - the XML being sent and the response being parsed - from mr rather
+// than the global heap. Only this thread uses mr, so it needn't be thread-safe:
+// a monotonic_buffer_resource per request is the obvious choice. Scopes nest,
+// and must end in the reverse order they began. Work handed to other threads,
+// such as the prefetch in find_items, still uses the default resource.
+class PROSPECT scoped_resource {
+public:
+    scoped_resource(std::pmr::memory_resource* mr);
+    ~scoped_resource();
+    scoped_resource(const scoped_resource&) = delete;
+    scoped_resource& operator=(const scoped_resource&) = delete;
+
+private:
+    std::pmr::memory_resource* prev;
+};
+
 class subscription;
 
+// A lazily-evaluated sequence, produced by a coroutine which runs only as far
+// as is needed for the next value. Values are handed over by reference, so can
+// be moved out. It can only be iterated once.
+template<typename T>
+class generator : public std::ranges::view_interface<generator<T>> {
+public:
+    class promise_type {
+    public:
+        // not an aggregate, or it'd be initialized from the coroutine's arguments
+        promise_type() = default;
+
+        generator get_return_object() {
+            return generator(std::coroutine_handle<promise_type>::from_promise(*this));
+        }
+
+        std::suspend_always initial_suspend() noexcept {
+            return {};
+        }
+
+        std::suspend_always final_suspend() noexcept {
+            return {};
+        }
+
+        std::suspend_always yield_value(T v) {
+            value.reset();
+            value.emplace(std::move(v));
+
+            return {};
+        }
+
+        void return_void() {
+        }
+
+        void unhandled_exception() {
+            exc = std::current_exception();
+        }
+
+        std::optional<T> value;
+        std::exception_ptr exc;
+    };
+
+    class iterator {
+    public:
+        using value_type = T;
+        using difference_type = std::ptrdiff_t;
+
+        iterator() = default;
+
+        T& operator*() const {
+            return *h.promise().value;
+        }
+
+        iterator& operator++() {
+            advance();
+            return *this;
+        }
+
+        void operator++(int) {
+            advance();
+        }
+
+        bool operator==(std::default_sentinel_t) const {
+            return !h || h.done();
+        }
+
+    private:
+        friend generator;
+
+        iterator(std::coroutine_handle<promise_type> h) : h(h) {
+        }
+
+        // Resuming a finished coroutine is undefined, so once it's done we stay
+        // done - even after throwing, in case the caller carries on regardless.
+        void advance() {
+            if (!h || h.done())
+                return;
+
+            h.resume();
+
+            if (h.done() && h.promise().exc)
+                std::rethrow_exception(std::exchange(h.promise().exc, nullptr));
+        }
+
+        std::coroutine_handle<promise_type> h;
+    };
+
+    generator(generator&& g) noexcept : h(std::exchange(g.h, nullptr)), started(std::exchange(g.started, false)) {
+    }
+
+    generator& operator=(generator&& g) noexcept {
+        if (this != &g) {
+            if (h)
+                h.destroy();
+
+            h = std::exchange(g.h, nullptr);
+            started = std::exchange(g.started, false);
+        }
+
+        return *this;
+    }
+
+    ~generator() {
+        if (h)
+            h.destroy();
+    }
+
+    // Only the first call runs the coroutine up to its first value; later ones
+    // pick up wherever iteration has got to.
+    iterator begin() {
+        iterator it(h);
+
+        if (!started) {
+            started = true;
+            it.advance();
+        }
+
+        return it;
+    }
+
+    std::default_sentinel_t end() const noexcept {
+        return {};
+    }
+
+private:
+    generator(std::coroutine_handle<promise_type> h) : h(h) {
+    }
+
+    std::coroutine_handle<promise_type> h;
+    bool started = false;
+};
+
+// A prospect object can be shared between threads, and all its methods called
+// concurrently. Each thread keeps its own connection to the server, which is
+// reused by later calls from that thread.
 class PROSPECT prospect {
 public:
     prospect(std::string_view domain = "");
     ~prospect();
 
+    prospect(const prospect&) = delete;
+    prospect& operator=(const prospect&) = delete;
+
+    static prospect from_url(std::string_view url); // skips autodiscover
+
     void get_domain_settings(const std::string& url, std::string_view domain, std::map<std::string, std::string>& settings);
     void get_user_settings(const std::string& url, std::string_view mailbox, std::map<std::string, std::string>& settings);
-    std::vector<folder> find_folders(std::string_view mailbox = "");
-    void find_items(std::string_view folder, const std::function<bool(const mail_item&)>& func);
-    bool get_item(std::string_view id, const std::function<bool(const mail_item&)>& func);
+    folder_tree find_folders(std::string_view mailbox = "");
+    folder_tree find_folders(std::string_view mailbox, std::pmr::memory_resource* mr);
+    bool sync_folders(folder_hierarchy& h, std::string_view mailbox = "");
+    void find_items(std::string_view folder, const std::function<bool(const mail_item&)>& func,
+                    const item_shape& shape = summary_fields, unsigned int page_size = 1000, unsigned int offset = 0);
+    void find_items(std::string_view folder, const restriction& restr, const std::function<bool(const mail_item&)>& func,
+                    const item_shape& shape = summary_fields, unsigned int page_size = 1000, unsigned int offset = 0);
+    // Like find_items, but pulled a page at a time: nothing further is fetched
+    // once the caller stops iterating.
+    generator<mail_item> items(std::string folder, const item_shape& shape = summary_fields, unsigned int page_size = 1000,
+                               unsigned int offset = 0);
+    generator<mail_item> items(std::string folder, restriction restr, item_shape shape = summary_fields,
+                               unsigned int page_size = 1000, unsigned int offset = 0);
+    // If given, page_done is called with the SyncState after each page's changes
+    // have gone to func, so a long sync can be resumed from there if it's cut short.
+    std::string sync_items(std::string_view folder, std::string_view sync_state,
+                           const std::function<void(enum sync_change type, const mail_item& item)>& func,
+                           const item_shape& shape = summary_fields,
+                           const std::function<void(std::string_view sync_state)>& page_done = nullptr);
+    bool get_item(std::string_view id, const std::function<bool(const mail_item&)>& func, const item_shape& shape = all_fields);
+    bool get_item(std::string_view id, std::string_view change_key, const std::function<bool(const mail_item&)>& func,
+                  const item_shape& shape = all_fields);
+    void get_items(std::span<const std::string> ids, const std::function<bool(const mail_item&)>& func,
+                   const item_shape& shape = all_fields);
     std::vector<attachment> get_attachments(std::string_view item_id);
+    std::pmr::vector<attachment> get_attachments(std::string_view item_id, std::pmr::memory_resource* mr);
     std::string read_attachment(std::string_view id);
+    std::map<std::string, std::vector<attachment>> get_attachments_for_items(std::span<const std::string> ids);
+    std::vector<item_result> read_attachments(std::span<const attachment> atts, attachment_sink& sink);
+    std::vector<item_result> read_attachments(std::span<const attachment> atts,
+                                              const std::function<void(const attachment&, std::string_view)>& func);
     std::string move_item(std::string_view id, std::string_view folder);
-    std::string create_folder(std::string_view parent, std::string_view name, const std::vector<folder>& folders);
+    std::vector<item_result> move_items(std::span<const std::string> ids, std::string_view folder);
+    std::vector<item_result> copy_items(std::span<const std::string> ids, std::string_view folder);
+    std::vector<item_result> export_items(std::span<const std::string> ids, item_sink& sink, unsigned int concurrency = 4);
+    std::vector<item_result> export_items(std::span<const std::string> ids, const std::filesystem::path& dir,
+                                          unsigned int concurrency = 4);
+    std::vector<item_result> upload_items(std::string_view folder, const std::function<bool(std::string& data)>& source,
+                                          unsigned int concurrency = 4);
+    std::vector<item_result> upload_items(std::string_view folder, std::span<const std::filesystem::path> files,
+                                          unsigned int concurrency = 4);
+    std::vector<item_result> send_emails(std::span<const mail_item> items);
+    std::string create_folder(std::string_view parent, std::string_view name, folder_tree& folders);
+    // not while other threads are using this object
+    void set_item_cache(std::shared_ptr<item_cache> cache);
+    void set_memory_cache(std::shared_ptr<memory_cache> cache);
 
     friend class mail_item;
     friend class subscription;
+    friend class subscription_runner;
+    friend class subscription_group;
 
 private:
+    struct url_tag { };
+
+    prospect(url_tag, std::string_view url);
+    bool fetch_item(std::string_view id, const std::function<bool(const mail_item&)>& func, const item_shape& shape);
+    bool fetch_and_cache_item(std::string_view id, const std::function<bool(const mail_item&)>& func, const item_shape& shape);
+    bool get_change_key(std::string_view id, std::string& change_key);
+    folder_tree fetch_folders(std::string_view mailbox, std::pmr::memory_resource* mr);
+    std::vector<attachment> fetch_attachments(std::string_view item_id, std::string* change_key);
+    generator<mail_item> generate_items(std::string folder, restriction restr, item_shape shape, unsigned int page_size,
+                                        unsigned int offset);
+
     std::string url;
+    std::shared_ptr<item_cache> cache;
+    std::shared_ptr<memory_cache> mem_cache;
+};
+
+// Walks a whole mailbox using a pool of worker threads. The callbacks are
+// called from the worker threads, and so may be called concurrently. An item
+// with attachments that couldn't be read is left out of the checkpoint, so that
+// a resumed crawl fetches it again.
+class PROSPECT crawler {
+public:
+    crawler(prospect& p) : p(p) { }
+
+    void crawl(std::string_view mailbox = "");
+
+    prospect& p;
+    unsigned int threads = 8;
+    unsigned int max_in_flight = 8;
+    unsigned int max_folder_tasks = 2;
+    unsigned int max_item_tasks = 8;
+    unsigned int max_attachment_tasks = 4;
+    item_shape shape = all_fields;
+    bool fetch_attachments = true;
+    std::filesystem::path checkpoint;
+
+    std::function<bool(const folder&)> on_folder;
+    std::function<void(const mail_item&)> on_item;
+    std::function<void(const mail_item&, const attachment&, std::string_view)> on_attachment;
 };
 
 enum class event {
@@ -118,6 +695,13 @@ enum class event {
     status
 };
 
+class PROSPECT notification {
+public:
+    enum event type;
+    std::string timestamp, item_id, item_change_key, parent_id, parent_change_key;
+    std::string watermark; // save this once the event has been dealt with, to pass to catch_up after a restart
+};
+
 class PROSPECT subscription {
 public:
     subscription(prospect& p, std::string_view parent, const std::vector<enum event>& events);
@@ -127,14 +711,115 @@ public:
                                                              std::string_view item_change_key, std::string_view parent_id,
                                                              std::string_view parent_change_key)>& func);
     void cancel();
+    std::string watermark() const; // the last one received
+    void catch_up(std::string_view watermark, const std::function<void(const notification&)>& func);
+    void resume(const std::function<void(const notification&)>& func);
 
     prospect& p;
 
+    friend class subscription_runner;
+    friend class subscription_group;
+
 private:
+    std::string current_id() const;
+    void record_watermark(std::string_view watermark);
+
+    std::string parent;
+    std::vector<enum event> events;
+    mutable std::mutex lock;
     std::string id;
+    std::string last_watermark;
     bool cancelled = false;
 };
 
+class PROSPECT runner_stats {
+public:
+    uint64_t events = 0; // dequeued so far
+    uint64_t reconnects = 0;
+    uint64_t errors = 0;
+    std::chrono::microseconds mean_latency{0}; // from the event's TimeStamp to pop
+    std::chrono::microseconds max_latency{0};
+};
+
+// Holds a streaming connection open for a subscription on a background thread.
+// The next GetStreamingEvents is started before the last one times out, so there
+// is never a gap without a connection. Events are queued until pop is called,
+// which must only be done from one thread at a time.
+class PROSPECT subscription_runner {
+public:
+    subscription_runner(subscription& sub, unsigned int timeout = 30);
+    ~subscription_runner();
+
+    bool pop(notification& n, std::chrono::milliseconds timeout = std::chrono::milliseconds::zero());
+    runner_stats stats() const;
+    void stop();
+
+    subscription& sub;
+
+private:
+    class impl;
+
+    std::unique_ptr<impl> state;
+};
+
+// Merges bursts of events, so that an item that is created and then modified
+// several times is only fetched once. Events are held until the oldest is
+// window old, or max_events have built up, and the items that are left are then
+// fetched with one batched GetItem and passed to func. Items that have gone by
+// then, or that were deleted, are passed in deleted instead. An item created and
+// deleted within the same window is dropped altogether.
+class PROSPECT event_coalescer {
+public:
+    using batch_func = std::function<void(std::span<const mail_item> items, std::span<const std::string> deleted)>;
+
+    event_coalescer(prospect& p, batch_func func, const item_shape& shape = summary_fields,
+                    std::chrono::milliseconds window = std::chrono::milliseconds(500), size_t max_events = 100);
+    ~event_coalescer();
+
+    void push(const notification& n);
+    void poll();
+    void flush();
+    void consume(subscription_runner& runner, std::chrono::milliseconds duration);
+
+    prospect& p;
+
+private:
+    class impl;
+
+    std::unique_ptr<impl> state;
+};
+
+// Streams events for any number of subscriptions over a single GetStreamingEvents
+// connection, kept open by a background thread as with subscription_runner.
+// Adding or removing a member opens a new connection before the old one is
+// closed, so no events are lost. Handlers are called on the background thread,
+// and may add or remove members themselves. Once remove returns, that member's
+// handler won't be called again and the subscription may be destroyed, except
+// when remove is called from a handler, which doesn't wait for other handlers
+// still running. If the server loses the subscriptions, each is resubscribed
+// and caught up from its last watermark; one that can't be resubscribed is
+// dropped from the group, and one whose watermark has expired carries on
+// without the events it missed.
+class PROSPECT subscription_group {
+public:
+    using handler_func = std::function<void(const notification& n)>;
+
+    subscription_group(prospect& p, unsigned int timeout = 30);
+    ~subscription_group();
+
+    void add(subscription& sub, handler_func handler);
+    void remove(subscription& sub);
+    size_t size() const;
+    void stop();
+
+    prospect& p;
+
+private:
+    class impl;
+
+    std::unique_ptr<impl> state;
+};
+
 };
 
 #ifdef _MSC_VER
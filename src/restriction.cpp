@@ -0,0 +1,99 @@
+#include "prospect.h"
+#include "misc.h"
+
+using namespace std;
+
+namespace prospect {
+
+static restriction comparison(restriction_type type, item_field field, string_view value) {
+    restriction r;
+
+    r.type = type;
+    r.field = field;
+    r.value = value;
+
+    return r;
+}
+
+restriction restriction::is_equal_to(item_field field, string_view value) {
+    return comparison(restriction_type::is_equal_to, field, value);
+}
+
+restriction restriction::is_not_equal_to(item_field field, string_view value) {
+    return comparison(restriction_type::is_not_equal_to, field, value);
+}
+
+restriction restriction::is_greater_than(item_field field, string_view value) {
+    return comparison(restriction_type::is_greater_than, field, value);
+}
+
+restriction restriction::is_greater_than_or_equal_to(item_field field, string_view value) {
+    return comparison(restriction_type::is_greater_than_or_equal_to, field, value);
+}
+
+restriction restriction::is_less_than(item_field field, string_view value) {
+    return comparison(restriction_type::is_less_than, field, value);
+}
+
+restriction restriction::is_less_than_or_equal_to(item_field field, string_view value) {
+    return comparison(restriction_type::is_less_than_or_equal_to, field, value);
+}
+
+restriction restriction::contains(item_field field, string_view value, containment_mode mode, bool ignore_case) {
+    auto r = comparison(restriction_type::contains, field, value);
+
+    r.mode = mode;
+    r.ignore_case = ignore_case;
+
+    return r;
+}
+
+restriction restriction::exists(item_field field) {
+    return comparison(restriction_type::exists, field, "");
+}
+
+static restriction combine(restriction_type type, vector<restriction> children) {
+    restriction r;
+
+    r.type = type;
+
+    // flatten, so that a && b && c becomes one t:And rather than nested ones
+    for (auto& c : children) {
+        if (c.type == type) {
+            for (auto& c2 : c.children) {
+                r.children.push_back(move(c2));
+            }
+        } else if (c.type != restriction_type::none)
+            r.children.push_back(move(c));
+    }
+
+    if (r.children.empty())
+        return restriction();
+
+    if (r.children.size() == 1)
+        return move(r.children.front());
+
+    return r;
+}
+
+restriction restriction::all(vector<restriction> children) {
+    return combine(restriction_type::all, move(children));
+}
+
+restriction restriction::any(vector<restriction> children) {
+    return combine(restriction_type::any, move(children));
+}
+
+restriction restriction::negate(restriction r) {
+    if (r.type == restriction_type::none)
+        throw formatted_error("Cannot negate an empty restriction.");
+
+    restriction n;
+
+    n.type = restriction_type::negate;
+    n.children.push_back(move(r));
+
+    return n;
+}
+
+}
@@ -0,0 +1,158 @@
+// SHA-256, as in FIPS 180-4.
+
+#include "sha256.h"
+#include <string.h>
+#include <algorithm>
+
+using namespace std;
+
+static const uint32_t k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static inline uint32_t ror(uint32_t x, unsigned int n) {
+    return (x >> n) | (x << (32 - n));
+}
+
+sha256::sha256() {
+    static const uint32_t init[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+
+    memcpy(state, init, sizeof(state));
+}
+
+void sha256::transform(const uint8_t* block) {
+    uint32_t w[64];
+
+    for (unsigned int i = 0; i < 16; i++) {
+        w[i] = ((uint32_t)block[i * 4] << 24) | ((uint32_t)block[(i * 4) + 1] << 16) |
+               ((uint32_t)block[(i * 4) + 2] << 8) | (uint32_t)block[(i * 4) + 3];
+    }
+
+    for (unsigned int i = 16; i < 64; i++) {
+        auto s0 = ror(w[i - 15], 7) ^ ror(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        auto s1 = ror(w[i - 2], 17) ^ ror(w[i - 2], 19) ^ (w[i - 2] >> 10);
+
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    auto a = state[0], b = state[1], c = state[2], d = state[3];
+    auto e = state[4], f = state[5], g = state[6], h = state[7];
+
+    for (unsigned int i = 0; i < 64; i++) {
+        auto s1 = ror(e, 6) ^ ror(e, 11) ^ ror(e, 25);
+        auto ch = (e & f) ^ (~e & g);
+        auto t1 = h + s1 + ch + k[i] + w[i];
+        auto s0 = ror(a, 2) ^ ror(a, 13) ^ ror(a, 22);
+        auto maj = (a & b) ^ (a & c) ^ (b & c);
+        auto t2 = s0 + maj;
+
+        h = g;
+        g = f;
+        f = e;
+        e = d + t1;
+        d = c;
+        c = b;
+        b = a;
+        a = t1 + t2;
+    }
+
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+    state[4] += e;
+    state[5] += f;
+    state[6] += g;
+    state[7] += h;
+}
+
+void sha256::update(string_view sv) {
+    auto p = (const uint8_t*)sv.data();
+    auto len = sv.length();
+
+    total += len;
+
+    if (buf_len != 0) {
+        auto n = min(len, sizeof(buf) - buf_len);
+
+        memcpy(buf + buf_len, p, n);
+        buf_len += n;
+        p += n;
+        len -= n;
+
+        if (buf_len < sizeof(buf))
+            return;
+
+        transform(buf);
+        buf_len = 0;
+    }
+
+    while (len >= sizeof(buf)) {
+        transform(p);
+        p += sizeof(buf);
+        len -= sizeof(buf);
+    }
+
+    memcpy(buf, p, len);
+    buf_len = len;
+}
+
+array<uint8_t, 32> sha256::finish() {
+    auto bits = total * 8;
+
+    buf[buf_len++] = 0x80;
+
+    if (buf_len > 56) {
+        memset(buf + buf_len, 0, sizeof(buf) - buf_len);
+        transform(buf);
+        buf_len = 0;
+    }
+
+    memset(buf + buf_len, 0, 56 - buf_len);
+
+    for (unsigned int i = 0; i < 8; i++) {
+        buf[56 + i] = (uint8_t)(bits >> (56 - (i * 8)));
+    }
+
+    transform(buf);
+
+    array<uint8_t, 32> digest;
+
+    for (unsigned int i = 0; i < 8; i++) {
+        digest[i * 4] = (uint8_t)(state[i] >> 24);
+        digest[(i * 4) + 1] = (uint8_t)(state[i] >> 16);
+        digest[(i * 4) + 2] = (uint8_t)(state[i] >> 8);
+        digest[(i * 4) + 3] = (uint8_t)state[i];
+    }
+
+    return digest;
+}
+
+string sha256::finish_hex() {
+    static const char hex[] = "0123456789abcdef";
+    string s;
+
+    for (auto b : finish()) {
+        s += hex[b >> 4];
+        s += hex[b & 0xf];
+    }
+
+    return s;
+}
+
+string sha256_hex(string_view sv) {
+    sha256 h;
+
+    h.update(sv);
+
+    return h.finish_hex();
+}
@@ -0,0 +1,24 @@
+#pragma once
+
+#include <string>
+#include <array>
+#include <stdint.h>
+
+class sha256 {
+public:
+    sha256();
+
+    void update(std::string_view sv);
+    std::array<uint8_t, 32> finish();
+    std::string finish_hex();
+
+private:
+    void transform(const uint8_t* block);
+
+    uint32_t state[8];
+    uint8_t buf[64];
+    size_t buf_len = 0;
+    uint64_t total = 0;
+};
+
+std::string sha256_hex(std::string_view sv);
@@ -5,7 +5,15 @@
 #include "soap.h"
 #include "xml.h"
 #include "misc.h"
+#include "sha256.h"
 #include <iostream>
+#include <fstream>
+#include <sstream>
+#include <deque>
+#include <mutex>
+#include <utility>
+#include <thread>
+#include <future>
 
 using namespace std;
 
@@ -19,7 +27,413 @@ static const unordered_map<string, string> namespaces = {
     { "t", "http://schemas.microsoft.com/exchange/services/2006/types" }
 };
 
-static string extract_response(string_view ret);
+static mutex library_lock;
+static unsigned int library_refcount = 0;
+
+// The connection cache is shared by every handle, so that threads made for a
+// single request - prefetches, upload and export batches - can pick up a
+// connection that's already been through Negotiate, rather than opening their own.
+static CURLSH* shared_connections = nullptr;
+static mutex share_locks[CURL_LOCK_DATA_LAST];
+
+static void share_lock_cb(CURL*, curl_lock_data data, curl_lock_access, void*) {
+    share_locks[data].lock();
+}
+
+static void share_unlock_cb(CURL*, curl_lock_data data, void*) {
+    share_locks[data].unlock();
+}
+
+void acquire_libraries() {
+    lock_guard lg(library_lock);
+
+    if (library_refcount == 0) {
+        auto res = curl_global_init(CURL_GLOBAL_DEFAULT);
+
+        if (res != CURLE_OK)
+            throw formatted_error("curl_global_init failed: {}", curl_easy_strerror(res));
+
+        xmlInitParser();
+
+        shared_connections = curl_share_init();
+
+        if (shared_connections) {
+            curl_share_setopt(shared_connections, CURLSHOPT_LOCKFUNC, share_lock_cb);
+            curl_share_setopt(shared_connections, CURLSHOPT_UNLOCKFUNC, share_unlock_cb);
+            curl_share_setopt(shared_connections, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+            curl_share_setopt(shared_connections, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+        }
+    }
+
+    library_refcount++;
+}
+
+// We never call xmlCleanupParser: libxml2 may also be in use by something else
+// in the process, which it would pull the rug from under.
+void release_libraries() {
+    lock_guard lg(library_lock);
+
+    if (--library_refcount == 0) {
+        if (shared_connections) {
+            curl_share_cleanup(shared_connections);
+            shared_connections = nullptr;
+        }
+
+        curl_global_cleanup();
+    }
+}
+
+namespace {
+
+// Each thread keeps a cURL handle between requests, rather than setting up a new
+// one each time. The connections themselves are in shared_connections. The
+// handle has its own reference on the libraries, as it can outlive the prospect object.
+class curl_cache {
+public:
+    ~curl_cache() {
+        if (handle) {
+            curl_easy_cleanup(handle);
+            release_libraries();
+        }
+    }
+
+    CURL* handle = nullptr;
+    bool in_use = false;
+};
+
+thread_local curl_cache cached_curl;
+
+// Borrows the thread's cached handle. If that's already busy - a callback from
+// a streaming request making a request of its own - we use a temporary one.
+class curl_handle {
+public:
+    curl_handle() {
+        if (!cached_curl.in_use) {
+            if (!cached_curl.handle) {
+                acquire_libraries();
+
+                cached_curl.handle = curl_easy_init();
+
+                if (!cached_curl.handle) {
+                    release_libraries();
+                    throw formatted_error("Failed to initialize cURL.");
+                }
+            }
+
+            cached_curl.in_use = true;
+            cached = true;
+            curl = cached_curl.handle;
+        } else {
+            curl = curl_easy_init();
+
+            if (!curl)
+                throw formatted_error("Failed to initialize cURL.");
+        }
+
+        if (shared_connections)
+            curl_easy_setopt(curl, CURLOPT_SHARE, shared_connections);
+    }
+
+    ~curl_handle() {
+        if (cached) {
+            // forgets the options, but stays attached to the share
+            curl_easy_reset(curl);
+            cached_curl.in_use = false;
+        } else
+            curl_easy_cleanup(curl);
+
+        if (headers)
+            curl_slist_free_all(headers);
+    }
+
+    curl_handle(const curl_handle&) = delete;
+    curl_handle& operator=(const curl_handle&) = delete;
+
+    CURL* curl;
+    struct curl_slist* headers = nullptr;
+
+private:
+    bool cached = false;
+};
+
+}
+
+class recorder {
+public:
+    recorder(const filesystem::path& dir) : dir(dir) {
+        filesystem::create_directories(dir);
+
+        index.open(dir / "index", ios::binary | ios::trunc);
+
+        if (!index.good())
+            throw formatted_error("Could not open {}.", (dir / "index").string());
+    }
+
+    uint64_t reserve() {
+        return next_seq++;
+    }
+
+    filesystem::path response_path(uint64_t seq) const {
+        return dir / format("{:08}.resp", seq);
+    }
+
+    // the response is already on disk by now
+    void add(uint64_t seq, string_view key, string_view request, long status,
+             const vector<pair<chrono::microseconds, size_t>>& chunks) {
+        auto fn = dir / format("{:08}.req", seq);
+        ofstream f(fn, ios::binary | ios::trunc);
+
+        f.write(request.data(), (streamsize)request.length());
+
+        if (!f.good())
+            throw formatted_error("Error writing to {}.", fn.string());
+
+        auto line = format("{} {} {} {}", seq, key, status, chunks.size());
+
+        for (const auto& c : chunks) {
+            line += format(" {} {}", c.first.count(), c.second);
+        }
+
+        lock_guard lg(lock);
+
+        index << line << '\n';
+        index.flush();
+    }
+
+private:
+    filesystem::path dir;
+    mutex lock;
+    ofstream index;
+    atomic<uint64_t> next_seq = 0;
+};
+
+// A response being recorded, which goes to disk as it arrives rather than being
+// held in memory - a streaming request can go on for half an hour, and an
+// export can be gigabytes. It only makes it into the index once it's finished,
+// and is deleted if it never is, e.g. when it loses a race.
+class recording {
+public:
+    recording(shared_ptr<recorder> rec) : rec(move(rec)), seq(this->rec->reserve()), fn(this->rec->response_path(seq)),
+                                          started(chrono::steady_clock::now()) {
+        f.open(fn, ios::binary | ios::trunc);
+
+        if (!f.good())
+            throw formatted_error("Could not open {} for writing.", fn.string());
+    }
+
+    ~recording() {
+        if (finished)
+            return;
+
+        error_code ec;
+
+        f.close();
+        filesystem::remove(fn, ec);
+    }
+
+    recording(const recording&) = delete;
+    recording& operator=(const recording&) = delete;
+
+    void write(string_view sv) {
+        chunks.emplace_back(chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - started), sv.length());
+
+        f.write(sv.data(), (streamsize)sv.length());
+    }
+
+    void finish(string_view key, string_view request, long status) {
+        f.close();
+
+        if (!f.good())
+            throw formatted_error("Error writing to {}.", fn.string());
+
+        rec->add(seq, key, request, status, chunks);
+        finished = true;
+    }
+
+private:
+    shared_ptr<recorder> rec;
+    uint64_t seq;
+    filesystem::path fn;
+    ofstream f;
+    chrono::steady_clock::time_point started;
+    vector<pair<chrono::microseconds, size_t>> chunks;
+    bool finished = false;
+};
+
+class replayer {
+public:
+    // Everything is read in up front, so that the replay itself doesn't do
+    // any more I/O than the live run did.
+    replayer(const filesystem::path& dir, double latency_scale) : latency_scale(latency_scale) {
+        ifstream index(dir / "index", ios::binary);
+
+        if (!index.good())
+            throw formatted_error("Could not open {}.", (dir / "index").string());
+
+        string line;
+
+        while (getline(index, line)) {
+            istringstream ss(line);
+            uint64_t seq;
+            string key;
+            size_t num_chunks;
+            auto resp = make_shared<recorded_response>();
+
+            ss >> seq >> key >> resp->status >> num_chunks;
+
+            for (size_t i = 0; i < num_chunks; i++) {
+                int64_t us;
+                size_t len;
+
+                ss >> us >> len;
+                resp->chunks.emplace_back(chrono::microseconds{us}, len);
+            }
+
+            if (ss.fail())
+                throw formatted_error("Malformed line in {}: {}", (dir / "index").string(), line);
+
+            auto fn = dir / format("{:08}.resp", seq);
+            ifstream f(fn, ios::binary);
+
+            if (!f.good())
+                throw formatted_error("Could not open {}.", fn.string());
+
+            resp->data.assign(istreambuf_iterator<char>(f), istreambuf_iterator<char>());
+
+            responses[key].push_back(move(resp));
+        }
+    }
+
+    // Repeats of a request get the responses in the order they were recorded,
+    // and once we've run out, the last one again.
+    shared_ptr<const recorded_response> next(const string& key) {
+        lock_guard lg(lock);
+
+        auto it = responses.find(key);
+
+        if (it == responses.end())
+            throw formatted_error("No recorded response for request {}.", key);
+
+        auto& q = it->second;
+        auto resp = q.front();
+
+        if (q.size() > 1)
+            q.pop_front();
+
+        return resp;
+    }
+
+    double latency_scale;
+
+private:
+    mutex lock;
+    unordered_map<string, deque<shared_ptr<const recorded_response>>> responses;
+};
+
+static mutex transport_lock;
+static shared_ptr<recorder> active_recorder;
+static shared_ptr<replayer> active_replayer;
+
+void soap_record(const filesystem::path& dir) {
+    auto rec = make_shared<recorder>(dir);
+
+    lock_guard lg(transport_lock);
+
+    active_recorder = move(rec);
+    active_replayer.reset();
+}
+
+void soap_replay(const filesystem::path& dir, double latency_scale) {
+    auto rep = make_shared<replayer>(dir, latency_scale);
+
+    lock_guard lg(transport_lock);
+
+    active_replayer = move(rep);
+    active_recorder.reset();
+}
+
+void soap_live() {
+    lock_guard lg(transport_lock);
+
+    active_recorder.reset();
+    active_replayer.reset();
+}
+
+static string request_key(string_view url, string_view action, string_view payload) {
+    sha256 h;
+
+    h.update(url);
+    h.update("\n");
+    h.update(action);
+    h.update("\n");
+    h.update(payload);
+
+    return h.finish_hex();
+}
+
+// Takes a reference on whichever is active, so that switching mode can't pull
+// it out from under a request in progress.
+void soap::start_request(const string& url, const string& action) {
+    {
+        lock_guard lg(transport_lock);
+
+        rec = active_recorder;
+        rep = active_replayer;
+    }
+
+    if (rec || rep)
+        key = request_key(url, action, payload);
+
+    if (rec)
+        current_recording = make_unique<recording>(rec);
+    else
+        current_recording.reset();
+}
+
+void soap::finish_recording(long status) {
+    if (!current_recording)
+        return;
+
+    current_recording->finish(key, payload, status);
+    current_recording.reset();
+}
+
+// Serves a recorded response as if it were coming off the wire, to the stream
+// function if there is one and otherwise into ret.
+long soap::replay(bool stream) {
+    auto resp = rep->next(key);
+    auto start = chrono::steady_clock::now();
+    size_t off = 0;
+
+    for (const auto& [when, len] : resp->chunks) {
+        if (rep->latency_scale > 0) {
+            auto due = start + chrono::duration_cast<chrono::steady_clock::duration>(when * rep->latency_scale);
+
+            while (true) {
+                auto now = chrono::steady_clock::now();
+
+                if (now >= due || abort_requested)
+                    break;
+
+                this_thread::sleep_for(min(due - now, chrono::steady_clock::duration(chrono::milliseconds(100))));
+            }
+        }
+
+        if (abort_requested)
+            return 0;
+
+        auto chunk = string_view(resp->data).substr(off, len);
+
+        off += len;
+
+        if (stream)
+            write_stream_chunk(chunk);
+        else
+            ret.append(chunk);
+    }
+
+    return resp->status;
+}
 
 static size_t curl_read_cb(void* dest, size_t size, size_t nmemb, void* userdata) {
     auto& s = *(soap*)userdata;
@@ -35,17 +449,19 @@ static size_t curl_write_cb(char* ptr, size_t size, size_t nmemb, void* userdata
     return size * nmemb;
 }
 
-string soap::create_xml(string_view header, string_view body) {
-    string body2{body};
-    xml_writer req;
+soap::soap() : ret(request_resource()), payload(request_resource()) {
+}
 
-    if (body2.length() > 2 && body2[0] == '<' && body2[1] == '?') {
-        auto st = body2.find('>');
+soap::~soap() = default;
 
-        body2 = body2.substr(st + 1);
+void soap::create_xml(string_view header, string_view body) {
+    xml_writer req(payload.get_allocator().resource());
 
-        while (!body2.empty() && body2[0] == '\n') {
-            body2 = body2.substr(1);
+    if (body.length() > 2 && body[0] == '<' && body[1] == '?') {
+        body.remove_prefix(body.find('>') + 1);
+
+        while (!body.empty() && body[0] == '\n') {
+            body.remove_prefix(1);
         }
     }
 
@@ -57,12 +473,12 @@ string soap::create_xml(string_view header, string_view body) {
     req.end_element();
 
     req.start_element("soap:Body");
-    req.raw(body2);
+    req.raw(body);
     req.end_element();
 
     req.end_element();
 
-    return req.dump();
+    payload = req.dump();
 }
 
 static int curl_seek_cb(void* userdata, curl_off_t offset, int origin) {
@@ -170,77 +586,357 @@ static int trace(CURL*, curl_infotype type, char* data, size_t size) {
 }
 #endif
 
-string soap::get(const string& url, const string& action, const string& header, const string& body) {
-    string soap_action = "SOAPAction: " + action;
-
-    CURLcode res;
-    CURL* curl = curl_easy_init();
-
-    if (!curl)
-        throw formatted_error("Failed to initialize cURL.");
+static int curl_xferinfo_cb(void* userdata, curl_off_t, curl_off_t, curl_off_t, curl_off_t) {
+    auto& s = *(soap*)userdata;
 
-    payload = create_xml(header, body);
+    return s.aborted() ? 1 : 0;
+}
 
-    try {
-        struct curl_slist *chunk = NULL;
-        long error_code;
+// Sets up curl to POST payload to url, with the response going into ret.
+void soap::setup(CURL* curl, curl_slist*& headers, const string& url, const string& action) {
+    CURLcode res;
 
-        curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+    curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
 
 #ifdef DEBUG_CURL
-        curl_easy_setopt(curl, CURLOPT_DEBUGFUNCTION, trace);
-        curl_easy_setopt(curl, CURLOPT_VERBOSE, 1L);
+    curl_easy_setopt(curl, CURLOPT_DEBUGFUNCTION, trace);
+    curl_easy_setopt(curl, CURLOPT_VERBOSE, 1L);
 #endif
 
-        curl_easy_setopt(curl, CURLOPT_HTTPAUTH, CURLAUTH_NEGOTIATE);
-        curl_easy_setopt(curl, CURLOPT_USERPWD, ":");
+    curl_easy_setopt(curl, CURLOPT_HTTPAUTH, CURLAUTH_NEGOTIATE);
+    curl_easy_setopt(curl, CURLOPT_USERPWD, ":");
+
+    curl_easy_setopt(curl, CURLOPT_SSL_VERIFYPEER, 0);
+    curl_easy_setopt(curl, CURLOPT_SSL_VERIFYHOST, 0);
 
-        curl_easy_setopt(curl, CURLOPT_SSL_VERIFYPEER, 0);
-        curl_easy_setopt(curl, CURLOPT_SSL_VERIFYHOST, 0);
+    curl_easy_setopt(curl, CURLOPT_POST, 1L);
+    curl_easy_setopt(curl, CURLOPT_READFUNCTION, curl_read_cb);
+    curl_easy_setopt(curl, CURLOPT_READDATA, this);
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, curl_write_cb);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, this);
+    curl_easy_setopt(curl, CURLOPT_SEEKFUNCTION, curl_seek_cb);
+    curl_easy_setopt(curl, CURLOPT_SEEKDATA, this);
+    curl_easy_setopt(curl, CURLOPT_XFERINFOFUNCTION, curl_xferinfo_cb);
+    curl_easy_setopt(curl, CURLOPT_XFERINFODATA, this);
+    curl_easy_setopt(curl, CURLOPT_NOPROGRESS, 0L);
 
-        curl_easy_setopt(curl, CURLOPT_POST, 1L);
-        curl_easy_setopt(curl, CURLOPT_READFUNCTION, curl_read_cb);
-        curl_easy_setopt(curl, CURLOPT_READDATA, this);
-        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, curl_write_cb);
-        curl_easy_setopt(curl, CURLOPT_WRITEDATA, this);
-        curl_easy_setopt(curl, CURLOPT_SEEKFUNCTION, curl_seek_cb);
-        curl_easy_setopt(curl, CURLOPT_SEEKDATA, this);
+    curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE_LARGE, payload.length());
 
-        curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE_LARGE, payload.length());
+    headers = curl_slist_append(headers, "Content-Type: text/xml;charset=UTF-8");
+    res = curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
+    if (res != CURLE_OK)
+        throw formatted_error("curl_easy_setopt failed: {}", curl_easy_strerror(res));
 
-        chunk = curl_slist_append(chunk, "Content-Type: text/xml;charset=UTF-8");
-        res = curl_easy_setopt(curl, CURLOPT_HTTPHEADER, chunk);
+    if (!action.empty()) {
+        auto soap_action = "SOAPAction: " + action;
+
+        headers = curl_slist_append(headers, soap_action.c_str());
+        res = curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
         if (res != CURLE_OK)
             throw formatted_error("curl_easy_setopt failed: {}", curl_easy_strerror(res));
+    }
+}
+
+pmr::string soap::get(const string& url, const string& action, string_view header, string_view body) {
+    create_xml(header, body);
+
+    start_request(url, action);
+
+    if (rep) {
+        auto status = replay(false);
+
+        // as with the live path, rather than parse what we got before the abort
+        if (abort_requested)
+            throw formatted_error("Request aborted.");
+
+        if (status >= 400)
+            throw formatted_error("HTTP error {}", status);
+
+        return extract_response(ret, ret.get_allocator().resource());
+    }
+
+    CURLcode res;
+    curl_handle h;
+    CURL* curl = h.curl;
+    long error_code;
+
+    setup(curl, h.headers, url, action);
+
+    res = curl_easy_perform(curl);
+
+    if (res == CURLE_ABORTED_BY_CALLBACK && abort_requested)
+        throw formatted_error("Request aborted.");
+
+    if (res != CURLE_OK)
+        throw formatted_error("curl_easy_perform failed: {}", curl_easy_strerror(res));
+
+    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &error_code);
+
+    finish_recording(error_code);
+
+    if (error_code >= 400)
+        throw formatted_error("HTTP error {}", error_code);
+
+    return extract_response(ret, ret.get_allocator().resource());
+}
+
+namespace {
+
+// One of the requests in a race. Each has a handle of its own, so that the
+// losers can be dropped without disturbing anything else.
+class racer {
+public:
+    racer(const string& url) : url(url) {
+    }
 
-        if (!action.empty()) {
-            chunk = curl_slist_append(chunk, soap_action.c_str());
-            res = curl_easy_setopt(curl, CURLOPT_HTTPHEADER, chunk);
-            if (res != CURLE_OK)
-                throw formatted_error("curl_easy_setopt failed: {}", curl_easy_strerror(res));
+    ~racer() {
+        if (curl)
+            curl_easy_cleanup(curl);
+
+        if (headers)
+            curl_slist_free_all(headers);
+    }
+
+    racer(const racer&) = delete;
+    racer& operator=(const racer&) = delete;
+
+    string url;
+    soap s;
+    CURL* curl = nullptr;
+    curl_slist* headers = nullptr;
+};
+
+class multi_handle {
+public:
+    multi_handle() {
+        multi = curl_multi_init();
+
+        if (!multi)
+            throw formatted_error("Failed to initialize cURL.");
+    }
+
+    ~multi_handle() {
+        // removing a handle abandons its transfer
+        for (const auto& r : racers) {
+            if (r->curl)
+                curl_multi_remove_handle(multi, r->curl);
         }
 
-        res = curl_easy_perform(curl);
+        racers.clear();
 
-        if (res != CURLE_OK)
-            throw formatted_error("curl_easy_perform failed: {}", curl_easy_strerror(res));
+        curl_multi_cleanup(multi);
+    }
 
-        curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &error_code);
+    multi_handle(const multi_handle&) = delete;
+    multi_handle& operator=(const multi_handle&) = delete;
 
-        if (error_code >= 400)
-            throw formatted_error("HTTP error {}", error_code);
-    } catch (...) {
-        curl_easy_cleanup(curl);
-        throw;
+    CURLM* multi;
+    vector<unique_ptr<racer>> racers;
+};
+
+// Runs a lookup on a detached thread, which owns the function and the promise,
+// so that the race can return as soon as there's a winner without waiting for
+// a slow DNS server. The function mustn't refer to anything it doesn't own.
+future<vector<race_candidate>> start_lookup(function<vector<race_candidate>()> func) {
+    auto done = make_shared<promise<vector<race_candidate>>>();
+    auto result = done->get_future();
+
+    thread([done, func = move(func)]() {
+        try {
+            done->set_value(func());
+        } catch (...) {
+            done->set_exception(current_exception());
+        }
+    }).detach();
+
+    return result;
+}
+
+}
+
+// Sends the same request to all the candidates at once, and returns once accept
+// has been given a response it's happy with - it throws if it isn't. The other
+// requests are abandoned. If there's a lookup, it's run alongside, and any
+// candidates it finds join the race - e.g. from a DNS query. It isn't waited
+// for once there's a winner, so it has to own everything it uses. If nothing
+// has been accepted by the time the requests have all failed, or timeout has
+// passed, we throw.
+void soap::race(vector<race_candidate> candidates, function<vector<race_candidate>()> lookup, const string& action,
+                string_view body, const function<void(string_view)>& accept, chrono::milliseconds timeout) {
+    string errors;
+    bool replaying;
+
+    auto fail = [&](string_view url, string_view msg) {
+        if (!errors.empty())
+            errors += "; ";
+
+        errors += format("{}: {}", url, msg);
+    };
+
+    {
+        lock_guard lg(transport_lock);
+
+        replaying = !!active_replayer;
+    }
+
+    // Responses come in the order they were recorded in, so there's no race to
+    // be had. Going through the candidates in turn finds the one that won. The
+    // lookup is skipped, as it would go to the network, so a replay can't find
+    // a winner that only the lookup turned up.
+    if (replaying) {
+        for (const auto& c : candidates) {
+            try {
+                soap s;
+
+                accept(s.get(c.url, action, c.header, body));
+
+                return;
+            } catch (const exception& e) {
+                fail(c.url, e.what());
+            }
+        }
+
+        throw formatted_error("No usable response from any of {} endpoints ({}).", candidates.size(), errors);
+    }
+
+    future<vector<race_candidate>> late;
+
+    if (lookup)
+        late = start_lookup(move(lookup));
+
+    multi_handle m;
+    auto deadline = chrono::steady_clock::now() + timeout;
+
+    auto start = [&](const race_candidate& c) {
+        auto& r = *m.racers.emplace_back(make_unique<racer>(c.url));
+
+        r.s.create_xml(c.header, body);
+        r.s.start_request(c.url, action);
+
+        r.curl = curl_easy_init();
+
+        if (!r.curl)
+            throw formatted_error("Failed to initialize cURL.");
+
+        r.s.setup(r.curl, r.headers, c.url, action);
+        curl_easy_setopt(r.curl, CURLOPT_PRIVATE, &r);
+
+        auto mc = curl_multi_add_handle(m.multi, r.curl);
+
+        if (mc != CURLM_OK) {
+            curl_easy_cleanup(r.curl);
+            r.curl = nullptr;
+            throw formatted_error("curl_multi_add_handle failed: {}", curl_multi_strerror(mc));
+        }
+    };
+
+    for (const auto& c : candidates) {
+        start(c);
+    }
+
+    while (true) {
+        int running;
+        auto mc = curl_multi_perform(m.multi, &running);
+
+        if (mc != CURLM_OK)
+            throw formatted_error("curl_multi_perform failed: {}", curl_multi_strerror(mc));
+
+        CURLMsg* msg;
+        int queued;
+
+        while ((msg = curl_multi_info_read(m.multi, &queued))) {
+            if (msg->msg != CURLMSG_DONE)
+                continue;
+
+            char* priv;
+
+            curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, &priv);
+
+            auto& r = *(racer*)priv;
+
+            if (msg->data.result != CURLE_OK) {
+                fail(r.url, curl_easy_strerror(msg->data.result));
+                continue;
+            }
+
+            long status;
+
+            curl_easy_getinfo(r.curl, CURLINFO_RESPONSE_CODE, &status);
+
+            if (status >= 400) {
+                fail(r.url, format("HTTP error {}", status));
+                continue;
+            }
+
+            try {
+                accept(extract_response(r.s.ret, r.s.ret.get_allocator().resource()));
+            } catch (const exception& e) {
+                fail(r.url, e.what());
+                continue;
+            }
+
+            // only the winner gets recorded, as a replay only needs to find that
+            r.s.finish_recording(status);
+
+            return;
+        }
+
+        if (late.valid() && late.wait_for(chrono::seconds::zero()) == future_status::ready) {
+            // if the lookup failed, there's just nothing more to try
+            try {
+                for (const auto& c : late.get()) {
+                    start(c);
+                }
+            } catch (const exception& e) {
+                fail("lookup", e.what());
+            }
+
+            continue;
+        }
+
+        if (running == 0 && !late.valid())
+            break;
+
+        auto now = chrono::steady_clock::now();
+
+        if (now >= deadline) {
+            throw formatted_error("Timed out waiting for a usable response from any of {} endpoints{}.", m.racers.size(),
+                                  errors.empty() ? "" : " (" + errors + ")");
+        }
+
+        auto wait = chrono::duration_cast<chrono::milliseconds>(deadline - now);
+
+        // we can't be woken when late is ready, so have to keep checking
+        if (late.valid())
+            wait = min(wait, chrono::milliseconds(50));
+
+        curl_multi_poll(m.multi, nullptr, 0, (int)wait.count() + 1, nullptr);
     }
 
-    curl_easy_cleanup(curl);
+    throw formatted_error("No usable response from any of {} endpoints ({}).", m.racers.size(), errors);
+}
+
+// Exceptions mustn't go through cURL, which would leave the handle unusable, so
+// we stash them and rethrow once curl_easy_perform has returned.
+bool soap::write_stream(char* ptr, size_t size, size_t nmemb) {
+    if (current_recording)
+        current_recording->write(string_view(ptr, size * nmemb));
 
-    return extract_response(ret);
+    try {
+        write_stream_chunk(string_view(ptr, size * nmemb));
+    } catch (...) {
+        stream_error = current_exception();
+        return false;
+    }
+
+    return true;
 }
 
-void soap::write_stream(char* ptr, size_t size, size_t nmemb) {
-    auto sv = string_view(ptr, size * nmemb);
+void soap::write_stream_chunk(string_view sv) {
+    if (raw_stream) {
+        stream_func(sv);
+        return;
+    }
 
     while (!sv.empty() && sv[0] != '<') {
         sv.remove_prefix(1);
@@ -251,86 +947,80 @@ void soap::write_stream(char* ptr, size_t size, size_t nmemb) {
     }
 
     if (!sv.empty())
-        stream_func(extract_response(sv));
+        stream_func(extract_response(sv, ret.get_allocator().resource()));
 }
 
 static size_t curl_write_stream_cb(char* ptr, size_t size, size_t nmemb, void* userdata) {
     auto& s = *(soap*)userdata;
 
-    s.write_stream(ptr, size, nmemb);
+    if (!s.write_stream(ptr, size, nmemb))
+        return 0;
 
     return size * nmemb;
 }
 
-void soap::get_stream(const string& url, const string& action, const string& header, const string& body,
-                      const soap_stream_func& func) {
-    string soap_action = "SOAPAction: " + action;
-
-    CURLcode res;
-    CURL* curl = curl_easy_init();
-
-    if (!curl)
-        throw formatted_error("Failed to initialize cURL.");
-
-    payload = create_xml(header, body);
+// Makes a get_stream in progress on another thread return early, or a get
+// throw. cURL only checks about once a second while the connection is idle.
+void soap::abort() {
+    abort_requested = true;
+}
 
-    try {
-        struct curl_slist *chunk = NULL;
-        long error_code;
+bool soap::aborted() const {
+    return abort_requested;
+}
 
-        curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+void soap::get_stream(const string& url, const string& action, string_view header, string_view body,
+                      const soap_stream_func& func) {
+    create_xml(header, body);
+    stream_func = func;
 
-        curl_easy_setopt(curl, CURLOPT_HTTPAUTH, CURLAUTH_NEGOTIATE);
-        curl_easy_setopt(curl, CURLOPT_USERPWD, ":");
+    start_request(url, action);
 
-        curl_easy_setopt(curl, CURLOPT_SSL_VERIFYPEER, 0);
-        curl_easy_setopt(curl, CURLOPT_SSL_VERIFYHOST, 0);
+    if (rep) {
+        auto status = replay(true);
 
-        curl_easy_setopt(curl, CURLOPT_POST, 1L);
-        curl_easy_setopt(curl, CURLOPT_READFUNCTION, curl_read_cb);
-        curl_easy_setopt(curl, CURLOPT_READDATA, this);
+        if (status >= 400)
+            throw formatted_error("HTTP error {}", status);
 
-        stream_func = func;
+        return;
+    }
 
-        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, curl_write_stream_cb);
-        curl_easy_setopt(curl, CURLOPT_WRITEDATA, this);
+    CURLcode res;
+    curl_handle h;
+    CURL* curl = h.curl;
+    long error_code;
 
-        curl_easy_setopt(curl, CURLOPT_SEEKFUNCTION, curl_seek_cb);
-        curl_easy_setopt(curl, CURLOPT_SEEKDATA, this);
+    setup(curl, h.headers, url, action);
 
-        curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE_LARGE, payload.length());
+    // replace setup's write callback, so chunks go to stream_func rather than ret
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, curl_write_stream_cb);
 
-        chunk = curl_slist_append(chunk, "Content-Type: text/xml;charset=UTF-8");
-        res = curl_easy_setopt(curl, CURLOPT_HTTPHEADER, chunk);
-        if (res != CURLE_OK)
-            throw formatted_error("curl_easy_setopt failed: {}", curl_easy_strerror(res));
+    res = curl_easy_perform(curl);
 
-        if (!action.empty()) {
-            chunk = curl_slist_append(chunk, soap_action.c_str());
-            res = curl_easy_setopt(curl, CURLOPT_HTTPHEADER, chunk);
-            if (res != CURLE_OK)
-                throw formatted_error("curl_easy_setopt failed: {}", curl_easy_strerror(res));
-        }
+    if (stream_error)
+        rethrow_exception(exchange(stream_error, nullptr));
 
-        res = curl_easy_perform(curl);
+    if (res == CURLE_ABORTED_BY_CALLBACK && abort_requested) {
+        finish_recording(200);
+        return;
+    }
 
-        if (res != CURLE_OK)
-            throw formatted_error("curl_easy_perform failed: {}", curl_easy_strerror(res));
+    if (res != CURLE_OK)
+        throw formatted_error("curl_easy_perform failed: {}", curl_easy_strerror(res));
 
-        curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &error_code);
+    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &error_code);
 
-        if (error_code >= 400)
-            throw formatted_error("HTTP error {}", error_code);
-    } catch (...) {
-        curl_easy_cleanup(curl);
-        throw;
-    }
+    finish_recording(error_code);
 
-    curl_easy_cleanup(curl);
+    if (error_code >= 400)
+        throw formatted_error("HTTP error {}", error_code);
 }
 
 void soap::write(char* ptr, size_t size) {
-    ret += string(ptr, size);
+    if (current_recording)
+        current_recording->write(string_view(ptr, size));
+
+    ret.append(ptr, size);
 }
 
 size_t soap::read(void* ptr, size_t size) {
@@ -344,8 +1034,8 @@ size_t soap::read(void* ptr, size_t size) {
     return size;
 }
 
-static string extract_response(string_view ret) {
-    xmlDocPtr doc = xmlReadMemory(ret.data(), (int)ret.length(), nullptr, nullptr, 0);
+pmr::string extract_response(string_view ret, pmr::memory_resource* mr) {
+    xmlDocPtr doc = read_xml(ret);
 
     if (!doc)
         throw formatted_error("Invalid XML.");
@@ -386,9 +1076,10 @@ static string extract_response(string_view ret) {
                     throw;
                 }
 
-                auto s = string((char*)buf->content, buf->use);
+                auto s = pmr::string((char*)buf->content, buf->use, mr);
 
                 xmlBufferFree(buf);
+                xmlFreeDoc(doc);
 
                 return s;
             }
@@ -404,3 +1095,19 @@ static string extract_response(string_view ret) {
 
     xmlFreeDoc(doc);
 }
+
+// Like get_stream, but passes on the response exactly as it arrives, for callers
+// with their own incremental parser. The SOAP envelope is not removed.
+void soap::get_raw(const string& url, const string& action, string_view header, string_view body,
+                   const soap_stream_func& func) {
+    raw_stream = true;
+
+    try {
+        get_stream(url, action, header, body, func);
+    } catch (...) {
+        raw_stream = false;
+        throw;
+    }
+
+    raw_stream = false;
+}
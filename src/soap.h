@@ -2,24 +2,83 @@
 
 #include <string>
 #include <functional>
+#include <atomic>
+#include <exception>
+#include <chrono>
+#include <vector>
+#include <memory>
+#include <filesystem>
+#include <memory_resource>
 
 using soap_stream_func = std::function<void(std::string_view)>;
 
+// Process-wide initialization of libcurl and libxml2, reference-counted so that
+// any number of prospect objects can come and go on any thread.
+void acquire_libraries();
+void release_libraries();
+
+// returns the contents of the soap:Body of an envelope
+std::pmr::string extract_response(std::string_view ret, std::pmr::memory_resource* mr = std::pmr::get_default_resource());
+
+// behind prospect::record_transport, replay_transport and live_transport
+void soap_record(const std::filesystem::path& dir);
+void soap_replay(const std::filesystem::path& dir, double latency_scale);
+void soap_live();
+
+struct recorded_response {
+    long status;
+    std::vector<std::pair<std::chrono::microseconds, size_t>> chunks; // when each arrived, and its length
+    std::string data;
+};
+
+class recorder;
+class recording;
+class replayer;
+
+// an endpoint for soap::race, with the header to send to it
+struct race_candidate {
+    std::string url;
+    std::string header;
+};
+
+// Buffers for the request and response come from the thread's request resource.
 class soap {
 public:
-    std::string get(const std::string& url, const std::string& action, const std::string& header, const std::string& body);
-    void get_stream(const std::string& url, const std::string& action, const std::string& header, const std::string& body,
+    soap();
+    ~soap();
+
+    std::pmr::string get(const std::string& url, const std::string& action, std::string_view header, std::string_view body);
+    void get_stream(const std::string& url, const std::string& action, std::string_view header, std::string_view body,
                     const soap_stream_func& func);
+    void get_raw(const std::string& url, const std::string& action, std::string_view header, std::string_view body,
+                 const soap_stream_func& func);
+    static void race(std::vector<race_candidate> candidates, std::function<std::vector<race_candidate>()> lookup,
+                     const std::string& action, std::string_view body, const std::function<void(std::string_view)>& accept,
+                     std::chrono::milliseconds timeout);
     void write(char* ptr, size_t size);
     size_t read(void* ptr, size_t size);
     int seek(curl_off_t offset, int origin);
-    void write_stream(char* ptr, size_t size, size_t nmemb);
+    bool write_stream(char* ptr, size_t size, size_t nmemb);
+    void abort();
+    bool aborted() const;
 
 private:
-    std::string create_xml(std::string_view header, std::string_view body);
+    void create_xml(std::string_view header, std::string_view body);
+    void setup(CURL* curl, curl_slist*& headers, const std::string& url, const std::string& action);
+    void write_stream_chunk(std::string_view sv);
+    void start_request(const std::string& url, const std::string& action);
+    void finish_recording(long status);
+    long replay(bool stream);
 
-    std::string ret;
-    std::string payload;
+    std::pmr::string ret;
+    std::pmr::string payload;
     size_t payload_offset = 0;
     soap_stream_func stream_func;
+    bool raw_stream = false;
+    std::atomic<bool> abort_requested = false;
+    std::exception_ptr stream_error;
+    std::shared_ptr<recorder> rec;
+    std::shared_ptr<replayer> rep;
+    std::string key;
+    std::unique_ptr<recording> current_recording;
 };
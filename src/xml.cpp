@@ -2,10 +2,24 @@
 #include "misc.h"
 #include <stdexcept>
 #include <string.h>
+#include <utility>
 
 using namespace std;
 
-string xml_writer::dump() const {
+static thread_local pmr::memory_resource* current_resource = nullptr;
+
+pmr::memory_resource* request_resource() {
+    return current_resource ? current_resource : pmr::get_default_resource();
+}
+
+pmr::memory_resource* set_request_resource(pmr::memory_resource* mr) {
+    return exchange(current_resource, mr);
+}
+
+xml_writer::xml_writer(pmr::memory_resource* mr) : buf(mr), tag_names(mr), atts(mr) {
+}
+
+string_view xml_writer::dump() const {
     return buf;
 }
 
@@ -13,63 +27,54 @@ void xml_writer::start_document() {
     buf = "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n";
 }
 
-string xml_writer::escape(string_view s, bool att) {
-    bool need_escape = false;
+// appends straight to buf, rather than making a temporary string
+void xml_writer::escape(string_view s, bool att) {
+    while (!s.empty()) {
+        auto pos = s.find_first_of(att ? "<>&\"" : "<>&");
 
-    for (auto c : s) {
-        if (c == '<' || c == '>' || c == '&' || (att && c == '"')) {
-            need_escape = true;
-            break;
-        }
-    }
+        buf += s.substr(0, pos);
 
-    if (!need_escape)
-        return string(s);
-
-    string ret;
-
-    ret.reserve(s.length());
+        if (pos == string_view::npos)
+            break;
 
-    for (auto c : s) {
-        switch (c) {
+        switch (s[pos]) {
             case '<':
-                ret += "&lt;";
+                buf += "&lt;";
                 break;
 
             case '>':
-                ret += "&gt;";
+                buf += "&gt;";
                 break;
 
             case '&':
-                ret += "&amp;";
+                buf += "&amp;";
                 break;
 
             case '"':
-                if (att) {
-                    ret += "&quot;";
-                    break;
-                }
-                [[fallthrough]];
-
-            default:
-                ret += c;
+                buf += "&quot;";
+                break;
         }
-    }
 
-    return ret;
+        s.remove_prefix(pos + 1);
+    }
 }
 
 void xml_writer::flush_tag() {
-    buf += "<" + tag_names.top();
+    buf += '<';
+    buf += tag_names.back();
 
     for (const auto& att : atts) {
-        buf += " " + escape(att.first, false) + "=\"" + escape(att.second, true) + "\"";
+        buf += ' ';
+        escape(att.first, false);
+        buf += "=\"";
+        escape(att.second, true);
+        buf += '"';
     }
 
     if (empty_tag)
         buf += " />";
     else
-        buf += ">";
+        buf += '>';
 
     unflushed = false;
     atts.clear();
@@ -81,12 +86,15 @@ void xml_writer::start_element(string_view tag, const unordered_map<string, stri
         flush_tag();
     }
 
-    tag_names.push(string(tag));
+    tag_names.emplace_back(tag);
     unflushed = true;
     empty_tag = true;
 
     for (const auto& ns : namespaces) {
-        atts.emplace(ns.first.empty() ? "xmlns" : ("xmlns:" + ns.first), ns.second);
+        if (ns.first.empty())
+            attribute("xmlns", ns.second);
+        else
+            attribute("xmlns:" + ns.first, ns.second);
     }
 }
 
@@ -100,10 +108,13 @@ void xml_writer::end_element() {
         flush_tag();
     }
 
-    if (need_end)
-        buf += "</" + tag_names.top() + ">";
+    if (need_end) {
+        buf += "</";
+        buf += tag_names.back();
+        buf += '>';
+    }
 
-    tag_names.pop();
+    tag_names.pop_back();
 }
 
 void xml_writer::text(string_view s) {
@@ -112,11 +123,17 @@ void xml_writer::text(string_view s) {
         flush_tag();
     }
 
-    buf += escape(s, false);
+    escape(s, false);
 }
 
+// The first value given for an attribute wins.
 void xml_writer::attribute(string_view name, string_view value) {
-    atts.emplace(name, value);
+    for (const auto& att : atts) {
+        if (att.first == name)
+            return;
+    }
+
+    atts.emplace_back(name, value);
 }
 
 void xml_writer::raw(string_view s) {
@@ -211,3 +228,45 @@ string get_prop(xmlNodePtr n, const string& name) noexcept {
 
     return ret;
 }
+
+namespace {
+
+// Each thread keeps its parser context, rather than building a new one for
+// every response. Its dictionary of names only ever grows, so we start afresh
+// every so often.
+class parser_cache {
+public:
+    ~parser_cache() {
+        if (ctxt)
+            xmlFreeParserCtxt(ctxt);
+    }
+
+    xmlParserCtxtPtr ctxt = nullptr;
+    unsigned int uses = 0;
+};
+
+thread_local parser_cache cached_parser;
+
+}
+
+xmlDocPtr read_xml(string_view s) {
+    static const unsigned int max_uses = 1000;
+
+    if (cached_parser.ctxt && cached_parser.uses >= max_uses) {
+        xmlFreeParserCtxt(cached_parser.ctxt);
+        cached_parser.ctxt = nullptr;
+    }
+
+    if (!cached_parser.ctxt) {
+        cached_parser.ctxt = xmlNewParserCtxt();
+
+        if (!cached_parser.ctxt)
+            throw formatted_error("xmlNewParserCtxt failed.");
+
+        cached_parser.uses = 0;
+    }
+
+    cached_parser.uses++;
+
+    return xmlCtxtReadMemory(cached_parser.ctxt, s.data(), (int)s.length(), nullptr, nullptr, XML_PARSE_NODICT);
+}
@@ -3,12 +3,22 @@
 #include <string>
 #include <unordered_map>
 #include <functional>
-#include <stack>
+#include <vector>
+#include <memory_resource>
 #include <libxml/tree.h>
+#include <libxml/parser.h>
+
+// The resource that per-request buffers come from on this thread, as set by
+// prospect::scoped_resource. set_request_resource returns the previous one,
+// and nullptr means the default resource.
+std::pmr::memory_resource* request_resource();
+std::pmr::memory_resource* set_request_resource(std::pmr::memory_resource* mr);
 
 class xml_writer {
 public:
-    std::string dump() const;
+    xml_writer(std::pmr::memory_resource* mr = request_resource());
+
+    std::string_view dump() const;
     void start_document();
     void start_element(std::string_view tag, const std::unordered_map<std::string, std::string>& namespaces = {});
     void end_element();
@@ -25,12 +35,12 @@ public:
 
 private:
     void flush_tag();
-    std::string escape(std::string_view s, bool att);
+    void escape(std::string_view s, bool att);
 
-    std::string buf;
+    std::pmr::string buf;
     bool unflushed = false;
-    std::stack<std::string> tag_names;
-    std::unordered_map<std::string, std::string> atts;
+    std::pmr::vector<std::pmr::string> tag_names;
+    std::pmr::vector<std::pair<std::pmr::string, std::pmr::string>> atts;
     bool empty_tag;
 };
 
@@ -39,3 +49,4 @@ void find_tags(xmlNodePtr n, const std::string& ns, const std::string& tag, cons
 std::string find_tag_prop(xmlNodePtr root, const std::string& ns, const std::string& tag_name, const std::string& prop_name) noexcept;
 std::string get_prop(xmlNodePtr n, const std::string& name) noexcept;
 std::string find_tag_content(xmlNodePtr root, const std::string& ns, const std::string& name) noexcept;
+xmlDocPtr read_xml(std::string_view s);